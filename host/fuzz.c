@@ -0,0 +1,86 @@
+// Fuzz harness for the image ingestion path, built with Doorbell.c included so the file checks can be called directly
+// FUZZ_FILE: check_file, then the PNG decode (rle_build) or scene compile, as for a file from the server, a peer, upload or SD
+// FUZZ_DELTA: delta_apply against the embedded icon as the cached file, then the same checks on the result
+// Built with clang -fsanitize=fuzzer for libFuzzer. Otherwise main runs each file named (or stdin), for AFL (@@) or a corpus check.
+
+#include "host.h"
+#include "Doorbell.c"
+
+int
+LLVMFuzzerTestOneInput (const uint8_t * data, size_t size)
+{
+   host_quiet = 1;
+   file_t i = {.url = "fuzz" };
+#ifdef	FUZZ_DELTA
+   extern const uint8_t base_start[] asm ("_binary_apple_touch_icon_png_start");
+   extern const uint8_t base_end[] asm ("_binary_apple_touch_icon_png_end");
+   file_t base = {.url = "base",.data = (uint8_t *) base_start,.size = base_end - base_start };
+   base.crc = esp_rom_crc32_le (0, base.data, base.size);
+   if (size < 8 || size > IMAGEMAX)
+      return 0;
+   uint8_t *d = malloc (size);
+   memcpy (d, data, size);
+   for (int n = 0; n < 4; n++)
+      d[4 + n] = base.crc >> (n * 8);   // Always from the cached file, so the ops get tried
+   int32_t len = 0;
+   i.data = delta_apply (&base, d, size, &len);
+   i.size = len;
+   free (d);
+   if (!i.data)
+      return 0;
+#else
+   if (!size || size > IMAGEMAX)
+      return 0;
+   if (!(i.data = mem_alloc (MEM_CACHE, size)))
+      return 0;
+   memcpy (i.data, data, size);
+   i.size = size;
+#endif
+   check_file (&i);
+   if (i.data)
+   {
+      if (i.json)
+         scene_compile (&i);
+      else
+         rle_build (&i, DITHER_NONE);
+   }
+   scene_free (&i);
+   mem_free (MEM_CACHE, i.rle);
+   mem_free (MEM_CACHE, i.data);
+   return 0;
+}
+
+#ifndef	LIBFUZZER
+int
+main (int argc, char *argv[])
+{                               // Run each file, or stdin
+   int run (FILE * f)
+   {
+      char *buf = NULL;
+      size_t len = 0;
+      FILE *o = open_memstream (&buf, &len);
+      char b[4096];
+      size_t l;
+      while ((l = fread (b, 1, sizeof (b), f)) > 0)
+         fwrite (b, 1, l, o);
+      fclose (o);
+      LLVMFuzzerTestOneInput ((uint8_t *) buf, len);
+      free (buf);
+      return 0;
+   }
+   if (argc < 2)
+      return run (stdin);
+   for (int a = 1; a < argc; a++)
+   {
+      FILE *f = fopen (argv[a], "r");
+      if (!f)
+      {
+         perror (argv[a]);
+         return 1;
+      }
+      run (f);
+      fclose (f);
+   }
+   return 0;
+}
+#endif
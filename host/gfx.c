@@ -0,0 +1,301 @@
+// Host stand-in for the ESP32-GFX component, an 800x480 1 bit panel in memory, with a red plane on red builds
+// Text is drawn in a made up block font, it only needs to be repeatable, not readable
+// A panel update starts at gfx_unlock when anything changed, and takes modelled time, gfx_lock waits for it as on the device
+
+#include "host.h"
+#include "esp_rom_crc.h"
+
+#define	RAW_W	800
+#define	RAW_H	480
+#define	STRIDE	((RAW_W+7)/8)
+
+host_gfx_t host_gfx = { 0 };
+
+uint32_t host_gfx_full_ms = 3000;       // Typical 7.5" panel
+uint32_t host_gfx_partial_ms = 600;
+void (*host_gfx_hook) (void) = NULL;
+
+static uint8_t plane_b[STRIDE * RAW_H];
+#ifdef	CONFIG_GFX_BUILD_SUFFIX_EPD75R
+static uint8_t plane_r[STRIDE * RAW_H];
+#endif
+static uint8_t flip,
+  invert,
+  started,
+  changed,
+  full = 1;                     // Next update is full, the first is
+static uint32_t fg = 0,
+   bg = 0xFFFFFF;
+static gfx_pos_t px,
+  py;
+static gfx_align_t pa;
+
+const char *
+gfx_init_opts (gfx_init_t o)
+{
+   flip = o.flip;
+   invert = o.invert;
+   started = 1;
+   memset (plane_b, invert ? 0xFF : 0, sizeof (plane_b));       // White
+#ifdef	CONFIG_GFX_BUILD_SUFFIX_EPD75R
+   memset (plane_r, 0, sizeof (plane_r));
+#endif
+   return NULL;
+}
+
+void
+gfx_lock (void)
+{                               // Wait for panel update to finish
+   if (sim_now < host_gfx.done)
+      sim_wait (host_gfx.done - sim_now);
+}
+
+void
+gfx_unlock (void)
+{
+   if (!changed)
+      return;
+   host_gfx.updates++;
+   if (full)
+      host_gfx.full++;
+   host_gfx.done = sim_now + 1000LL * (full ? host_gfx_full_ms : host_gfx_partial_ms);
+   host_gfx.crc = host_gfx_crc ();
+   changed = 0;
+   full = 0;
+   if (host_gfx_hook)
+      host_gfx_hook ();
+}
+
+void
+gfx_refresh (void)
+{
+   full = 1;
+   changed = 1;
+}
+
+void
+gfx_changed (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h)
+{                               // Frame buffer written directly, the whole panel is sent anyway
+   changed = 1;
+}
+
+uint32_t
+host_gfx_crc (void)
+{
+   uint32_t crc = esp_rom_crc32_le (0, plane_b, sizeof (plane_b));
+#ifdef	CONFIG_GFX_BUILD_SUFFIX_EPD75R
+   crc = esp_rom_crc32_le (crc, plane_r, sizeof (plane_r));
+#endif
+   return crc;
+}
+
+gfx_pos_t
+gfx_width (void)
+{
+   return flip & 4 ? RAW_H : RAW_W;
+}
+
+gfx_pos_t
+gfx_height (void)
+{
+   return flip & 4 ? RAW_W : RAW_H;
+}
+
+uint32_t
+gfx_raw_w (void)
+{
+   return RAW_W;
+}
+
+uint32_t
+gfx_raw_h (void)
+{
+   return RAW_H;
+}
+
+uint8_t *
+gfx_raw_b (void)
+{
+   return started ? plane_b : NULL;
+}
+
+uint8_t *
+gfx_raw_r (void)
+{
+#ifdef	CONFIG_GFX_BUILD_SUFFIX_EPD75R
+   return started ? plane_r : NULL;
+#else
+   return NULL;
+#endif
+}
+
+uint8_t
+gfx_bpp (void)
+{
+   return 1;
+}
+
+void
+gfx_foreground (uint32_t rgb)
+{
+   fg = rgb;
+}
+
+void
+gfx_background (uint32_t rgb)
+{
+   bg = rgb;
+}
+
+uint32_t
+gfx_f (void)
+{
+   return fg;
+}
+
+uint32_t
+gfx_b (void)
+{
+   return bg;
+}
+
+static void
+setbit (uint8_t * plane, uint32_t o, uint8_t m, int on)
+{
+   if (!!(plane[o] & m) == !!on)
+      return;
+   plane[o] ^= m;
+   changed = 1;
+}
+
+void
+gfx_pixel (gfx_pos_t x, gfx_pos_t y, gfx_intensity_t i)
+{
+   if (!started || x < 0 || y < 0 || x >= gfx_width () || y >= gfx_height ())
+      return;
+   int32_t rx = x,
+      ry = y;
+   if (flip & 4)
+   {
+      rx = y;
+      ry = x;
+   }
+   if (flip & 1)
+      rx = RAW_W - 1 - rx;
+   if (flip & 2)
+      ry = RAW_H - 1 - ry;
+   uint32_t c = (i & 0x80 ? fg : bg),
+      r = (c >> 16) & 0xFF,
+      g = (c >> 8) & 0xFF,
+      b = c & 0xFF;
+   uint32_t o = ry * STRIDE + rx / 8;
+   uint8_t m = 0x80 >> (rx & 7);
+#ifdef	CONFIG_GFX_BUILD_SUFFIX_EPD75R
+   if (r >= 128 && g < 128 && b < 128)
+   {                            // Red, and not black
+      setbit (plane_r, o, m, 1);
+      setbit (plane_b, o, m, invert);
+      return;
+   }
+   setbit (plane_r, o, m, 0);
+#endif
+   setbit (plane_b, o, m, (r + g + b < 384) ^ invert);
+}
+
+void
+gfx_clear (gfx_intensity_t i)
+{
+   for (gfx_pos_t y = 0; y < gfx_height (); y++)
+      for (gfx_pos_t x = 0; x < gfx_width (); x++)
+         gfx_pixel (x, y, i);
+}
+
+void
+gfx_pos (gfx_pos_t x, gfx_pos_t y, gfx_align_t a)
+{
+   px = x;
+   py = y;
+   pa = a;
+}
+
+void
+gfx_draw (gfx_pos_t w, gfx_pos_t h, gfx_pos_t wm, gfx_pos_t hm, gfx_pos_t * xp, gfx_pos_t * yp)
+{                               // Place a w by h box at the position, and move on past it if H or V
+   uint8_t ha = (pa & GFX_C),
+      va = (pa & GFX_M);
+   gfx_pos_t x = (ha == GFX_R ? px + 1 - w : ha == GFX_C ? px - w / 2 : px),
+      y = (va == GFX_B ? py + 1 - h : va == GFX_M ? py - h / 2 : py);
+   if (xp)
+      *xp = x;
+   if (yp)
+      *yp = y;
+   if (pa & GFX_H)
+      px += (ha == GFX_R ? -(w + wm) : w + wm);
+   if (pa & GFX_V)
+      py += (va == GFX_B ? -(h + hm) : h + hm);
+}
+
+static void
+glyph (char c, gfx_pos_t x, gfx_pos_t y, int s)
+{                               // 5x7 block pattern from the character, in a 6x8 cell
+   if (c == ' ')
+      return;
+   uint32_t bits = (uint8_t) c * 2654435761U;
+   bits ^= bits >> 15;
+   bits |= 1;                   // Never empty
+   for (int cy = 0; cy < 7; cy++)
+      for (int cx = 0; cx < 5; cx++)
+         if ((bits >> ((cy * 5 + cx) % 32)) & 1)
+            for (int dy = 0; dy < s; dy++)
+               for (int dx = 0; dx < s; dx++)
+                  gfx_pixel (x + cx * s + dx, y + cy * s + dy, 255);
+}
+
+static void
+text (const char *t, int len, int s)
+{                               // One line at the position
+   gfx_pos_t x,
+     y;
+   gfx_draw (len * 6 * s, 8 * s, 0, 0, &x, &y);
+   for (int n = 0; n < len; n++)
+      glyph (t[n], x + n * 6 * s, y, s);
+}
+
+void
+gfx_message (const char *m)
+{                               // Lines separated by /, [n] sets size, centred from the top of the display
+   int s = 2;
+   gfx_pos (gfx_width () / 2, 0, GFX_C | GFX_T | GFX_V);
+   while (m && *m)
+   {
+      if (*m == '[' && isdigit ((int) (unsigned char) m[1]))
+      {
+         s = atoi (m + 1);
+         while (*m && *m != ']')
+            m++;
+         if (*m)
+            m++;
+         continue;
+      }
+      const char *e = strchr (m, '/');
+      int l = (e ? e - m : strlen (m));
+      text (m, l, s ? : 1);
+      m += l;
+      if (*m)
+         m++;
+   }
+}
+
+void
+gfx_7seg (gfx_align_t a, int s, const char *fmt, ...)
+{
+   char *v = NULL;
+   va_list ap;
+   va_start (ap, fmt);
+   if (vasprintf (&v, fmt, ap) < 0)
+      v = NULL;
+   va_end (ap);
+   if (v)
+      text (v, strlen (v), s);
+   free (v);
+}
@@ -0,0 +1,59 @@
+// Host build, shared by the stand-ins and the programs that drive them
+#pragma once
+#include "revk.h"
+#include "gfx.h"
+
+#define	SIM_NEVER	INT64_MAX
+
+// Virtual clock and tasks (sim.c), tasks take turns and only give way when they wait, so a run is repeatable
+extern int64_t sim_now;         // Virtual time (us)
+extern time_t sim_epoch;        // Wall clock at virtual time 0
+extern int host_quiet;          // No ESP_LOG output
+void sim_run (void);            // Run tasks until sim_stop, or all are waiting for ever
+void sim_stop (void);
+void sim_wait (int64_t us);     // Calling task waits, or the clock just moves if not in a task
+TaskHandle_t sim_task (const char *name, TaskFunction_t fn, void *arg);
+const char *sim_task_name (TaskHandle_t t);
+void sim_tasks (jo_t j);        // Add per task wake ups to report
+
+typedef struct
+{                               // CPU time accounting, for the duty cycle report
+   int64_t awake_us;            // Time with a task running or about to run, or idle too briefly to sleep
+   int64_t sleep_us;            // Time that could be in light sleep
+   uint32_t wakeups;            // Times the CPU came out of idle
+   uint8_t light_sleep:1;       // esp_pm_configure enabled light sleep
+} sim_cpu_t;
+extern sim_cpu_t sim_cpu;
+
+// GPIO (hw.c)
+void host_button (int pressed);
+extern uint32_t host_led_refresh;       // LED strip updates
+extern uint32_t host_led_rgb[];         // LED colours as last sent
+
+// HTTP (http.c)
+extern const char *host_images; // Directory served for imageurl
+extern int64_t host_offline;    // Image server unreachable until this virtual time
+extern uint32_t host_fetch_ms;  // Modelled time for each image server request
+int host_request (httpd_method_t method, const char *uri, const char *auth, const void *body, size_t len, char **reply,
+                  size_t *replylen);
+
+// MQTT and settings (revk.c)
+extern int64_t host_mqtt_offline;       // MQTT sends fail until this virtual time
+extern char host_season;        // Season letter, 0 for none
+extern app_callback_t *host_app_callback;
+extern void (*host_mqtt_hook) (const char *topic, const char *payload);
+const char *host_setting (const char *name, const char *value);
+
+// Display (gfx.c)
+typedef struct
+{
+   uint32_t updates;            // Panel updates
+   uint32_t full;               // Of which full refresh
+   uint32_t crc;                // CRC of planes last sent to panel
+   int64_t done;                // Virtual time last update finishes
+} host_gfx_t;
+extern host_gfx_t host_gfx;
+extern uint32_t host_gfx_full_ms;       // Modelled panel update times
+extern uint32_t host_gfx_partial_ms;
+extern void (*host_gfx_hook) (void);    // Called after each panel update
+uint32_t host_gfx_crc (void);   // CRC of planes as drawn now
@@ -0,0 +1,376 @@
+// Host stand-ins for the HTTP client and server
+// The client answers from files in host_images (the URL path under it), after a modelled delay.
+// The server keeps the registered handlers, and host_request runs one in the calling task, as the httpd task would.
+
+#include "host.h"
+#include "esp_http_client.h"
+
+const char *host_images = NULL;
+int64_t host_offline = 0;
+uint32_t host_fetch_ms = 150;
+
+// Client
+
+struct esp_http_client_s
+{
+   char *url;
+   uint8_t *data;
+   size_t len,
+     pos;
+   int status;
+};
+
+esp_http_client_handle_t
+esp_http_client_init (const esp_http_client_config_t * config)
+{
+   esp_http_client_handle_t c = calloc (1, sizeof (*c));
+   c->url = strdup (config->url);
+   return c;
+}
+
+esp_err_t
+esp_http_client_set_header (esp_http_client_handle_t c, const char *key, const char *value)
+{
+   return ESP_OK;
+}
+
+esp_err_t
+esp_http_client_open (esp_http_client_handle_t c, int write_len)
+{
+   sim_wait (host_fetch_ms * 1000LL);
+   if (sim_now < host_offline)
+      return ESP_ERR_TIMEOUT;
+   const char *path = strstr (c->url, "://");
+   path = (path ? strchr (path + 3, '/') : NULL);
+   c->status = 404;
+   if (!host_images || !path || strstr (path, ".."))
+      return ESP_OK;
+   char *fn = NULL;
+   if (asprintf (&fn, "%s%s", host_images, path) < 0)
+      return ESP_ERR_NO_MEM;
+   FILE *f = fopen (fn, "r");
+   free (fn);
+   if (!f)
+      return ESP_OK;
+   size_t size = 0;
+   FILE *o = open_memstream ((char **) &c->data, &size);
+   char buf[4096];
+   size_t l;
+   while ((l = fread (buf, 1, sizeof (buf), f)) > 0)
+      fwrite (buf, 1, l, o);
+   fclose (o);
+   fclose (f);
+   c->len = size;
+   c->status = 200;
+   return ESP_OK;
+}
+
+int64_t
+esp_http_client_fetch_headers (esp_http_client_handle_t c)
+{
+   return c->status == 200 ? c->len : 0;
+}
+
+int
+esp_http_client_get_status_code (esp_http_client_handle_t c)
+{
+   return c->status;
+}
+
+int
+esp_http_client_read (esp_http_client_handle_t c, char *buf, int len)
+{
+   if (c->status != 200)
+      return 0;
+   if (len > c->len - c->pos)
+      len = c->len - c->pos;
+   memcpy (buf, c->data + c->pos, len);
+   c->pos += len;
+   return len;
+}
+
+int
+esp_http_client_read_response (esp_http_client_handle_t c, char *buf, int len)
+{
+   return esp_http_client_read (c, buf, len);
+}
+
+esp_err_t
+esp_http_client_close (esp_http_client_handle_t c)
+{
+   return ESP_OK;
+}
+
+esp_err_t
+esp_http_client_cleanup (esp_http_client_handle_t c)
+{
+   free (c->url);
+   free (c->data);
+   free (c);
+   return ESP_OK;
+}
+
+// Server
+
+typedef struct
+{                               // Request state, shared by the request and its async copy
+   const char *auth;
+   const uint8_t *body;
+   size_t len,
+     pos;
+   FILE *o;
+   char *out;
+   size_t outlen;
+   char status[50];
+   uint8_t sent:1;              // Response started
+   uint8_t ended:1;             // Response complete
+   uint8_t async:1;             // Handed off
+   uint8_t done:1;              // Async complete
+   TaskHandle_t waiter;
+} host_req_t;
+
+static httpd_uri_t *handlers = NULL;
+static int handler_count = 0,
+   handler_max = 0;
+static httpd_uri_match_func_t match_fn = NULL;
+
+bool
+httpd_uri_match_wildcard (const char *reference_uri, const char *uri_to_match, size_t match_upto)
+{
+   size_t l = strlen (reference_uri);
+   if (l && reference_uri[l - 1] == '*')
+      return match_upto >= l - 1 && !strncmp (reference_uri, uri_to_match, l - 1);
+   return l == match_upto && !strncmp (reference_uri, uri_to_match, l);
+}
+
+esp_err_t
+httpd_start (httpd_handle_t * handle, const httpd_config_t * config)
+{
+   handler_max = config->max_uri_handlers;
+   handlers = calloc (handler_max, sizeof (*handlers));
+   match_fn = config->uri_match_fn;
+   *handle = &handlers;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_register_uri_handler (httpd_handle_t handle, const httpd_uri_t * uri)
+{
+   if (handler_count >= handler_max)
+   {
+      ESP_LOGE ("httpd", "No slots left for %s", uri->uri);
+      return ESP_FAIL;
+   }
+   handlers[handler_count] = *uri;
+   handlers[handler_count].uri = strdup (uri->uri);
+   handler_count++;
+   return ESP_OK;
+}
+
+static host_req_t *
+state (httpd_req_t * r)
+{
+   return r->aux;
+}
+
+int
+host_request (httpd_method_t method, const char *uri, const char *auth, const void *body, size_t len, char **reply, size_t *replylen)
+{                               // Run handler, returns HTTP status, reply is malloc'd
+   host_req_t s = {.auth = auth,.body = body,.len = len };
+   strcpy (s.status, "200 OK");
+   s.o = open_memstream (&s.out, &s.outlen);
+   httpd_req_t req = {.method = method,.content_len = len,.aux = &s };
+   strncpy ((char *) req.uri, uri, sizeof (req.uri) - 1);
+   size_t pathlen = strcspn (uri, "?");
+   int h;
+   for (h = 0; h < handler_count; h++)
+      if (handlers[h].method == method && (match_fn ? match_fn (handlers[h].uri, uri, pathlen) : strlen (handlers[h].uri) == pathlen
+                                           && !strncmp (handlers[h].uri, uri, pathlen)))
+         break;
+   if (h == handler_count)
+      httpd_resp_send_err (&req, HTTPD_404_NOT_FOUND, "Not found");
+   else
+   {
+      req.user_ctx = handlers[h].user_ctx;
+      if (handlers[h].handler (&req) != ESP_OK && !s.sent)
+         httpd_resp_send_err (&req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed");
+      if (s.async && xTaskGetCurrentTaskHandle ())
+      {                         // Wait for it to complete
+         s.waiter = xTaskGetCurrentTaskHandle ();
+         while (!s.done)
+            ulTaskNotifyTake (pdTRUE, portMAX_DELAY);
+      }
+   }
+   fclose (s.o);
+   if (reply)
+      *reply = s.out;
+   else
+      free (s.out);
+   if (replylen)
+      *replylen = s.outlen;
+   return atoi (s.status);
+}
+
+size_t
+httpd_req_get_url_query_len (httpd_req_t * r)
+{
+   const char *q = strchr (r->uri, '?');
+   return q ? strlen (q + 1) : 0;
+}
+
+esp_err_t
+httpd_req_get_url_query_str (httpd_req_t * r, char *buf, size_t len)
+{
+   const char *q = strchr (r->uri, '?');
+   if (!q)
+      return ESP_ERR_NOT_FOUND;
+   if (strlen (q + 1) >= len)
+      return ESP_ERR_INVALID_ARG;
+   strcpy (buf, q + 1);
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_query_key_value (const char *qry, const char *key, char *val, size_t len)
+{
+   size_t kl = strlen (key);
+   while (qry && *qry)
+   {
+      const char *e = strchr (qry, '&');
+      size_t l = (e ? e - qry : strlen (qry));
+      if (l > kl && !strncmp (qry, key, kl) && qry[kl] == '=')
+      {
+         l -= kl + 1;
+         if (l >= len)
+            return ESP_ERR_INVALID_ARG;
+         memcpy (val, qry + kl + 1, l);
+         val[l] = 0;
+         return ESP_OK;
+      }
+      qry = (e ? e + 1 : NULL);
+   }
+   return ESP_ERR_NOT_FOUND;
+}
+
+size_t
+httpd_req_get_hdr_value_len (httpd_req_t * r, const char *field)
+{
+   if (strcasecmp (field, "Authorization") || !state (r)->auth)
+      return 0;
+   return strlen (state (r)->auth);
+}
+
+esp_err_t
+httpd_req_get_hdr_value_str (httpd_req_t * r, const char *field, char *val, size_t len)
+{
+   size_t l = httpd_req_get_hdr_value_len (r, field);
+   if (!l)
+      return ESP_ERR_NOT_FOUND;
+   if (l >= len)
+      return ESP_ERR_INVALID_ARG;
+   strcpy (val, state (r)->auth);
+   return ESP_OK;
+}
+
+int
+httpd_req_recv (httpd_req_t * r, char *buf, size_t len)
+{
+   host_req_t *s = state (r);
+   if (len > s->len - s->pos)
+      len = s->len - s->pos;
+   memcpy (buf, s->body + s->pos, len);
+   s->pos += len;
+   return len;
+}
+
+esp_err_t
+httpd_resp_set_type (httpd_req_t * r, const char *type)
+{
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_set_status (httpd_req_t * r, const char *status)
+{
+   snprintf (state (r)->status, sizeof (state (r)->status), "%s", status);
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_set_hdr (httpd_req_t * r, const char *field, const char *value)
+{
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_send_chunk (httpd_req_t * r, const char *buf, ssize_t len)
+{
+   host_req_t *s = state (r);
+   if (s->ended)
+      return ESP_FAIL;
+   s->sent = 1;
+   if (!buf || !len)
+   {
+      s->ended = 1;
+      return ESP_OK;
+   }
+   if (len < 0)
+      len = strlen (buf);
+   fwrite (buf, 1, len, s->o);
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_send (httpd_req_t * r, const char *buf, ssize_t len)
+{
+   if (buf && len)
+      httpd_resp_send_chunk (r, buf, len);
+   return httpd_resp_send_chunk (r, NULL, 0);
+}
+
+esp_err_t
+httpd_resp_sendstr (httpd_req_t * r, const char *str)
+{
+   return httpd_resp_send (r, str, str ? strlen (str) : 0);
+}
+
+esp_err_t
+httpd_resp_sendstr_chunk (httpd_req_t * r, const char *str)
+{
+   return httpd_resp_send_chunk (r, str, str ? strlen (str) : 0);
+}
+
+esp_err_t
+httpd_resp_send_err (httpd_req_t * r, httpd_err_code_t error, const char *msg)
+{
+   static const char *status[] = {
+      [HTTPD_500_INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
+      [HTTPD_400_BAD_REQUEST] = "400 Bad Request",
+      [HTTPD_401_UNAUTHORIZED] = "401 Unauthorized",
+      [HTTPD_404_NOT_FOUND] = "404 Not Found",
+      [HTTPD_411_LENGTH_REQUIRED] = "411 Length Required",
+   };
+   httpd_resp_set_status (r, status[error]);
+   return httpd_resp_sendstr (r, msg);
+}
+
+esp_err_t
+httpd_req_async_handler_begin (httpd_req_t * r, httpd_req_t ** out)
+{
+   httpd_req_t *a = malloc (sizeof (*a));
+   memcpy (a, r, sizeof (*a));
+   state (r)->async = 1;
+   *out = a;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_req_async_handler_complete (httpd_req_t * r)
+{
+   host_req_t *s = state (r);
+   s->done = 1;
+   if (s->waiter)
+      xTaskNotifyGive (s->waiter);
+   free (r);
+   return ESP_OK;
+}
@@ -0,0 +1,303 @@
+// Host stand-ins for the hardware, GPIO (button), UART (NFC), LED strip, SD card, network, and small libraries
+
+#include "host.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "esp_sleep.h"
+#include "esp_netif.h"
+#include "esp_vfs_fat.h"
+#include "esp_crt_bundle.h"
+#include "mbedtls/base64.h"
+#include "iec18004.h"
+
+#define	PINS	64
+#define	LEDS	256
+
+static uint8_t level[PINS];     // Physical pin level
+static struct
+{
+   gpio_isr_t isr;
+   void *arg;
+   gpio_int_type_t type;
+   uint8_t enabled:1;
+} intr[PINS];
+
+uint32_t host_led_refresh = 0;
+uint32_t host_led_rgb[LEDS];
+static uint32_t led_set[LEDS];
+
+static void
+intr_check (int pin)
+{                               // Level interrupts fire while the level matches and they are enabled
+   if (pin < 0 || pin >= PINS || !intr[pin].enabled || !intr[pin].isr)
+      return;
+   if ((intr[pin].type == GPIO_INTR_LOW_LEVEL && !level[pin]) || (intr[pin].type == GPIO_INTR_HIGH_LEVEL && level[pin]))
+      intr[pin].isr (intr[pin].arg);
+}
+
+void
+host_button (int pressed)
+{
+   if (!btn1.set)
+      return;
+   level[btn1.num] = ((pressed ? 1 : 0) ^ btn1.invert);
+   intr_check (btn1.num);
+}
+
+// RevK GPIO, logical level
+
+esp_err_t
+revk_gpio_input (revk_gpio_t g)
+{                               // Pulled to inactive
+   if (!g.set || g.num >= PINS)
+      return ESP_ERR_INVALID_ARG;
+   level[g.num] = g.invert;
+   return ESP_OK;
+}
+
+esp_err_t
+revk_gpio_output (revk_gpio_t g, int on)
+{
+   if (!g.set || g.num >= PINS)
+      return ESP_ERR_INVALID_ARG;
+   level[g.num] = ((on ? 1 : 0) ^ g.invert);
+   return ESP_OK;
+}
+
+int
+revk_gpio_get (revk_gpio_t g)
+{
+   if (!g.set || g.num >= PINS)
+      return 0;
+   return level[g.num] ^ g.invert;
+}
+
+void
+revk_gpio_set (revk_gpio_t g, int on)
+{
+   revk_gpio_output (g, on);
+}
+
+// ESP-IDF GPIO
+
+esp_err_t
+gpio_reset_pin (int pin)
+{
+   return ESP_OK;
+}
+
+esp_err_t
+gpio_install_isr_service (int flags)
+{
+   return ESP_OK;
+}
+
+esp_err_t
+gpio_isr_handler_add (int pin, gpio_isr_t isr, void *arg)
+{
+   if (pin < 0 || pin >= PINS)
+      return ESP_ERR_INVALID_ARG;
+   intr[pin].isr = isr;
+   intr[pin].arg = arg;
+   return ESP_OK;
+}
+
+esp_err_t
+gpio_intr_enable (int pin)
+{
+   if (pin < 0 || pin >= PINS)
+      return ESP_ERR_INVALID_ARG;
+   intr[pin].enabled = 1;
+   intr_check (pin);
+   return ESP_OK;
+}
+
+esp_err_t
+gpio_intr_disable (int pin)
+{
+   if (pin < 0 || pin >= PINS)
+      return ESP_ERR_INVALID_ARG;
+   intr[pin].enabled = 0;
+   return ESP_OK;
+}
+
+esp_err_t
+gpio_set_intr_type (int pin, gpio_int_type_t type)
+{
+   if (pin < 0 || pin >= PINS)
+      return ESP_ERR_INVALID_ARG;
+   intr[pin].type = type;
+   return ESP_OK;
+}
+
+esp_err_t
+gpio_wakeup_enable (int pin, gpio_int_type_t type)
+{
+   return gpio_set_intr_type (pin, type);
+}
+
+esp_err_t
+esp_sleep_enable_gpio_wakeup (void)
+{
+   return ESP_OK;
+}
+
+// UART, nothing is ever received
+
+esp_err_t
+uart_param_config (int uart, const uart_config_t * config)
+{
+   return ESP_OK;
+}
+
+esp_err_t
+uart_set_pin (int uart, int tx, int rx, int rts, int cts)
+{
+   return ESP_OK;
+}
+
+int
+uart_is_driver_installed (int uart)
+{
+   return 1;
+}
+
+esp_err_t
+uart_driver_install (int uart, int rx, int tx, int queue, void *handle, int flags)
+{
+   return ESP_OK;
+}
+
+int
+uart_read_bytes (int uart, void *buf, uint32_t len, TickType_t ticks)
+{
+   vTaskDelay (ticks);
+   return 0;
+}
+
+// LED strip
+
+struct led_strip_s
+{
+   uint32_t leds;
+};
+
+esp_err_t
+led_strip_new_rmt_device (const led_strip_config_t * config, const led_strip_rmt_config_t * rmt, led_strip_handle_t * strip)
+{
+   *strip = calloc (1, sizeof (**strip));
+   (*strip)->leds = (config->max_leds < LEDS ? config->max_leds : LEDS);
+   return ESP_OK;
+}
+
+esp_err_t
+led_strip_set_pixel (led_strip_handle_t strip, uint32_t index, uint32_t r, uint32_t g, uint32_t b)
+{
+   if (index >= strip->leds)
+      return ESP_ERR_INVALID_ARG;
+   led_set[index] = (r << 16 | g << 8 | b);
+   return ESP_OK;
+}
+
+esp_err_t
+led_strip_refresh (led_strip_handle_t strip)
+{
+   memcpy (host_led_rgb, led_set, strip->leds * sizeof (*led_set));
+   host_led_refresh++;
+   return ESP_OK;
+}
+
+// SD card, none
+
+esp_err_t
+esp_vfs_fat_sdmmc_mount (const char *base, const sdmmc_host_t * host, const void *slot,
+                         const esp_vfs_fat_sdmmc_mount_config_t * config, sdmmc_card_t ** card)
+{
+   *card = NULL;
+   return ESP_ERR_NOT_FOUND;
+}
+
+// Network
+
+esp_netif_t *
+esp_netif_get_handle_from_ifkey (const char *key)
+{
+   return NULL;
+}
+
+esp_err_t
+esp_netif_get_ip_info (esp_netif_t * netif, esp_netif_ip_info_t * info)
+{
+   info->ip.addr = 0x0200A8C0;  // 192.168.0.2
+   return ESP_OK;
+}
+
+esp_err_t
+esp_crt_bundle_attach (void *conf)
+{
+   return ESP_OK;
+}
+
+int
+mbedtls_base64_decode (unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen)
+{
+   uint32_t v = 0;
+   int bits = 0;
+   size_t n = 0;
+   for (size_t i = 0; i < slen && src[i] != '='; i++)
+   {
+      const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+         *p = strchr (b64, src[i]);
+      if (!p || !src[i])
+         return -1;
+      v = (v << 6) | (p - b64);
+      if ((bits += 6) >= 8)
+      {
+         bits -= 8;
+         if (n >= dlen)
+            return -1;
+         dst[n++] = v >> bits;
+      }
+   }
+   *olen = n;
+   return 0;
+}
+
+// QR, a repeatable pattern the size of a real code, with finder squares
+
+uint8_t *
+qr_encode_opts (size_t len, const char *value, qr_encode_opts_t o)
+{
+   int ver = 1 + (int) len / 16;
+   if (ver > 40)
+      return NULL;
+   int w = 17 + 4 * ver + (o.noquiet ? 0 : 8),
+      q = (o.noquiet ? 0 : 4);
+   uint8_t *qr = calloc (w, w);
+   uint32_t h = 2166136261U;
+   for (size_t i = 0; i < len; i++)
+      h = (h ^ (uint8_t) value[i]) * 16777619U;
+   for (int y = q; y < w - q; y++)
+      for (int x = q; x < w - q; x++)
+      {
+         int fx = (x - q < 7 ? x - q : w - q - 1 - x < 7 ? w - q - 1 - x : -1),
+            fy = (y - q < 7 ? y - q : w - q - 1 - y < 7 ? w - q - 1 - y : -1);
+         int black;
+         if (fx >= 0 && fy >= 0 && !(x - q >= 7 && y - q >= 7))
+         {                      // Finder, rings
+            int r = (fx < fy ? fx : fy);
+            black = (r != 1);
+         } else
+         {
+            h ^= h << 13;
+            h ^= h >> 17;
+            h ^= h << 5;
+            black = h & 1;
+         }
+         if (black)
+            qr[y * w + x] = QR_TAG_BLACK;
+      }
+   if (o.widthp)
+      *o.widthp = w;
+   return qr;
+}
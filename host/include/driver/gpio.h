@@ -0,0 +1,20 @@
+// Host stand-in, the button can be pressed by the replay driver
+#pragma once
+#include "esp_err.h"
+typedef enum
+{
+   GPIO_INTR_DISABLE,
+   GPIO_INTR_POSEDGE,
+   GPIO_INTR_NEGEDGE,
+   GPIO_INTR_ANYEDGE,
+   GPIO_INTR_LOW_LEVEL,
+   GPIO_INTR_HIGH_LEVEL,
+} gpio_int_type_t;
+typedef void (*gpio_isr_t) (void *);
+esp_err_t gpio_reset_pin (int pin);
+esp_err_t gpio_install_isr_service (int flags);
+esp_err_t gpio_isr_handler_add (int pin, gpio_isr_t isr, void *arg);
+esp_err_t gpio_intr_enable (int pin);
+esp_err_t gpio_intr_disable (int pin);
+esp_err_t gpio_set_intr_type (int pin, gpio_int_type_t type);
+esp_err_t gpio_wakeup_enable (int pin, gpio_int_type_t type);
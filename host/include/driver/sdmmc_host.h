@@ -0,0 +1,26 @@
+// Host stand-in
+#pragma once
+#include <stdint.h>
+typedef struct sdmmc_card_s sdmmc_card_t;
+typedef struct
+{
+   int slot;
+   int max_freq_khz;
+} sdmmc_host_t;
+typedef struct
+{
+   int clk,
+     cmd,
+     d0,
+     d1,
+     d2,
+     d3,
+     cd,
+     width;
+   uint32_t flags;
+} sdmmc_slot_config_t;
+#define	SDMMC_HOST_SLOT_1	1
+#define	SDMMC_FREQ_HIGHSPEED	40000
+#define	SDMMC_SLOT_FLAG_INTERNAL_PULLUP	1
+#define	SDMMC_HOST_DEFAULT()	{0}
+#define	SDMMC_SLOT_CONFIG_DEFAULT()	{0}
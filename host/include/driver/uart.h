@@ -0,0 +1,30 @@
+// Host stand-in, no data ever arrives
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+typedef enum
+{ UART_DATA_8_BITS = 3 } uart_word_length_t;
+typedef enum
+{ UART_PARITY_DISABLE } uart_parity_t;
+typedef enum
+{ UART_STOP_BITS_1 = 1 } uart_stop_bits_t;
+typedef enum
+{ UART_HW_FLOWCTRL_DISABLE } uart_hw_flowcontrol_t;
+typedef enum
+{ UART_SCLK_DEFAULT } uart_sclk_t;
+typedef struct
+{
+   int baud_rate;
+   uart_word_length_t data_bits;
+   uart_parity_t parity;
+   uart_stop_bits_t stop_bits;
+   uart_hw_flowcontrol_t flow_ctrl;
+   uart_sclk_t source_clk;
+} uart_config_t;
+esp_err_t uart_param_config (int uart, const uart_config_t * config);
+esp_err_t uart_set_pin (int uart, int tx, int rx, int rts, int cts);
+int uart_is_driver_installed (int uart);
+esp_err_t uart_driver_install (int uart, int rx, int tx, int queue, void *handle, int flags);
+int uart_read_bytes (int uart, void *buf, uint32_t len, TickType_t ticks);
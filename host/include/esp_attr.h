@@ -0,0 +1,4 @@
+// Host stand-in
+#pragma once
+#define	IRAM_ATTR
+#define	RTC_NOINIT_ATTR
@@ -0,0 +1,2 @@
+// Host stand-in, no backtrace (CONFIG_IDF_TARGET_ARCH_XTENSA is not set)
+#pragma once
@@ -0,0 +1,10 @@
+// Host stand-in
+#pragma once
+#include <stddef.h>
+#define	MALLOC_CAP_DEFAULT	(1<<12)
+#define	MALLOC_CAP_INTERNAL	(1<<11)
+#define	MALLOC_CAP_SPIRAM	(1<<10)
+size_t heap_caps_get_free_size (int caps);
+size_t heap_caps_get_minimum_free_size (int caps);
+size_t heap_caps_get_largest_free_block (int caps);
+size_t heap_caps_get_allocated_size (void *p);
@@ -0,0 +1,43 @@
+// Host stand-in, requests are answered from the image directory given to the replay driver (see http.c)
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+typedef struct esp_http_client_s *esp_http_client_handle_t;
+typedef enum
+{
+   HTTP_EVENT_ERROR,
+   HTTP_EVENT_ON_CONNECTED,
+   HTTP_EVENT_HEADERS_SENT,
+   HTTP_EVENT_ON_HEADER,
+   HTTP_EVENT_ON_DATA,
+   HTTP_EVENT_ON_FINISH,
+   HTTP_EVENT_DISCONNECTED,
+} esp_http_client_event_id_t;
+typedef struct
+{
+   esp_http_client_event_id_t event_id;
+   esp_http_client_handle_t client;
+   void *data;
+   int data_len;
+   void *user_data;
+   char *header_key;
+   char *header_value;
+} esp_http_client_event_t;
+typedef esp_err_t (*http_event_handle_cb) (esp_http_client_event_t * e);
+typedef struct
+{
+   const char *url;
+   int timeout_ms;
+   http_event_handle_cb event_handler;
+   void *user_data;
+   esp_err_t (*crt_bundle_attach) (void *conf);
+} esp_http_client_config_t;
+esp_http_client_handle_t esp_http_client_init (const esp_http_client_config_t * config);
+esp_err_t esp_http_client_set_header (esp_http_client_handle_t client, const char *key, const char *value);
+esp_err_t esp_http_client_open (esp_http_client_handle_t client, int write_len);
+int64_t esp_http_client_fetch_headers (esp_http_client_handle_t client);
+int esp_http_client_get_status_code (esp_http_client_handle_t client);
+int esp_http_client_read (esp_http_client_handle_t client, char *buf, int len);
+int esp_http_client_read_response (esp_http_client_handle_t client, char *buf, int len);
+esp_err_t esp_http_client_close (esp_http_client_handle_t client);
+esp_err_t esp_http_client_cleanup (esp_http_client_handle_t client);
@@ -0,0 +1,71 @@
+// Host stand-in, handlers are called by the replay driver (see http.c)
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+typedef void *httpd_handle_t;
+typedef enum
+{
+   HTTP_DELETE,
+   HTTP_GET,
+   HTTP_HEAD,
+   HTTP_POST,
+   HTTP_PUT,
+} httpd_method_t;
+typedef enum
+{
+   HTTPD_500_INTERNAL_SERVER_ERROR,
+   HTTPD_400_BAD_REQUEST,
+   HTTPD_401_UNAUTHORIZED,
+   HTTPD_404_NOT_FOUND,
+   HTTPD_411_LENGTH_REQUIRED,
+} httpd_err_code_t;
+#define	HTTPD_RESP_USE_STRLEN	-1
+#define	HTTPD_SOCK_ERR_FAIL	-1
+#define	HTTPD_SOCK_ERR_INVALID	-2
+#define	HTTPD_SOCK_ERR_TIMEOUT	-3
+typedef struct httpd_req
+{
+   httpd_handle_t handle;
+   int method;
+   const char uri[513];
+   size_t content_len;
+   void *aux;                   // Host request state
+   void *user_ctx;
+} httpd_req_t;
+typedef struct httpd_uri
+{
+   const char *uri;
+   httpd_method_t method;
+   esp_err_t (*handler) (httpd_req_t * r);
+   void *user_ctx;
+} httpd_uri_t;
+typedef bool (*httpd_uri_match_func_t) (const char *reference_uri, const char *uri_to_match, size_t match_upto);
+typedef struct
+{
+   size_t stack_size;
+   uint16_t max_uri_handlers;
+   bool lru_purge_enable;
+   httpd_uri_match_func_t uri_match_fn;
+} httpd_config_t;
+#define	HTTPD_DEFAULT_CONFIG()	{.stack_size=4096,.max_uri_handlers=8}
+bool httpd_uri_match_wildcard (const char *reference_uri, const char *uri_to_match, size_t match_upto);
+esp_err_t httpd_start (httpd_handle_t * handle, const httpd_config_t * config);
+esp_err_t httpd_register_uri_handler (httpd_handle_t handle, const httpd_uri_t * uri);
+size_t httpd_req_get_url_query_len (httpd_req_t * r);
+esp_err_t httpd_req_get_url_query_str (httpd_req_t * r, char *buf, size_t len);
+esp_err_t httpd_query_key_value (const char *qry, const char *key, char *val, size_t len);
+size_t httpd_req_get_hdr_value_len (httpd_req_t * r, const char *field);
+esp_err_t httpd_req_get_hdr_value_str (httpd_req_t * r, const char *field, char *val, size_t len);
+int httpd_req_recv (httpd_req_t * r, char *buf, size_t len);
+esp_err_t httpd_resp_set_type (httpd_req_t * r, const char *type);
+esp_err_t httpd_resp_set_status (httpd_req_t * r, const char *status);
+esp_err_t httpd_resp_set_hdr (httpd_req_t * r, const char *field, const char *value);
+esp_err_t httpd_resp_send (httpd_req_t * r, const char *buf, ssize_t len);
+esp_err_t httpd_resp_send_chunk (httpd_req_t * r, const char *buf, ssize_t len);
+esp_err_t httpd_resp_sendstr (httpd_req_t * r, const char *str);
+esp_err_t httpd_resp_sendstr_chunk (httpd_req_t * r, const char *str);
+esp_err_t httpd_resp_send_err (httpd_req_t * r, httpd_err_code_t error, const char *msg);
+esp_err_t httpd_req_async_handler_begin (httpd_req_t * r, httpd_req_t ** out);
+esp_err_t httpd_req_async_handler_complete (httpd_req_t * r);
@@ -0,0 +1,17 @@
+// Host stand-in, logs to stderr with the virtual time
+#pragma once
+typedef enum
+{
+   ESP_LOG_NONE,
+   ESP_LOG_ERROR,
+   ESP_LOG_WARN,
+   ESP_LOG_INFO,
+   ESP_LOG_DEBUG,
+   ESP_LOG_VERBOSE,
+} esp_log_level_t;
+void host_log (esp_log_level_t level, const char *tag, const char *fmt, ...);
+#define	ESP_LOGE(tag,...)	host_log(ESP_LOG_ERROR,tag,__VA_ARGS__)
+#define	ESP_LOGW(tag,...)	host_log(ESP_LOG_WARN,tag,__VA_ARGS__)
+#define	ESP_LOGI(tag,...)	host_log(ESP_LOG_INFO,tag,__VA_ARGS__)
+#define	ESP_LOGD(tag,...)	host_log(ESP_LOG_DEBUG,tag,__VA_ARGS__)
+#define	ESP_LOG_BUFFER_HEX_LEVEL(tag,buf,len,level)	((void)(buf),(void)(len))
@@ -0,0 +1,19 @@
+// Host stand-in
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+typedef struct
+{
+   uint32_t addr;
+} esp_ip4_addr_t;
+typedef struct
+{
+   esp_ip4_addr_t ip,
+     netmask,
+     gw;
+} esp_netif_ip_info_t;
+typedef struct esp_netif_s esp_netif_t;
+#define	IPSTR	"%d.%d.%d.%d"
+#define	IP2STR(a)	(int)((a)->addr&0xFF),(int)(((a)->addr>>8)&0xFF),(int)(((a)->addr>>16)&0xFF),(int)(((a)->addr>>24)&0xFF)
+esp_netif_t *esp_netif_get_handle_from_ifkey (const char *key);
+esp_err_t esp_netif_get_ip_info (esp_netif_t * netif, esp_netif_ip_info_t * info);
@@ -0,0 +1,6 @@
+// Host stand-in, repeatable sequence
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+uint32_t esp_random (void);
+void esp_fill_random (void *buf, size_t len);
@@ -0,0 +1,2 @@
+// Host stand-in
+#pragma once
@@ -0,0 +1,4 @@
+// Host stand-in, virtual clock
+#pragma once
+#include <stdint.h>
+int64_t esp_timer_get_time (void);
@@ -0,0 +1,13 @@
+// Host stand-in, no SD card
+#pragma once
+#include "esp_err.h"
+#include "driver/sdmmc_host.h"
+typedef struct
+{
+   int format_if_mount_failed;
+   int max_files;
+   int allocation_unit_size;
+   int disk_status_check_enable;
+} esp_vfs_fat_sdmmc_mount_config_t;
+esp_err_t esp_vfs_fat_sdmmc_mount (const char *base, const sdmmc_host_t * host, const void *slot,
+                                   const esp_vfs_fat_sdmmc_mount_config_t * config, sdmmc_card_t ** card);
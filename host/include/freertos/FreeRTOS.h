@@ -0,0 +1,27 @@
+// Host stand-in for FreeRTOS, tasks are run one at a time on a virtual clock (see sim.c)
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_attr.h"
+
+typedef struct sim_task_s *TaskHandle_t;
+typedef void (*TaskFunction_t) (void *);
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef int portMUX_TYPE;       // Nothing runs at the same time, so critical sections do nothing
+
+#define	configTICK_RATE_HZ	1000
+#define	portTICK_PERIOD_MS	(1000/configTICK_RATE_HZ)
+#define	portMAX_DELAY		((TickType_t)0xFFFFFFFF)
+#define	pdMS_TO_TICKS(ms)	((TickType_t)((uint64_t)(ms)*configTICK_RATE_HZ/1000))
+#define	pdTRUE			1
+#define	pdFALSE			0
+#define	pdPASS			1
+#define	pdFAIL			0
+#define	portMUX_INITIALIZER_UNLOCKED	0
+#define	taskENTER_CRITICAL(m)	((void)(m))
+#define	taskEXIT_CRITICAL(m)	((void)(m))
+#define	portYIELD_FROM_ISR(w)	((void)(w))
+
+#include "freertos/task.h"
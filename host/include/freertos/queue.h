@@ -0,0 +1,10 @@
+// Host stand-in for FreeRTOS queues
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_queue_s *QueueHandle_t;
+
+QueueHandle_t xQueueCreate (UBaseType_t len, UBaseType_t size);
+BaseType_t xQueueSend (QueueHandle_t q, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive (QueueHandle_t q, void *item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting (QueueHandle_t q);
@@ -0,0 +1,9 @@
+// Host stand-in for FreeRTOS semaphores, mutex only
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_mutex_s *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex (void);
+BaseType_t xSemaphoreTake (SemaphoreHandle_t s, TickType_t ticks);
+BaseType_t xSemaphoreGive (SemaphoreHandle_t s);
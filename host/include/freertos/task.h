@@ -0,0 +1,11 @@
+// Host stand-in for FreeRTOS tasks
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+TaskHandle_t xTaskGetCurrentTaskHandle (void);
+void vTaskDelay (TickType_t ticks);
+void vTaskDelete (TaskHandle_t task);
+uint32_t ulTaskNotifyTake (BaseType_t clear, TickType_t ticks);
+BaseType_t xTaskNotifyGive (TaskHandle_t task);
+void vTaskNotifyGiveFromISR (TaskHandle_t task, BaseType_t * woken);
+BaseType_t xTaskCreate (TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t * task);
@@ -0,0 +1,50 @@
+// Host stand-in for the ESP32-GFX component, a black plane (and red plane on red panels) in memory (see gfx.c)
+#pragma once
+#include <stdint.h>
+typedef int16_t gfx_pos_t;
+typedef uint8_t gfx_intensity_t;
+typedef uint8_t gfx_align_t;
+#define	GFX_L	1
+#define	GFX_R	2
+#define	GFX_C	3
+#define	GFX_T	4
+#define	GFX_B	8
+#define	GFX_M	12
+#define	GFX_H	16
+#define	GFX_V	32
+typedef struct
+{
+   int cs,
+     sck,
+     mosi,
+     dc,
+     rst,
+     busy,
+     ena;
+   uint8_t flip;
+   uint8_t direct:1;
+   uint8_t invert:1;
+} gfx_init_t;
+#define	gfx_init(...)	gfx_init_opts((gfx_init_t){__VA_ARGS__})
+const char *gfx_init_opts (gfx_init_t o);
+void gfx_lock (void);
+void gfx_unlock (void);
+void gfx_refresh (void);
+void gfx_changed (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h);
+void gfx_clear (gfx_intensity_t i);
+void gfx_pixel (gfx_pos_t x, gfx_pos_t y, gfx_intensity_t i);
+gfx_pos_t gfx_width (void);
+gfx_pos_t gfx_height (void);
+uint32_t gfx_raw_w (void);
+uint32_t gfx_raw_h (void);
+uint8_t *gfx_raw_b (void);
+uint8_t *gfx_raw_r (void);
+uint8_t gfx_bpp (void);
+void gfx_foreground (uint32_t rgb);
+void gfx_background (uint32_t rgb);
+uint32_t gfx_f (void);
+uint32_t gfx_b (void);
+void gfx_pos (gfx_pos_t x, gfx_pos_t y, gfx_align_t a);
+void gfx_draw (gfx_pos_t w, gfx_pos_t h, gfx_pos_t wm, gfx_pos_t hm, gfx_pos_t * xp, gfx_pos_t * yp);
+void gfx_message (const char *m);
+void gfx_7seg (gfx_align_t a, int s, const char *fmt, ...);
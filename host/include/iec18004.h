@@ -0,0 +1,12 @@
+// Host stand-in for the QR component, a repeatable pattern from the text rather than a real QR code
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#define	QR_TAG_BLACK	0x01
+typedef struct
+{
+   unsigned int *widthp;
+   unsigned char noquiet;
+} qr_encode_opts_t;
+#define	qr_encode(len,value,...)	qr_encode_opts(len,value,(qr_encode_opts_t){__VA_ARGS__})
+uint8_t *qr_encode_opts (size_t len, const char *value, qr_encode_opts_t o);
@@ -0,0 +1,34 @@
+// Host stand-in, LED colours are recorded
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+typedef struct led_strip_s *led_strip_handle_t;
+typedef enum
+{ LED_MODEL_WS2812 } led_model_t;
+typedef enum
+{ RMT_CLK_SRC_DEFAULT } rmt_clock_source_t;
+#define	LED_STRIP_COLOR_COMPONENT_FMT_GRB	0
+typedef struct
+{
+   int strip_gpio_num;
+   uint32_t max_leds;
+   int color_component_format;
+   led_model_t led_model;
+   struct
+   {
+      uint32_t invert_out:1;
+   } flags;
+} led_strip_config_t;
+typedef struct
+{
+   rmt_clock_source_t clk_src;
+   uint32_t resolution_hz;
+   struct
+   {
+      uint32_t with_dma:1;
+   } flags;
+} led_strip_rmt_config_t;
+esp_err_t led_strip_new_rmt_device (const led_strip_config_t * config, const led_strip_rmt_config_t * rmt,
+                                    led_strip_handle_t * strip);
+esp_err_t led_strip_set_pixel (led_strip_handle_t strip, uint32_t index, uint32_t r, uint32_t g, uint32_t b);
+esp_err_t led_strip_refresh (led_strip_handle_t strip);
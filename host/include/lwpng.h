@@ -0,0 +1,19 @@
+// Host stand-in for the ESP32-LWPNG component, decode and 1 bit encode using zlib (see lwpng.c)
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <zlib.h>
+typedef struct lwpng_decode_s lwpng_decode_t;
+typedef struct lwpng_encode_s lwpng_encode_t;
+typedef void *lwpng_alloc_t (void *opaque, uInt items, uInt size);
+typedef void lwpng_free_t (void *opaque, void *address);
+typedef const char *lwpng_info_t (void *opaque, uint32_t w, uint32_t h, uint8_t depth, uint8_t colour);
+typedef const char *lwpng_pixel_t (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a);
+lwpng_decode_t *lwpng_decode (void *opaque, lwpng_info_t * info, lwpng_pixel_t * pixel, lwpng_alloc_t * alloc, lwpng_free_t * free,
+                              void *allocopaque);
+const char *lwpng_data (lwpng_decode_t * p, size_t len, const uint8_t * data);
+const char *lwpng_decoded (lwpng_decode_t ** pp);
+const char *lwpng_get_info (uint32_t len, const uint8_t * data, uint32_t * w, uint32_t * h);
+lwpng_encode_t *lwpng_encode_1bit (uint32_t w, uint32_t h, lwpng_alloc_t * alloc, lwpng_free_t * free, void *allocopaque);
+const char *lwpng_encode_scanline (lwpng_encode_t * p, const uint8_t * data);
+const char *lwpng_encoded (lwpng_encode_t ** pp, size_t *len, uint8_t ** data);
@@ -0,0 +1,125 @@
+// Host stand-in for the ESP32-RevK component (see revk.c and jo.c)
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_http_server.h"
+#include "led_strip.h"
+
+// JSON
+typedef struct jo_s *jo_t;
+typedef enum
+{
+   JO_END,
+   JO_CLOSE,
+   JO_TAG,
+   JO_OBJECT,
+   JO_ARRAY,
+   JO_STRING,
+   JO_NUMBER,
+   JO_NULL,
+   JO_TRUE,
+   JO_FALSE,
+} jo_type_t;
+jo_t jo_object_alloc (void);
+jo_t jo_create_alloc (void);
+jo_t jo_parse_mem (const void *buf, size_t len);
+jo_t jo_parse_str (const char *s);
+void jo_free (jo_t * jp);
+char *jo_finisha (jo_t * jp);
+const char *jo_error (jo_t j, int *pos);
+void jo_array (jo_t j, const char *tag);
+void jo_object (jo_t j, const char *tag);
+void jo_close (jo_t j);
+void jo_string (jo_t j, const char *tag, const char *val);
+void jo_stringf (jo_t j, const char *tag, const char *fmt, ...);
+void jo_int (jo_t j, const char *tag, int64_t val);
+void jo_bool (jo_t j, const char *tag, int val);
+void jo_null (jo_t j, const char *tag);
+void jo_base64 (jo_t j, const char *tag, const void *buf, size_t len);
+jo_type_t jo_here (jo_t j);
+jo_type_t jo_next (jo_t j);
+jo_type_t jo_skip (jo_t j);
+void jo_rewind (jo_t j);
+jo_type_t jo_find (jo_t j, const char *path);
+ssize_t jo_strlen (jo_t j);
+ssize_t jo_strncpy (jo_t j, void *buf, size_t len);
+char *jo_strdup (jo_t j);
+int jo_strcmp (jo_t j, const char *s);
+int64_t jo_read_int (jo_t j);
+double jo_read_float (jo_t j);
+
+// Application
+typedef const char *app_callback_t (int client, const char *prefix, const char *target, const char *suffix, jo_t j);
+extern const char *revk_app;
+extern const char *revk_id;
+void revk_boot (app_callback_t * cb);
+void revk_start (void);
+TaskHandle_t revk_task (const char *name, TaskFunction_t fn, const void *arg, int stackk);
+void *mallocspi (size_t len);
+uint32_t uptime (void);
+int revk_link_down (void);
+const char *revk_season (time_t t);
+uint32_t revk_rgb (char c);
+uint32_t revk_blinker (void);
+void revk_led (led_strip_handle_t strip, int led, int scale, uint32_t rgb);
+extern const uint8_t gamma8[256];
+void revk_gfx_init (int secs);
+#define	REVK_ERR_CHECK(x)	do{esp_err_t e_=(x);if(e_)ESP_LOGE("revk","%s %s",#x,esp_err_to_name(e_));}while(0)
+
+// MQTT
+void *revk_mqtt (int client);
+void lwmqtt_subscribe (void *handle, const char *topic);
+const char *revk_mqtt_send_raw (const char *topic, int retain, const char *payload, int clients);
+const char *revk_mqtt_send_str (const char *str);
+const char *revk_info (const char *tag, jo_t * jp);
+const char *revk_error (const char *tag, jo_t * jp);
+
+// GPIO
+typedef struct
+{
+   uint16_t num:8;
+   uint16_t set:1;
+   uint16_t invert:1;
+} revk_gpio_t;
+esp_err_t revk_gpio_input (revk_gpio_t g);
+esp_err_t revk_gpio_output (revk_gpio_t g, int on);
+int revk_gpio_get (revk_gpio_t g);
+void revk_gpio_set (revk_gpio_t g, int on);
+
+// Web
+int revk_num_web_handlers (void);
+void revk_web_settings_add (httpd_handle_t webserver);
+esp_err_t revk_web_settings (httpd_req_t * req);
+void revk_web_send (httpd_req_t * req, const char *fmt, ...);
+void revk_web_head (httpd_req_t * req, const char *title);
+esp_err_t revk_web_foot (httpd_req_t * req, int home, int wifi, const char *extra);
+void revk_web_setting_title (httpd_req_t * req, const char *fmt, ...);
+void revk_web_setting_info (httpd_req_t * req, const char *fmt, ...);
+void revk_web_setting (httpd_req_t * req, const char *tag, const char *field);
+
+// Settings, generated from settings.def (see settings_gen.c)
+typedef struct
+{
+   const char *name;
+   char type;                   // g gpio, b bit, 1/2/4 unsigned, e enum, s string, c single character
+   void *ptr;
+   uint8_t array;
+   const char *enums;
+} host_setting_t;
+extern const host_setting_t host_settings[];
+#include "settings.h"
@@ -0,0 +1,570 @@
+// Host stand-in for the RevK JSON object library, builder and cursor based parser
+// Parsing is done in one pass to a token list, so a syntax error anywhere gives jo_error and an empty document, as check_data expects
+
+#include "revk.h"
+
+typedef struct
+{
+   jo_type_t type;
+   uint32_t pos,                // Offset in text
+     len;                       // Length in text (string without quotes)
+   uint32_t end;                // Token after the matching close, for object and array
+} tok_t;
+
+struct jo_s
+{
+   // Building
+   FILE *o;
+   char *buf;
+   size_t size;
+   uint8_t level;
+   uint8_t comma[32];           // Something in this level already
+   char close[32];              // Close for each level
+   // Parsing
+   char *text;
+   tok_t *toks;
+   uint32_t count,
+     here;
+   const char *error;
+   int errpos;
+};
+
+// Building
+
+static jo_t
+create (void)
+{
+   jo_t j = calloc (1, sizeof (*j));
+   j->o = open_memstream (&j->buf, &j->size);
+   return j;
+}
+
+jo_t
+jo_create_alloc (void)
+{
+   return create ();
+}
+
+jo_t
+jo_object_alloc (void)
+{
+   jo_t j = create ();
+   fputc ('{', j->o);
+   j->close[0] = '}';
+   j->level = 1;
+   return j;
+}
+
+static void
+quoted (FILE * o, const char *s)
+{
+   fputc ('"', o);
+   for (; *s; s++)
+   {
+      uint8_t c = *s;
+      if (c == '"' || c == '\\')
+         fprintf (o, "\\%c", c);
+      else if (c == '\n')
+         fputs ("\\n", o);
+      else if (c == '\r')
+         fputs ("\\r", o);
+      else if (c == '\t')
+         fputs ("\\t", o);
+      else if (c < ' ')
+         fprintf (o, "\\u%04X", c);
+      else
+         fputc (c, o);
+   }
+   fputc ('"', o);
+}
+
+static void
+tag (jo_t j, const char *tag)
+{                               // Comma and tag as needed for a new value
+   if (!j || !j->o)
+      return;
+   if (j->level < sizeof (j->comma) && j->comma[j->level]++)
+      fputc (',', j->o);
+   if (tag)
+   {
+      quoted (j->o, tag);
+      fputc (':', j->o);
+   }
+}
+
+void
+jo_object (jo_t j, const char *t)
+{
+   tag (j, t);
+   fputc ('{', j->o);
+   if (j->level < sizeof (j->close))
+      j->close[j->level] = '}';
+   if (++j->level < sizeof (j->comma))
+      j->comma[j->level] = 0;
+}
+
+void
+jo_array (jo_t j, const char *t)
+{
+   tag (j, t);
+   fputc ('[', j->o);
+   if (j->level < sizeof (j->close))
+      j->close[j->level] = ']';
+   if (++j->level < sizeof (j->comma))
+      j->comma[j->level] = 0;
+}
+
+void
+jo_close (jo_t j)
+{
+   if (!j || !j->o || !j->level)
+      return;
+   fputc (j->level <= sizeof (j->close) ? j->close[j->level - 1] : '}', j->o);
+   j->level--;
+}
+
+void
+jo_string (jo_t j, const char *t, const char *val)
+{
+   tag (j, t);
+   if (val)
+      quoted (j->o, val);
+   else
+      fputs ("null", j->o);
+}
+
+void
+jo_stringf (jo_t j, const char *t, const char *fmt, ...)
+{
+   char *v = NULL;
+   va_list ap;
+   va_start (ap, fmt);
+   if (vasprintf (&v, fmt, ap) < 0)
+      v = NULL;
+   va_end (ap);
+   jo_string (j, t, v);
+   free (v);
+}
+
+void
+jo_int (jo_t j, const char *t, int64_t val)
+{
+   tag (j, t);
+   fprintf (j->o, "%lld", (long long) val);
+}
+
+void
+jo_bool (jo_t j, const char *t, int val)
+{
+   tag (j, t);
+   fputs (val ? "true" : "false", j->o);
+}
+
+void
+jo_null (jo_t j, const char *t)
+{
+   tag (j, t);
+   fputs ("null", j->o);
+}
+
+void
+jo_base64 (jo_t j, const char *t, const void *buf, size_t len)
+{
+   static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   const uint8_t *p = buf;
+   tag (j, t);
+   fputc ('"', j->o);
+   for (size_t i = 0; i < len; i += 3)
+   {
+      uint32_t v = p[i] << 16 | (i + 1 < len ? p[i + 1] << 8 : 0) | (i + 2 < len ? p[i + 2] : 0);
+      fputc (b64[v >> 18], j->o);
+      fputc (b64[(v >> 12) & 63], j->o);
+      fputc (i + 1 < len ? b64[(v >> 6) & 63] : '=', j->o);
+      fputc (i + 2 < len ? b64[v & 63] : '=', j->o);
+   }
+   fputc ('"', j->o);
+}
+
+char *
+jo_finisha (jo_t * jp)
+{
+   jo_t j = *jp;
+   if (!j)
+      return NULL;
+   *jp = NULL;
+   char *r = NULL;
+   if (j->o)
+   {
+      while (j->level)
+         jo_close (j);
+      fclose (j->o);
+      r = j->buf;
+   }
+   free (j->text);
+   free (j->toks);
+   free (j);
+   return r;
+}
+
+void
+jo_free (jo_t * jp)
+{
+   free (jo_finisha (jp));
+}
+
+// Parsing
+
+static void
+add (jo_t j, jo_type_t type, uint32_t pos, uint32_t len)
+{
+   if (!(j->count & 255))
+      j->toks = realloc (j->toks, (j->count + 256) * sizeof (tok_t));
+   j->toks[j->count++] = (tok_t)
+   {
+   type, pos, len, 0};
+}
+
+static int
+fail (jo_t j, const char *e, uint32_t pos)
+{
+   if (!j->error)
+   {
+      j->error = e;
+      j->errpos = pos;
+   }
+   return -1;
+}
+
+static int
+parse_value (jo_t j, uint32_t * pp, int depth)
+{
+   const char *t = j->text;
+   uint32_t p = *pp;
+   while (isspace ((int) (unsigned char) t[p]))
+      p++;
+   if (depth > 100)
+      return fail (j, "Too deep", p);
+   char c = t[p];
+   if (c == '"')
+   {
+      uint32_t s = ++p;
+      while (t[p] && t[p] != '"')
+      {
+         if ((unsigned char) t[p] < ' ')
+            return fail (j, "Bad string", p);
+         if (t[p] == '\\')
+         {
+            p++;
+            if (t[p] == 'u')
+            {
+               for (int n = 1; n <= 4; n++)
+                  if (!isxdigit ((int) (unsigned char) t[p + n]))
+                     return fail (j, "Bad escape", p);
+               p += 4;
+            } else if (!strchr ("\"\\/bfnrt", t[p]) || !t[p])
+               return fail (j, "Bad escape", p);
+         }
+         p++;
+      }
+      if (!t[p])
+         return fail (j, "Unterminated string", s);
+      add (j, JO_STRING, s, p - s);
+      *pp = p + 1;
+      return 0;
+   }
+   if (c == '{' || c == '[')
+   {
+      uint32_t me = j->count;
+      add (j, c == '{' ? JO_OBJECT : JO_ARRAY, p, 1);
+      p++;
+      while (isspace ((int) (unsigned char) t[p]))
+         p++;
+      if (t[p] != (c == '{' ? '}' : ']'))
+         while (1)
+         {
+            if (c == '{')
+            {                   // Tag
+               while (isspace ((int) (unsigned char) t[p]))
+                  p++;
+               if (t[p] != '"')
+                  return fail (j, "Expecting tag", p);
+               if (parse_value (j, &p, depth + 1))
+                  return -1;
+               j->toks[j->count - 1].type = JO_TAG;
+               while (isspace ((int) (unsigned char) t[p]))
+                  p++;
+               if (t[p] != ':')
+                  return fail (j, "Expecting :", p);
+               p++;
+            }
+            if (parse_value (j, &p, depth + 1))
+               return -1;
+            while (isspace ((int) (unsigned char) t[p]))
+               p++;
+            if (t[p] != ',')
+               break;
+            p++;
+         }
+      if (t[p] != (c == '{' ? '}' : ']'))
+         return fail (j, c == '{' ? "Expecting }" : "Expecting ]", p);
+      add (j, JO_CLOSE, p, 1);
+      j->toks[me].end = j->count;
+      *pp = p + 1;
+      return 0;
+   }
+   if (c == '-' || isdigit ((int) (unsigned char) c))
+   {
+      uint32_t s = p;
+      if (t[p] == '-')
+         p++;
+      if (!isdigit ((int) (unsigned char) t[p]))
+         return fail (j, "Bad number", s);
+      while (isdigit ((int) (unsigned char) t[p]))
+         p++;
+      if (t[p] == '.')
+      {
+         p++;
+         if (!isdigit ((int) (unsigned char) t[p]))
+            return fail (j, "Bad number", s);
+         while (isdigit ((int) (unsigned char) t[p]))
+            p++;
+      }
+      if (t[p] == 'e' || t[p] == 'E')
+      {
+         p++;
+         if (t[p] == '+' || t[p] == '-')
+            p++;
+         if (!isdigit ((int) (unsigned char) t[p]))
+            return fail (j, "Bad number", s);
+         while (isdigit ((int) (unsigned char) t[p]))
+            p++;
+      }
+      add (j, JO_NUMBER, s, p - s);
+      *pp = p;
+      return 0;
+   }
+   static const struct
+   {
+      const char *word;
+      jo_type_t type;
+   } words[] = { {"true", JO_TRUE}, {"false", JO_FALSE}, {"null", JO_NULL} };
+   for (int w = 0; w < 3; w++)
+      if (!strncmp (t + p, words[w].word, strlen (words[w].word)))
+      {
+         add (j, words[w].type, p, strlen (words[w].word));
+         *pp = p + strlen (words[w].word);
+         return 0;
+      }
+   return fail (j, c ? "Bad JSON" : "Unexpected end", p);
+}
+
+jo_t
+jo_parse_mem (const void *buf, size_t len)
+{
+   jo_t j = calloc (1, sizeof (*j));
+   j->text = malloc (len + 1);
+   if (len)
+      memcpy (j->text, buf, len);
+   j->text[len] = 0;
+   if (strlen (j->text) != len)
+      fail (j, "Null in JSON", strlen (j->text));
+   else
+   {
+      uint32_t p = 0;
+      if (!parse_value (j, &p, 0))
+      {
+         while (isspace ((int) (unsigned char) j->text[p]))
+            p++;
+         if (j->text[p])
+            fail (j, "Extra after JSON", p);
+      }
+   }
+   if (j->error)
+      j->count = 0;
+   return j;
+}
+
+jo_t
+jo_parse_str (const char *s)
+{
+   return jo_parse_mem (s, s ? strlen (s) : 0);
+}
+
+const char *
+jo_error (jo_t j, int *pos)
+{
+   if (!j)
+      return "No JSON";
+   if (pos)
+      *pos = j->errpos;
+   return j->error;
+}
+
+jo_type_t
+jo_here (jo_t j)
+{
+   if (!j || j->here >= j->count)
+      return JO_END;
+   return j->toks[j->here].type;
+}
+
+jo_type_t
+jo_next (jo_t j)
+{                               // Into objects and arrays, over values and closes
+   if (!j || j->here >= j->count)
+      return JO_END;
+   j->here++;
+   return jo_here (j);
+}
+
+jo_type_t
+jo_skip (jo_t j)
+{                               // Over value, or tag and its value, including whole objects and arrays
+   if (!j || j->here >= j->count)
+      return JO_END;
+   if (j->toks[j->here].type == JO_TAG)
+      j->here++;
+   if (j->here < j->count && (j->toks[j->here].type == JO_OBJECT || j->toks[j->here].type == JO_ARRAY))
+      j->here = j->toks[j->here].end;
+   else
+      j->here++;
+   return jo_here (j);
+}
+
+void
+jo_rewind (jo_t j)
+{
+   if (j)
+      j->here = 0;
+}
+
+jo_type_t
+jo_find (jo_t j, const char *path)
+{                               // Tag path, dot separated, from the top level object
+   jo_rewind (j);
+   if (jo_here (j) != JO_OBJECT)
+      return JO_END;
+   while (path && *path)
+   {
+      const char *dot = strchr (path, '.');
+      size_t l = (dot ? dot - path : strlen (path));
+      jo_type_t t = jo_next (j);
+      while (t == JO_TAG)
+      {
+         tok_t *k = &j->toks[j->here];
+         if (k->len == l && !strncmp (j->text + k->pos, path, l))
+            break;
+         t = jo_skip (j);
+      }
+      if (t != JO_TAG)
+         return JO_END;
+      t = jo_next (j);
+      if (!dot)
+         return t;
+      if (t != JO_OBJECT)
+         return JO_END;
+      path = dot + 1;
+   }
+   return JO_END;
+}
+
+static ssize_t
+decode (jo_t j, char *out, size_t max)
+{                               // Decode current string, tag or number, returns full length, writes up to max including a null
+   if (!j || j->here >= j->count)
+      return -1;
+   tok_t *k = &j->toks[j->here];
+   if (k->type != JO_STRING && k->type != JO_TAG && k->type != JO_NUMBER)
+      return -1;
+   const char *t = j->text + k->pos,
+      *e = t + k->len;
+   size_t n = 0;
+   void put (uint8_t c)
+   {
+      if (out && n + 1 < max)
+         out[n] = c;
+      n++;
+   }
+   while (t < e)
+   {
+      if (*t != '\\' || k->type == JO_NUMBER)
+      {
+         put (*t++);
+         continue;
+      }
+      t++;
+      char c = *t++;
+      if (c == 'u')
+      {
+         unsigned int u = 0;
+         sscanf (t, "%4x", &u);
+         t += 4;
+         if (u < 0x80)
+            put (u);
+         else if (u < 0x800)
+         {
+            put (0xC0 | (u >> 6));
+            put (0x80 | (u & 0x3F));
+         } else
+         {
+            put (0xE0 | (u >> 12));
+            put (0x80 | ((u >> 6) & 0x3F));
+            put (0x80 | (u & 0x3F));
+         }
+      } else
+         put (c == 'b' ? '\b' : c == 'f' ? '\f' : c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : c);
+   }
+   if (out && max)
+      out[n < max ? n : max - 1] = 0;
+   return n;
+}
+
+ssize_t
+jo_strlen (jo_t j)
+{
+   return decode (j, NULL, 0);
+}
+
+ssize_t
+jo_strncpy (jo_t j, void *buf, size_t len)
+{
+   return decode (j, buf, len);
+}
+
+char *
+jo_strdup (jo_t j)
+{
+   ssize_t l = decode (j, NULL, 0);
+   if (l < 0)
+      return NULL;
+   char *s = malloc (l + 1);
+   decode (j, s, l + 1);
+   return s;
+}
+
+int
+jo_strcmp (jo_t j, const char *s)
+{
+   char *v = jo_strdup (j);
+   if (!v)
+      return -1;
+   int r = strcmp (v, s);
+   free (v);
+   return r;
+}
+
+int64_t
+jo_read_int (jo_t j)
+{
+   char v[40] = "";
+   jo_strncpy (j, v, sizeof (v));
+   return strtoll (v, NULL, 10);
+}
+
+double
+jo_read_float (jo_t j)
+{
+   char v[40] = "";
+   jo_strncpy (j, v, sizeof (v));
+   return strtod (v, NULL);
+}
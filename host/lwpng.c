@@ -0,0 +1,503 @@
+// Host stand-in for the ESP32-LWPNG component, using zlib
+// Decodes all PNG colour types and bit depths, with Adam7 interlace, calling back each pixel as 16 bit RGBA.
+// Data is collected by lwpng_data and decoded by lwpng_decoded, every length and size is checked, as this is a fuzz target.
+
+#include "host.h"
+#include "lwpng.h"
+
+#define	MAXPIXELS	(16*1024*1024)  // Refuse anything bigger than this before allocating for it
+#define	MAXRAW		(64*1024*1024)  // Inflated data limit
+
+struct lwpng_decode_s
+{
+   void *opaque;
+   lwpng_info_t *info;
+   lwpng_pixel_t *pixel;
+   lwpng_alloc_t *alloc;
+   lwpng_free_t *free;
+   void *allocopaque;
+   uint8_t *data;
+   size_t len;
+   const char *error;
+};
+
+struct lwpng_encode_s
+{
+   uint32_t w,
+     h,
+     y;
+   lwpng_alloc_t *alloc;
+   lwpng_free_t *free;
+   void *allocopaque;
+   z_stream z;
+   uint8_t *out;
+   size_t size,
+     used;
+   const char *error;
+};
+
+static const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+static uint32_t
+be32 (const uint8_t * p)
+{
+   return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void *
+def_alloc (void *opaque, uInt items, uInt size)
+{
+   return calloc (items, size);
+}
+
+static void
+def_free (void *opaque, void *address)
+{
+   free (address);
+}
+
+const char *
+lwpng_get_info (uint32_t len, const uint8_t * data, uint32_t * w, uint32_t * h)
+{
+   if (len < 8 + 8 + 13 || memcmp (data, sig, 8))
+      return "Not PNG";
+   if (be32 (data + 8) != 13 || memcmp (data + 12, "IHDR", 4))
+      return "No IHDR";
+   if (w)
+      *w = be32 (data + 16);
+   if (h)
+      *h = be32 (data + 20);
+   return NULL;
+}
+
+lwpng_decode_t *
+lwpng_decode (void *opaque, lwpng_info_t * info, lwpng_pixel_t * pixel, lwpng_alloc_t * alloc, lwpng_free_t * free,
+              void *allocopaque)
+{
+   if (!alloc)
+      alloc = def_alloc;
+   if (!free)
+      free = def_free;
+   lwpng_decode_t *p = alloc (allocopaque, 1, sizeof (*p));
+   if (!p)
+      return NULL;
+   memset (p, 0, sizeof (*p));
+   p->opaque = opaque;
+   p->info = info;
+   p->pixel = pixel;
+   p->alloc = alloc;
+   p->free = free;
+   p->allocopaque = allocopaque;
+   return p;
+}
+
+const char *
+lwpng_data (lwpng_decode_t * p, size_t len, const uint8_t * data)
+{
+   if (!p)
+      return "No decoder";
+   if (p->error || !len)
+      return p->error;
+   uint8_t *n = p->alloc (p->allocopaque, 1, p->len + len);
+   if (!n)
+      return p->error = "No memory";
+   if (p->len)
+      memcpy (n, p->data, p->len);
+   memcpy (n + p->len, data, len);
+   if (p->data)
+      p->free (p->allocopaque, p->data);
+   p->data = n;
+   p->len += len;
+   return NULL;
+}
+
+static uint8_t
+paeth (uint8_t a, uint8_t b, uint8_t c)
+{
+   int p = a + b - c,
+      pa = abs (p - a),
+      pb = abs (p - b),
+      pc = abs (p - c);
+   return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+static const char *
+decode (lwpng_decode_t * p)
+{
+   const uint8_t *d = p->data,
+      *e = p->data + p->len;
+   uint32_t w,
+     h;
+   const char *er = lwpng_get_info (p->len, d, &w, &h);
+   if (er)
+      return er;
+   uint8_t depth = d[24],
+      colour = d[25],
+      interlace = d[28];
+   if (!w || !h || (uint64_t) w * h > MAXPIXELS)
+      return "Bad size";
+   if (d[26] || d[27] || interlace > 1)
+      return "Bad IHDR";
+   uint8_t channels = (colour == 0 ? 1 : colour == 2 ? 3 : colour == 3 ? 1 : colour == 4 ? 2 : colour == 6 ? 4 : 0);
+   if (!channels)
+      return "Bad colour type";
+   if (colour == 0 ? (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)
+       : colour == 3 ? (depth != 1 && depth != 2 && depth != 4 && depth != 8) : (depth != 8 && depth != 16))
+      return "Bad bit depth";
+   if (p->info && (er = p->info (p->opaque, w, h, depth, colour)))
+      return er;
+   uint8_t plte[256][3] = { 0 },
+      trns[256];
+   memset (trns, 0xFF, sizeof (trns));
+   int plen = 0;
+   uint16_t tkey[3] = { 0 };
+   uint8_t hastkey = 0;
+   // Inflate IDAT chunks as they come
+   uint32_t bpp = (channels * depth + 7) / 8;   // Filter distance in bytes
+   uint64_t total = 0;
+   static const uint8_t ax[7] = { 0, 4, 0, 2, 0, 1, 0 },
+      ay[7] = { 0, 0, 4, 0, 2, 0, 1 },
+      dx[7] = { 8, 8, 4, 4, 2, 2, 1 },
+      dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+   for (int pass = 0; pass < (interlace ? 7 : 1); pass++)
+   {
+      uint32_t pw = (interlace ? (w > ax[pass] ? (w - ax[pass] + dx[pass] - 1) / dx[pass] : 0) : w),
+         ph = (interlace ? (h > ay[pass] ? (h - ay[pass] + dy[pass] - 1) / dy[pass] : 0) : h);
+      if (pw && ph)
+         total += ((uint64_t) pw * channels * depth + 7) / 8 * ph + ph;
+   }
+   if (total > MAXRAW)
+      return "Too big";
+   uint8_t *raw = p->alloc (p->allocopaque, 1, total);
+   if (!raw)
+      return "No memory";
+   z_stream z = {.zalloc = p->alloc,.zfree = p->free,.opaque = p->allocopaque,.next_out = raw,.avail_out = total };
+   if (inflateInit (&z) != Z_OK)
+   {
+      p->free (p->allocopaque, raw);
+      return "Inflate init";
+   }
+   int zr = Z_OK;
+   uint8_t iend = 0;
+   d += 8;
+   while (!iend)
+   {
+      if (e - d < 12)
+      {
+         er = "Truncated";
+         break;
+      }
+      uint32_t l = be32 (d);
+      if (l > e - d - 12)
+      {
+         er = "Bad chunk length";
+         break;
+      }
+      const uint8_t *type = d + 4,
+         *c = d + 8;
+      if (!memcmp (type, "PLTE", 4))
+      {
+         if (l % 3 || l > 768)
+         {
+            er = "Bad PLTE";
+            break;
+         }
+         plen = l / 3;
+         memcpy (plte, c, l);
+      } else if (!memcmp (type, "tRNS", 4))
+      {
+         if (colour == 3 && l <= 256)
+            memcpy (trns, c, l);
+         else if (colour == 0 && l == 2)
+         {
+            tkey[0] = c[0] << 8 | c[1];
+            hastkey = 1;
+         } else if (colour == 2 && l == 6)
+         {
+            for (int n = 0; n < 3; n++)
+               tkey[n] = c[n * 2] << 8 | c[n * 2 + 1];
+            hastkey = 1;
+         }
+      } else if (!memcmp (type, "IDAT", 4) && zr == Z_OK)
+      {
+         z.next_in = (uint8_t *) c;
+         z.avail_in = l;
+         while (z.avail_in && zr == Z_OK && z.avail_out)
+            zr = inflate (&z, Z_NO_FLUSH);
+         if (zr != Z_OK && zr != Z_STREAM_END)
+         {
+            er = "Bad compressed data";
+            break;
+         }
+      } else if (!memcmp (type, "IEND", 4))
+         iend = 1;
+      d += 12 + l;
+   }
+   inflateEnd (&z);
+   if (!er && z.avail_out)
+      er = "Short image data";
+   if (!er && colour == 3 && !plen)
+      er = "No PLTE";
+   // Unfilter and send pixels
+   uint8_t *r = raw;
+   for (int pass = 0; !er && pass < (interlace ? 7 : 1); pass++)
+   {
+      uint32_t pw = (interlace ? (w > ax[pass] ? (w - ax[pass] + dx[pass] - 1) / dx[pass] : 0) : w),
+         ph = (interlace ? (h > ay[pass] ? (h - ay[pass] + dy[pass] - 1) / dy[pass] : 0) : h);
+      if (!pw || !ph)
+         continue;
+      size_t stride = ((uint64_t) pw * channels * depth + 7) / 8;
+      uint8_t *prev = NULL;
+      for (uint32_t y = 0; !er && y < ph; y++)
+      {
+         uint8_t f = *r++;
+         for (size_t x = 0; x < stride; x++)
+         {
+            uint8_t a = (x >= bpp ? r[x - bpp] : 0),
+               b = (prev ? prev[x] : 0),
+               c = (prev && x >= bpp ? prev[x - bpp] : 0);
+            switch (f)
+            {
+            case 0:
+               break;
+            case 1:
+               r[x] += a;
+               break;
+            case 2:
+               r[x] += b;
+               break;
+            case 3:
+               r[x] += (a + b) / 2;
+               break;
+            case 4:
+               r[x] += paeth (a, b, c);
+               break;
+            default:
+               er = "Bad filter";
+            }
+         }
+         for (uint32_t x = 0; !er && x < pw; x++)
+         {
+            uint16_t v[4];
+            for (int ch = 0; ch < channels; ch++)
+            {
+               uint32_t bit = (x * channels + ch) * depth;
+               if (depth == 16)
+                  v[ch] = r[bit / 8] << 8 | r[bit / 8 + 1];
+               else if (depth == 8)
+                  v[ch] = r[bit / 8];
+               else
+                  v[ch] = (r[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+            }
+            uint16_t R,
+              G,
+              B,
+              A = 0xFFFF;
+            if (colour == 3)
+            {
+               if (v[0] >= plen)
+               {
+                  er = "Bad palette index";
+                  break;
+               }
+               R = plte[v[0]][0] * 257;
+               G = plte[v[0]][1] * 257;
+               B = plte[v[0]][2] * 257;
+               A = trns[v[0]] * 257;
+            } else
+            {
+               uint32_t max = (1 << depth) - 1;
+               uint16_t s[4];
+               for (int ch = 0; ch < channels; ch++)
+                  s[ch] = v[ch] * 65535U / max;
+               if (colour == 0 || colour == 4)
+               {
+                  R = G = B = s[0];
+                  if (colour == 4)
+                     A = s[1];
+                  else if (hastkey && v[0] == tkey[0])
+                     A = 0;
+               } else
+               {
+                  R = s[0];
+                  G = s[1];
+                  B = s[2];
+                  if (colour == 6)
+                     A = s[3];
+                  else if (hastkey && v[0] == tkey[0] && v[1] == tkey[1] && v[2] == tkey[2])
+                     A = 0;
+               }
+            }
+            uint32_t X = (interlace ? ax[pass] + x * dx[pass] : x),
+               Y = (interlace ? ay[pass] + y * dy[pass] : y);
+            if (p->pixel && (er = p->pixel (p->opaque, X, Y, R, G, B, A)))
+               break;
+         }
+         prev = r;
+         r += stride;
+      }
+   }
+   p->free (p->allocopaque, raw);
+   return er;
+}
+
+const char *
+lwpng_decoded (lwpng_decode_t ** pp)
+{
+   lwpng_decode_t *p = *pp;
+   if (!p)
+      return "No decoder";
+   *pp = NULL;
+   const char *er = p->error;
+   if (!er)
+      er = decode (p);
+   if (p->data)
+      p->free (p->allocopaque, p->data);
+   p->free (p->allocopaque, p);
+   return er;
+}
+
+// Encode, 1 bit grey
+
+static void
+put (lwpng_encode_t * p, const void *data, size_t len)
+{
+   if (p->error)
+      return;
+   if (p->used + len > p->size)
+   {
+      size_t size = (p->used + len) * 2 + 1024;
+      uint8_t *n = p->alloc (p->allocopaque, 1, size);
+      if (!n)
+      {
+         p->error = "No memory";
+         return;
+      }
+      if (p->used)
+         memcpy (n, p->out, p->used);
+      if (p->out)
+         p->free (p->allocopaque, p->out);
+      p->out = n;
+      p->size = size;
+   }
+   memcpy (p->out + p->used, data, len);
+   p->used += len;
+}
+
+static void
+put32 (lwpng_encode_t * p, uint32_t v)
+{
+   uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+   put (p, b, 4);
+}
+
+static void
+chunk (lwpng_encode_t * p, const char *type, const uint8_t * data, uint32_t len)
+{
+   put32 (p, len);
+   put (p, type, 4);
+   if (len)
+      put (p, data, len);
+   uint32_t crc = crc32 (0, (const uint8_t *) type, 4);
+   if (len)
+      crc = crc32 (crc, data, len);
+   put32 (p, crc);
+}
+
+static void
+deflate_out (lwpng_encode_t * p, int flush)
+{                               // Compress what is pending in to IDAT chunks
+   uint8_t buf[4096];
+   int r;
+   do
+   {
+      p->z.next_out = buf;
+      p->z.avail_out = sizeof (buf);
+      r = deflate (&p->z, flush);
+      if (r == Z_STREAM_ERROR)
+      {
+         p->error = "Deflate failed";
+         return;
+      }
+      if (sizeof (buf) - p->z.avail_out)
+         chunk (p, "IDAT", buf, sizeof (buf) - p->z.avail_out);
+   }
+   while (!p->z.avail_out || (flush == Z_FINISH && r != Z_STREAM_END));
+}
+
+lwpng_encode_t *
+lwpng_encode_1bit (uint32_t w, uint32_t h, lwpng_alloc_t * alloc, lwpng_free_t * free, void *allocopaque)
+{
+   if (!alloc)
+      alloc = def_alloc;
+   if (!free)
+      free = def_free;
+   lwpng_encode_t *p = alloc (allocopaque, 1, sizeof (*p));
+   if (!p)
+      return NULL;
+   memset (p, 0, sizeof (*p));
+   p->w = w;
+   p->h = h;
+   p->alloc = alloc;
+   p->free = free;
+   p->allocopaque = allocopaque;
+   p->z.zalloc = alloc;
+   p->z.zfree = free;
+   p->z.opaque = allocopaque;
+   if (deflateInit (&p->z, 9) != Z_OK)
+      p->error = "Deflate init";
+   put (p, sig, 8);
+   uint8_t ihdr[13] = { w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h, 1, 0, 0, 0, 0 };
+   chunk (p, "IHDR", ihdr, sizeof (ihdr));
+   return p;
+}
+
+const char *
+lwpng_encode_scanline (lwpng_encode_t * p, const uint8_t * data)
+{
+   if (!p)
+      return "No encoder";
+   if (p->error)
+      return p->error;
+   if (p->y++ >= p->h)
+      return p->error = "Too many scanlines";
+   uint8_t f = 0;
+   p->z.next_in = &f;
+   p->z.avail_in = 1;
+   deflate_out (p, Z_NO_FLUSH);
+   p->z.next_in = (uint8_t *) data;
+   p->z.avail_in = (p->w + 7) / 8;
+   deflate_out (p, Z_NO_FLUSH);
+   return p->error;
+}
+
+const char *
+lwpng_encoded (lwpng_encode_t ** pp, size_t *len, uint8_t ** data)
+{
+   lwpng_encode_t *p = *pp;
+   *len = 0;
+   *data = NULL;
+   if (!p)
+      return "No encoder";
+   *pp = NULL;
+   if (!p->error && p->y != p->h)
+      p->error = "Missing scanlines";
+   if (!p->error)
+   {
+      p->z.next_in = NULL;
+      p->z.avail_in = 0;
+      deflate_out (p, Z_FINISH);
+   }
+   deflateEnd (&p->z);
+   if (!p->error)
+      chunk (p, "IEND", NULL, 0);
+   const char *er = p->error;
+   if (!er)
+   {
+      *data = p->out;
+      *len = p->used;
+   } else if (p->out)
+      p->free (p->allocopaque, p->out);
+   p->free (p->allocopaque, p);
+   return er;
+}
@@ -0,0 +1,415 @@
+// Deterministic event replay, runs the doorbell application on the host against a script of timestamped events
+// Usage: doorbell-replay [-q] [-i imagedir] [-s setting=value]... [-x infotag]... script.json
+// Prints MQTT output and a report to stdout, with virtual times, the same every run for the same inputs.
+
+#include "host.h"
+#include <getopt.h>
+
+void app_main (void);
+uint32_t push_target (void);
+int push_visible (uint32_t target);
+
+#define	WAITTIME	30      // Max wait for a push to show (s), as the application
+#define	POLL		10      // Poll for pushed screen (ms), only whilst one is pending
+#define	PUSHHOLD	100     // Button held for (ms)
+
+typedef struct event_s
+{
+   int64_t at;                  // Virtual time (us)
+   uint8_t push:1;
+   char *cmd,
+    *value,
+    *topic,
+    *payload,
+    *get,
+    *put,
+    *file,
+    *images,
+    *season;
+   int offline,
+     mqtt_offline;
+   char **set;                  // name=value pairs, NULL terminated
+} event_t;
+
+static event_t *events = NULL;
+static int event_count = 0;
+static const char *script_error = NULL;
+static char **exclude = NULL;
+static int excludes = 0;
+
+static void
+stamp (void)
+{
+   printf ("%4lld.%03lld ", (long long) (sim_now / 1000000), (long long) (sim_now / 1000 % 1000));
+}
+
+static void
+mqtt_hook (const char *topic, const char *payload)
+{
+   for (int x = 0; x < excludes; x++)
+   {                            // info/app/tag
+      const char *t = strrchr (topic, '/');
+      if (t && !strncmp (topic, "info/", 5) && !strcmp (t + 1, exclude[x]))
+         return;
+   }
+   stamp ();
+   printf ("%s %s\n", topic, payload);
+}
+
+static void
+load (const char *file)
+{                               // Read script, an array of objects
+   FILE *f = fopen (file, "r");
+   if (!f)
+   {
+      perror (file);
+      exit (1);
+   }
+   char *text = NULL;
+   size_t len = 0;
+   FILE *o = open_memstream (&text, &len);
+   char buf[4096];
+   size_t l;
+   while ((l = fread (buf, 1, sizeof (buf), f)) > 0)
+      fwrite (buf, 1, l, o);
+   fclose (o);
+   fclose (f);
+   jo_t j = jo_parse_mem (text, len);
+   jo_type_t t = jo_here (j);
+   if (t == JO_ARRAY)
+      t = jo_next (j);
+   while (t == JO_OBJECT)
+   {
+      events = realloc (events, (event_count + 1) * sizeof (*events));
+      event_t *e = &events[event_count++];
+      memset (e, 0, sizeof (*e));
+      e->offline = e->mqtt_offline = -1;
+      t = jo_next (j);
+      while (t == JO_TAG)
+      {
+         char tag[20] = "";
+         jo_strncpy (j, tag, sizeof (tag));
+         t = jo_next (j);
+         if (t == JO_NUMBER && !strcmp (tag, "t"))
+            e->at = jo_read_float (j) * 1000000;
+         else if (t == JO_TRUE && !strcmp (tag, "push"))
+            e->push = 1;
+         else if (t == JO_STRING && !strcmp (tag, "cmd"))
+            e->cmd = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "value"))
+            e->value = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "topic"))
+            e->topic = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "payload"))
+            e->payload = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "get"))
+            e->get = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "put"))
+            e->put = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "file"))
+            e->file = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "images"))
+            e->images = jo_strdup (j);
+         else if (t == JO_STRING && !strcmp (tag, "season"))
+            e->season = jo_strdup (j);
+         else if (t == JO_NUMBER && !strcmp (tag, "offline"))
+            e->offline = jo_read_int (j);
+         else if (t == JO_NUMBER && !strcmp (tag, "mqtt_offline"))
+            e->mqtt_offline = jo_read_int (j);
+         else if (t == JO_OBJECT && !strcmp (tag, "set"))
+         {
+            int n = 0;
+            t = jo_next (j);
+            while (t == JO_TAG)
+            {
+               char *name = jo_strdup (j);
+               t = jo_next (j);
+               char *v = jo_strdup (j);
+               e->set = realloc (e->set, (n + 2) * sizeof (*e->set));
+               if (asprintf (&e->set[n], "%s=%s", name, v ? : "") >= 0)
+                  n++;
+               e->set[n] = NULL;
+               free (name);
+               free (v);
+               t = jo_skip (j);
+            }
+            t = jo_next (j);    // Past close
+            continue;
+         } else
+         {
+            fprintf (stderr, "Unknown event tag %s\n", tag);
+            exit (1);
+         }
+         t = jo_skip (j);
+      }
+      t = jo_next (j);
+   }
+   script_error = jo_error (j, NULL);
+   if (script_error)
+   {
+      fprintf (stderr, "%s: %s\n", file, script_error);
+      exit (1);
+   }
+   jo_free (&j);
+   free (text);
+}
+
+static void
+set (const char *nv)
+{
+   char *n = strdup (nv);
+   char *v = strchr (n, '=');
+   if (!v)
+   {
+      fprintf (stderr, "Expecting setting=value: %s\n", nv);
+      exit (1);
+   }
+   *v++ = 0;
+   const char *e = host_setting (n, v);
+   if (e)
+   {
+      fprintf (stderr, "%s: %s\n", n, e);
+      exit (1);
+   }
+   free (n);
+}
+
+static jo_t
+json_value (const char *v, int string)
+{                               // Parsed JSON, or a JSON string of the text
+   if (!v)
+      return NULL;
+   if (!string)
+   {
+      jo_t j = jo_parse_str (v);
+      if (!jo_error (j, NULL))
+         return j;
+      jo_free (&j);
+   }
+   jo_t s = jo_create_alloc ();
+   jo_string (s, NULL, v);
+   char *t = jo_finisha (&s);
+   jo_t j = jo_parse_str (t);
+   free (t);
+   return j;
+}
+
+static uint32_t
+metric (const char *text, const char *name)
+{
+   size_t l = strlen (name);
+   for (const char *p = text; p && *p; p = strchr (p, '\n'), p = (p ? p + 1 : NULL))
+      if (!strncmp (p, name, l) && p[l] == ' ')
+         return strtoul (p + l + 1, NULL, 10);
+   return 0;
+}
+
+static void
+main_task (void *arg)
+{
+   app_main ();
+}
+
+static void
+replay_task (void *arg)
+{
+   int pushes = 0,
+      seen = 0;
+   int64_t lat_min = 0,
+      lat_max = 0,
+      lat_sum = 0;
+   uint32_t pend_target = 0;
+   int64_t pend_start = 0;      // Push waiting for the pushed screen to be visible
+   void poll (void)
+   {
+      if (pend_start && push_visible (pend_target))
+      {                         // Visible when the panel update with it in finishes, or now if it needed no panel update
+         int64_t l = (host_gfx.done > pend_start ? host_gfx.done : sim_now) - pend_start;
+         if (!seen || l < lat_min)
+            lat_min = l;
+         if (!seen || l > lat_max)
+            lat_max = l;
+         lat_sum += l;
+         seen++;
+         pend_start = 0;
+      }
+   }
+   void wait_until (int64_t at)
+   {                            // Only wakes to poll if a push is pending
+      while (sim_now < at)
+      {
+         poll ();
+         sim_wait (pend_start && at - sim_now > POLL * 1000 ? POLL * 1000 : at - sim_now);
+      }
+      poll ();
+   }
+   for (int n = 0; n < event_count; n++)
+   {
+      event_t *e = &events[n];
+      wait_until (e->at);
+      if (e->set)
+      {
+         for (char **s = e->set; *s; s++)
+            set (*s);
+         host_app_callback (0, topiccommand, NULL, "setting", NULL);
+      }
+      if (e->images)
+         host_images = e->images;
+      if (e->offline >= 0)
+         host_offline = sim_now + e->offline * 1000000LL;
+      if (e->mqtt_offline >= 0)
+         host_mqtt_offline = sim_now + e->mqtt_offline * 1000000LL;
+      if (e->season)
+         host_season = *e->season;
+      if (e->push || (e->cmd && !strcmp (e->cmd, "push")))
+      {                         // Latency to the pushed screen being shown
+         pushes++;
+         if (!pend_start)
+         {
+            pend_target = push_target ();
+            pend_start = sim_now;
+         }
+      }
+      if (e->cmd)
+      {                         // As an MQTT command
+         jo_t j = json_value (e->value, 1);
+         host_app_callback (0, topiccommand, NULL, e->cmd, j);
+         jo_free (&j);
+      }
+      if (e->topic)
+      {                         // As an MQTT message, prefix/target/suffix
+         char *prefix = strdup (e->topic),
+            *target = strchr (prefix, '/'),
+            *suffix = NULL;
+         if (target)
+         {
+            *target++ = 0;
+            if ((suffix = strchr (target, '/')))
+               *suffix++ = 0;
+         }
+         jo_t j = json_value (e->payload, 0);
+         host_app_callback (0, prefix, target, suffix, j);
+         jo_free (&j);
+         free (prefix);
+      }
+      if (e->get)
+      {
+         char *reply = NULL;
+         int status = host_request (HTTP_GET, e->get, NULL, NULL, 0, &reply, NULL);
+         stamp ();
+         printf ("GET %s %d\n", e->get, status);
+         free (reply);
+      }
+      if (e->put)
+      {                         // Upload file from the images directory, or an empty body
+         char *fn = NULL;
+         char *body = NULL;
+         size_t len = 0;
+         FILE *f = NULL;
+         if (e->file && asprintf (&fn, "%s/%s", host_images ? : ".", e->file) >= 0 && (f = fopen (fn, "r")))
+         {
+            FILE *o = open_memstream (&body, &len);
+            char buf[4096];
+            size_t l;
+            while ((l = fread (buf, 1, sizeof (buf), f)) > 0)
+               fwrite (buf, 1, l, o);
+            fclose (o);
+            fclose (f);
+         }
+         free (fn);
+         int status = host_request (HTTP_PUT, e->put, NULL, body, len, NULL, NULL);
+         stamp ();
+         printf ("PUT %s %d\n", e->put, status);
+         free (body);
+      }
+      if (e->push)
+      {                         // Button down, then up
+         host_button (1);
+         wait_until (sim_now + PUSHHOLD * 1000);
+         host_button (0);
+      }
+   }
+   if (pend_start)
+      wait_until (pend_start + WAITTIME * 1000000LL);
+   char *m = NULL;
+   host_request (HTTP_GET, "/metrics", NULL, NULL, 0, &m, NULL);
+   jo_t r = jo_object_alloc ();
+   jo_int (r, "events", event_count);
+   jo_int (r, "duration_ms", sim_now / 1000);
+   jo_int (r, "pushes", pushes);
+   jo_int (r, "visible", seen);
+   if (seen)
+   {
+      jo_int (r, "latency_min_ms", lat_min / 1000);
+      jo_int (r, "latency_avg_ms", lat_sum / seen / 1000);
+      jo_int (r, "latency_max_ms", lat_max / 1000);
+   }
+   jo_int (r, "panel_updates", host_gfx.updates);
+   jo_int (r, "panel_full", host_gfx.full);
+   jo_stringf (r, "panel_crc", "%08X", host_gfx.crc);
+   jo_int (r, "refresh_full", metric (m, "doorbell_refresh_total{type=\"full\"}"));
+   jo_int (r, "refresh_partial", metric (m, "doorbell_refresh_total{type=\"partial\"}"));
+   jo_int (r, "cache_hit", metric (m, "doorbell_cache_total{result=\"hit\"}"));
+   jo_int (r, "cache_miss", metric (m, "doorbell_cache_total{result=\"miss\"}"));
+   jo_int (r, "http_200", metric (m, "doorbell_download_total{status=\"200\"}"));
+   jo_int (r, "http_404", metric (m, "doorbell_download_total{status=\"404\"}"));
+   jo_int (r, "http_failed", metric (m, "doorbell_download_total{status=\"failed\"}"));
+   jo_int (r, "decode_count", metric (m, "doorbell_decode_seconds_count"));
+   jo_int (r, "blit_count", metric (m, "doorbell_blit_seconds_count"));
+   jo_int (r, "mqtt_sent", metric (m, "doorbell_mqtt_total{result=\"sent\"}"));
+   jo_int (r, "mqtt_dropped", metric (m, "doorbell_mqtt_total{result=\"dropped\"}"));
+   jo_int (r, "main_loops", metric (m, "doorbell_task_loops_total{task=\"main\"}"));
+   jo_int (r, "led_updates", host_led_refresh);
+   // Duty cycle, time the CPU could light sleep (only with powersave), and how often each task ran
+   jo_int (r, "cpu_wakeups", sim_cpu.wakeups);
+   jo_int (r, "cpu_awake_ms", sim_cpu.awake_us / 1000);
+   jo_int (r, "cpu_sleep_ms", sim_cpu.sleep_us / 1000);
+   sim_tasks (r);
+   free (m);
+   char *report = jo_finisha (&r);
+   stamp ();
+   printf ("report %s\n", report);
+   free (report);
+   fflush (stdout);
+   sim_stop ();
+   vTaskDelay (portMAX_DELAY);
+}
+
+int
+main (int argc, char *argv[])
+{
+   setenv ("TZ", "UTC", 1);
+   tzset ();
+   int c;
+   while ((c = getopt (argc, argv, "qi:s:x:")) > 0)
+      switch (c)
+      {
+      case 'q':
+         host_quiet = 1;
+         break;
+      case 'i':
+         host_images = optarg;
+         break;
+      case 's':
+         set (optarg);
+         break;
+      case 'x':
+         exclude = realloc (exclude, (excludes + 1) * sizeof (*exclude));
+         exclude[excludes++] = optarg;
+         break;
+      default:
+         fprintf (stderr, "Usage: %s [-q] [-i imagedir] [-s setting=value]... [-x infotag]... script.json\n", argv[0]);
+         return 1;
+      }
+   if (optind + 1 != argc)
+   {
+      fprintf (stderr, "Expecting one script file\n");
+      return 1;
+   }
+   load (argv[optind]);
+   host_mqtt_hook = mqtt_hook;
+   sim_task ("main", main_task, NULL);
+   sim_task ("replay", replay_task, NULL);
+   sim_run ();
+   return 0;
+}
@@ -0,0 +1,405 @@
+// Host stand-in for the ESP32-RevK component, application start, MQTT, settings and web helpers
+// MQTT messages go to host_mqtt_hook, so the program driving the run decides what to print
+
+#include "host.h"
+#include "esp_timer.h"
+
+const char *revk_app = "Doorbell";
+const char *revk_id = "112233445566";
+app_callback_t *host_app_callback = NULL;
+void (*host_mqtt_hook) (const char *topic, const char *payload) = NULL;
+int64_t host_mqtt_offline = 0;
+char host_season = 0;
+
+static uint8_t link_up = 0;
+
+const uint8_t gamma8[256] = {
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+   2, 3, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5,
+   5, 6, 6, 6, 6, 7, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10,
+   10, 10, 11, 11, 11, 12, 12, 13, 13, 13, 14, 14, 15, 15, 16, 16,
+   17, 17, 18, 18, 19, 19, 20, 20, 21, 21, 22, 22, 23, 24, 24, 25,
+   25, 26, 27, 27, 28, 29, 29, 30, 31, 32, 32, 33, 34, 35, 35, 36,
+   37, 38, 39, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 50,
+   51, 52, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 66, 67, 68,
+   69, 70, 72, 73, 74, 75, 77, 78, 79, 81, 82, 83, 85, 86, 87, 89,
+   90, 92, 93, 95, 96, 98, 99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
+   115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
+   144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
+   177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
+   215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255,
+};
+
+// Application
+
+static void
+connect_task (void *arg)
+{                               // WiFi then MQTT up a second after start, as seen by the application
+   vTaskDelay (pdMS_TO_TICKS (1000));
+   link_up = 1;
+   if (host_app_callback)
+   {
+      host_app_callback (0, topiccommand, NULL, "wifi", NULL);
+      host_app_callback (0, topiccommand, NULL, "connect", NULL);
+   }
+   vTaskDelete (NULL);
+}
+
+void
+revk_boot (app_callback_t * cb)
+{
+   host_app_callback = cb;
+}
+
+void
+revk_start (void)
+{
+   revk_task ("revk", connect_task, NULL, 4);
+}
+
+TaskHandle_t
+revk_task (const char *name, TaskFunction_t fn, const void *arg, int stackk)
+{
+   return sim_task (name, fn, (void *) arg);
+}
+
+uint32_t
+uptime (void)
+{
+   return esp_timer_get_time () / 1000000LL ? : 1;
+}
+
+int
+revk_link_down (void)
+{
+   return !link_up;
+}
+
+const char *
+revk_season (time_t t)
+{
+   static char s[2];
+   s[0] = host_season;
+   s[1] = 0;
+   return s;
+}
+
+uint32_t
+revk_rgb (char c)
+{
+   switch (toupper ((int) (unsigned char) c))
+   {
+   case 'R':
+      return 0xFF0000;
+   case 'G':
+      return 0x00FF00;
+   case 'B':
+      return 0x0000FF;
+   case 'Y':
+      return 0xFFFF00;
+   case 'C':
+      return 0x00FFFF;
+   case 'M':
+      return 0xFF00FF;
+   case 'O':
+      return 0xFF8000;
+   case 'W':
+      return 0xFFFFFF;
+   }
+   return 0;
+}
+
+uint32_t
+revk_blinker (void)
+{                               // Status LED, blue until link up, then slow green blink
+   if (!link_up)
+      return 0x0000FF;
+   return (esp_timer_get_time () / 1000000) & 1 ? 0x00FF00 : 0;
+}
+
+void
+revk_led (led_strip_handle_t strip, int led, int scale, uint32_t rgb)
+{
+   led_strip_set_pixel (strip, led, gamma8[((rgb >> 16) & 0xFF) * scale / 255], gamma8[((rgb >> 8) & 0xFF) * scale / 255],
+                        gamma8[(rgb & 0xFF) * scale / 255]);
+}
+
+void
+revk_gfx_init (int secs)
+{                               // Start up message
+   gfx_lock ();
+   gfx_clear (0);
+   gfx_pos (gfx_width () / 2, gfx_height () / 2, GFX_C | GFX_M);
+   gfx_message ("[3]Doorbell");
+   gfx_unlock ();
+}
+
+// MQTT
+
+void *
+revk_mqtt (int client)
+{
+   return client ? NULL : (void *) &link_up;
+}
+
+void
+lwmqtt_subscribe (void *handle, const char *topic)
+{
+}
+
+const char *
+revk_mqtt_send_raw (const char *topic, int retain, const char *payload, int clients)
+{
+   if (!link_up || sim_now < host_mqtt_offline)
+      return "Not connected";
+   if (host_mqtt_hook)
+      host_mqtt_hook (topic, payload ? : "");
+   return NULL;
+}
+
+const char *
+revk_mqtt_send_str (const char *str)
+{                               // Topic, space, payload
+   char *topic = strdup (str);
+   char *payload = strchr (topic, ' ');
+   if (payload)
+      *payload++ = 0;
+   const char *e = revk_mqtt_send_raw (topic, 0, payload, 1);
+   free (topic);
+   return e;
+}
+
+static const char *
+send_jo (const char *prefix, const char *tag, jo_t * jp)
+{
+   char *payload = (jp ? jo_finisha (jp) : NULL);
+   char *topic = NULL;
+   if (asprintf (&topic, "%s/%s/%s", prefix, revk_app, tag) < 0)
+      topic = NULL;
+   const char *e = (topic ? revk_mqtt_send_raw (topic, 0, payload, 1) : "No memory");
+   free (topic);
+   free (payload);
+   return e;
+}
+
+const char *
+revk_info (const char *tag, jo_t * jp)
+{
+   return send_jo ("info", tag, jp);
+}
+
+const char *
+revk_error (const char *tag, jo_t * jp)
+{
+   return send_jo ("error", tag, jp);
+}
+
+// Settings
+
+static const host_setting_t *
+setting_find (const char *name, int *index)
+{                               // Name with or without dots, arrays as name then 1 based index
+   char n[100];
+   int l = 0;
+   for (; *name && l < sizeof (n) - 1; name++)
+      if (*name != '.')
+         n[l++] = *name;
+   n[l] = 0;
+   *index = 0;
+   for (const host_setting_t * s = host_settings; s->name; s++)
+   {
+      size_t sl = strlen (s->name);
+      if (!strcmp (s->name, n))
+         return s;
+      if (s->array && !strncmp (s->name, n, sl) && isdigit ((int) (unsigned char) n[sl]))
+      {
+         *index = atoi (n + sl) - 1;
+         if (*index >= 0 && *index < s->array)
+            return s;
+      }
+   }
+   return NULL;
+}
+
+const char *
+host_setting (const char *name, const char *value)
+{                               // Set a setting from text, NULL if OK
+   int index;
+   const host_setting_t *s = setting_find (name, &index);
+   if (!s)
+      return "Unknown setting";
+   long v = strtol (value, NULL, 0);
+   if (s->enums && !isdigit ((int) (unsigned char) *value))
+   {                            // Enum by name
+      const char *e = s->enums + (*s->enums == '"');
+      size_t l = strlen (value);
+      for (v = 0; *e && *e != '"'; v++)
+      {
+         if (!strncasecmp (e, value, l) && (e[l] == ',' || e[l] == '"' || !e[l]))
+            break;
+         while (*e && *e != ',' && *e != '"')
+            e++;
+         if (*e == ',')
+            e++;
+      }
+      if (!*e || *e == '"')
+         return "Unknown value";
+   }
+   switch (s->type)
+   {
+   case 'g':
+      ((revk_gpio_t *) s->ptr)[index] = (revk_gpio_t)
+      {
+      .num = labs (v),.set = (*value != 0),.invert = (v < 0)};
+      break;
+   case 'b':
+      ((uint8_t *) s->ptr)[index] = (v || !strcasecmp (value, "true"));
+      break;
+   case '1':
+   case 'e':
+      ((uint8_t *) s->ptr)[index] = v;
+      break;
+   case '2':
+      ((uint16_t *) s->ptr)[index] = v;
+      break;
+   case '4':
+      ((uint32_t *) s->ptr)[index] = v;
+      break;
+   case 's':
+      ((char **) s->ptr)[index] = strdup (value);       // Never freed, defaults are literals
+      break;
+   case 'c':
+      ((char *) s->ptr)[0] = *value;
+      ((char *) s->ptr)[1] = 0;
+      break;
+   }
+   return NULL;
+}
+
+static void
+setting_text (const char *name, char *out, size_t len)
+{
+   int index;
+   const host_setting_t *s = setting_find (name, &index);
+   *out = 0;
+   if (!s)
+      return;
+   switch (s->type)
+   {
+   case 'g':
+      {
+         revk_gpio_t g = ((revk_gpio_t *) s->ptr)[index];
+         if (g.set)
+            snprintf (out, len, "%s%d", g.invert ? "-" : "", g.num);
+      }
+      break;
+   case 'b':
+   case '1':
+   case 'e':
+      snprintf (out, len, "%u", ((uint8_t *) s->ptr)[index]);
+      break;
+   case '2':
+      snprintf (out, len, "%u", ((uint16_t *) s->ptr)[index]);
+      break;
+   case '4':
+      snprintf (out, len, "%u", ((uint32_t *) s->ptr)[index]);
+      break;
+   case 's':
+      snprintf (out, len, "%s", ((char **) s->ptr)[index]);
+      break;
+   case 'c':
+      snprintf (out, len, "%s", (char *) s->ptr);
+      break;
+   }
+}
+
+// Web
+
+void revk_web_extra (httpd_req_t * req);
+
+int
+revk_num_web_handlers (void)
+{
+   return 1;
+}
+
+void
+revk_web_settings_add (httpd_handle_t webserver)
+{
+   httpd_uri_t uri = {.uri = "/revk-settings",.method = HTTP_GET,.handler = revk_web_settings };
+   httpd_register_uri_handler (webserver, &uri);
+}
+
+esp_err_t
+revk_web_settings (httpd_req_t * req)
+{
+   revk_web_head (req, "Settings");
+   revk_web_send (req, "<table>");
+   revk_web_extra (req);
+   revk_web_send (req, "</table>");
+   return revk_web_foot (req, 0, 1, NULL);
+}
+
+void
+revk_web_send (httpd_req_t * req, const char *fmt, ...)
+{
+   char *v = NULL;
+   va_list ap;
+   va_start (ap, fmt);
+   if (vasprintf (&v, fmt, ap) < 0)
+      v = NULL;
+   va_end (ap);
+   if (v)
+      httpd_resp_sendstr_chunk (req, v);
+   free (v);
+}
+
+void
+revk_web_head (httpd_req_t * req, const char *title)
+{
+   httpd_resp_set_type (req, "text/html; charset=utf-8");
+   revk_web_send (req, "<!DOCTYPE html><html><head><title>%s</title></head><body>", title);
+}
+
+esp_err_t
+revk_web_foot (httpd_req_t * req, int home, int wifi, const char *extra)
+{
+   revk_web_send (req, "</body></html>");
+   return httpd_resp_sendstr_chunk (req, NULL);
+}
+
+void
+revk_web_setting_title (httpd_req_t * req, const char *fmt, ...)
+{
+   char *v = NULL;
+   va_list ap;
+   va_start (ap, fmt);
+   if (vasprintf (&v, fmt, ap) < 0)
+      v = NULL;
+   va_end (ap);
+   revk_web_send (req, "<tr><th colspan=2>%s</th></tr>", v ? : "");
+   free (v);
+}
+
+void
+revk_web_setting_info (httpd_req_t * req, const char *fmt, ...)
+{
+   char *v = NULL;
+   va_list ap;
+   va_start (ap, fmt);
+   if (vasprintf (&v, fmt, ap) < 0)
+      v = NULL;
+   va_end (ap);
+   revk_web_send (req, "<tr><td colspan=2>%s</td></tr>", v ? : "");
+   free (v);
+}
+
+void
+revk_web_setting (httpd_req_t * req, const char *tag, const char *field)
+{
+   char v[200];
+   setting_text (field, v, sizeof (v));
+   revk_web_send (req, "<tr><td>%s</td><td><input name=\"%s\" value=\"%s\"></td></tr>", tag, field, v);
+}
@@ -0,0 +1,206 @@
+// Generate settings.h and settings.c from settings.def files, host build only
+// Does what components/ESP32-RevK/revk_settings does for the device, for the types used here
+// Usage: settings_gen out.h out.c file.def...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static FILE *h,
+ *c;
+
+static void
+cname (char *out, const char *name)
+{                               // Setting name with the dots taken out, as the C variable
+   while (*name)
+   {
+      if (*name != '.')
+         *out++ = *name;
+      name++;
+   }
+   *out = 0;
+}
+
+static char *
+token (char **pp)
+{                               // Next white space separated token, quoted strings kept whole, NULL at end or comment
+   char *p = *pp;
+   while (*p && isspace ((int) (unsigned char) *p))
+      p++;
+   if (!*p || (p[0] == '/' && p[1] == '/'))
+      return NULL;
+   char *s = p;
+   int q = 0;
+   while (*p && (q || !isspace ((int) (unsigned char) *p)))
+   {
+      if (*p == '"')
+         q = !q;
+      p++;
+   }
+   if (*p)
+      *p++ = 0;
+   *pp = p;
+   return s;
+}
+
+static void
+setting (char *type, char *name, char *def, int array, char *enums)
+{
+   char n[100];
+   cname (n, name);
+   const char *ctype = NULL;
+   char t = 0;
+   if (!strcmp (type, "gpio"))
+   {
+      ctype = "revk_gpio_t";
+      t = 'g';
+   } else if (!strcmp (type, "bit"))
+   {
+      ctype = "uint8_t";
+      t = 'b';
+   } else if (!strcmp (type, "u8") || !strcmp (type, "enum"))
+   {
+      ctype = "uint8_t";
+      t = (*type == 'e' ? 'e' : '1');
+   } else if (!strcmp (type, "u16"))
+   {
+      ctype = "uint16_t";
+      t = '2';
+   } else if (!strcmp (type, "u32"))
+   {
+      ctype = "uint32_t";
+      t = '4';
+   } else if (!strcmp (type, "s"))
+   {
+      ctype = "char *";
+      t = 's';
+   } else if (!strcmp (type, "c1"))
+   {
+      ctype = "char";
+      t = 'c';
+   } else
+   {
+      fprintf (stderr, "Unknown type %s for %s\n", type, name);
+      exit (1);
+   }
+   char dim[20] = "";
+   if (t == 'c')
+      strcpy (dim, "[2]");
+   else if (array)
+      sprintf (dim, "[%d]", array);
+   fprintf (h, "extern %s%s%s%s;\n", ctype, t == 's' ? "" : " ", n, dim);
+   if (enums)
+   {                            // REVK_SETTINGS_NAME_VALUE
+      char u[100];
+      for (int i = 0; n[i]; i++)
+         u[i] = toupper ((int) (unsigned char) n[i]), u[i + 1] = 0;
+      fprintf (h, "enum {");
+      char *e = enums;
+      if (*e == '"')
+         e++;
+      int first = 1;
+      while (*e && *e != '"')
+      {
+         fprintf (h, "%sREVK_SETTINGS_%s_", first ? "" : ",", u);
+         first = 0;
+         while (*e && *e != ',' && *e != '"')
+         {
+            if (isalnum ((int) (unsigned char) *e))
+               fputc (toupper ((int) (unsigned char) *e), h);
+            e++;
+         }
+         if (*e == ',')
+            e++;
+      }
+      fprintf (h, "};\n");
+   }
+   char init[200] = "0";
+   if (def)
+   {
+      if (t == 'g')
+      {
+         int v = atoi (def);
+         sprintf (init, "{.num=%d,.set=1,.invert=%d}", abs (v), v < 0);
+      } else if (t == 's' || t == 'c')
+         snprintf (init, sizeof (init), "%s", def);
+      else
+         snprintf (init, sizeof (init), "%s", def);
+   } else if (t == 's')
+      strcpy (init, "\"\"");
+   else if (t == 'g' || t == 'c')
+      strcpy (init, "{0}");
+   if (array)
+   {
+      fprintf (c, "%s%s%s[%d]={", ctype, t == 's' ? "" : " ", n, array);
+      for (int i = 0; i < array; i++)
+         fprintf (c, "%s%s", i ? "," : "", init);
+      fprintf (c, "};\n");
+   } else
+      fprintf (c, "%s%s%s%s=%s;\n", ctype, t == 's' ? "" : " ", n, dim, init);
+   fprintf (c, "#define\tTABLE_%s\t{\"%s\",'%c',&%s,%d,%s},\n", n, n, t, n, array, enums ? enums : "NULL");
+}
+
+int
+main (int argc, char *argv[])
+{
+   if (argc < 4)
+   {
+      fprintf (stderr, "%s out.h out.c file.def...\n", argv[0]);
+      return 1;
+   }
+   h = fopen (argv[1], "w");
+   c = fopen (argv[2], "w");
+   if (!h || !c)
+   {
+      perror ("output");
+      return 1;
+   }
+   fprintf (h, "// Generated by settings_gen, do not edit\n");
+   fprintf (c, "// Generated by settings_gen, do not edit\n#include \"revk.h\"\n");
+   char *names = NULL;
+   size_t namelen = 0;
+   FILE *list = open_memstream (&names, &namelen);
+   for (int a = 3; a < argc; a++)
+   {
+      FILE *f = fopen (argv[a], "r");
+      if (!f)
+      {
+         perror (argv[a]);
+         return 1;
+      }
+      char line[1000];
+      while (fgets (line, sizeof (line), f))
+      {
+         char *p = line,
+            *type = token (&p),
+            *name = type ? token (&p) : NULL;
+         if (!name)
+            continue;
+         char *def = NULL,
+            *enums = NULL,
+            *v;
+         int array = 0;
+         while ((v = token (&p)))
+         {
+            if (*v != '.')
+               def = v;
+            else if (!strncmp (v, ".array=", 7))
+               array = atoi (v + 7);
+            else if (!strncmp (v, ".enums=", 7))
+               enums = v + 7;
+         }
+         setting (type, name, def, array, enums);
+         char n[100];
+         cname (n, name);
+         fprintf (list, "TABLE_%s\n", n);
+      }
+      fclose (f);
+   }
+   fclose (list);
+   fprintf (c, "const host_setting_t host_settings[]={\n%s{NULL}};\n", names);
+   free (names);
+   fclose (h);
+   fclose (c);
+   return 0;
+}
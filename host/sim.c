@@ -0,0 +1,475 @@
+// Host stand-in for FreeRTOS and the ESP-IDF system calls, on a virtual clock
+// Tasks take turns, a task runs until it waits (delay, notify, mutex, queue, usleep), then the task due next runs.
+// The clock only moves when every task is waiting, so a run depends only on its inputs, not on the host.
+
+#include "host.h"
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_heap_caps.h"
+#include "esp_pm.h"
+
+#define	STACK	(1024*1024)     // Each task, only touched pages are used
+#define	SLEEPMIN	(CONFIG_FREERTOS_IDLE_TIME_BEFORE_SLEEP*1000)      // Idle time before light sleep (us)
+
+int64_t sim_now = 0;
+time_t sim_epoch = 1736164800;  // 2025-01-06 12:00:00 UTC, a Monday
+int host_quiet = 0;
+sim_cpu_t sim_cpu = { 0 };
+
+struct sim_task_s
+{
+   struct sim_task_s *next;
+   const char *name;
+   ucontext_t ctx;
+   void *stack;
+   TaskFunction_t fn;
+   void *arg;
+   int64_t wake;                // When to run, SIM_NEVER if waiting without a time limit
+   uint64_t seq;                // Order made ready, for tasks due at the same time
+   uint32_t notify;             // Notification count
+   const void *wait;            // What it is waiting for
+   uint32_t wakeups;            // Times run after waiting
+   uint8_t dead:1;
+};
+
+struct sim_mutex_s
+{
+   TaskHandle_t owner;
+   uint8_t taken:1;
+};
+
+struct sim_queue_s
+{
+   uint32_t len,
+     size,
+     head,
+     count;
+   uint8_t *data;
+};
+
+static TaskHandle_t tasks = NULL,
+   current = NULL;
+static ucontext_t scheduler;
+static uint64_t seqs = 0;
+static uint8_t stop = 0;
+static const char notified[] = "notify";
+
+static void
+ready (TaskHandle_t t)
+{                               // Run t as soon as possible
+   if (t->wake > sim_now)
+   {
+      t->wake = sim_now;
+      t->seq = ++seqs;
+   }
+}
+
+static void
+wake (const void *what)
+{                               // Ready any task waiting for what
+   for (TaskHandle_t t = tasks; t; t = t->next)
+      if (!t->dead && t->wait == what)
+         ready (t);
+}
+
+static void
+block (const void *what, int64_t until)
+{                               // Current task waits for what, or until
+   if (!current)
+   {                            // Not in a task, nothing else can happen, so the clock moves on
+      if (until != SIM_NEVER && until > sim_now)
+         sim_now = until;
+      return;
+   }
+   current->wait = what;
+   current->wake = until;
+   current->seq = ++seqs;
+   swapcontext (&current->ctx, &scheduler);
+   current->wait = NULL;
+}
+
+static int64_t
+ticks_until (TickType_t ticks)
+{
+   if (ticks == portMAX_DELAY)
+      return SIM_NEVER;
+   return sim_now + (int64_t) ticks *portTICK_PERIOD_MS * 1000;
+}
+
+static void
+entry (void)
+{
+   current->fn (current->arg);
+   vTaskDelete (NULL);
+}
+
+TaskHandle_t
+sim_task (const char *name, TaskFunction_t fn, void *arg)
+{                               // Stack is executable, as GCC nested functions put trampolines on it
+   TaskHandle_t t = calloc (1, sizeof (*t));
+   t->name = name;
+   t->fn = fn;
+   t->arg = arg;
+   t->stack = mmap (NULL, STACK, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (t->stack == MAP_FAILED)
+   {
+      perror ("mmap");
+      exit (1);
+   }
+   getcontext (&t->ctx);
+   t->ctx.uc_stack.ss_sp = t->stack;
+   t->ctx.uc_stack.ss_size = STACK;
+   t->ctx.uc_link = NULL;
+   makecontext (&t->ctx, entry, 0);
+   t->wake = sim_now;
+   t->seq = ++seqs;
+   TaskHandle_t *p = &tasks;
+   while (*p)
+      p = &(*p)->next;
+   *p = t;
+   return t;
+}
+
+const char *
+sim_task_name (TaskHandle_t t)
+{
+   return t ? t->name : "host";
+}
+
+void
+sim_run (void)
+{
+   stop = 0;
+   while (!stop)
+   {
+      TaskHandle_t t = NULL;
+      for (TaskHandle_t q = tasks; q; q = q->next)
+         if (!q->dead && (!t || q->wake < t->wake || (q->wake == t->wake && q->seq < t->seq)))
+            t = q;
+      if (!t || t->wake == SIM_NEVER)
+         break;                 // Nothing more will happen
+      if (t->wake > sim_now)
+      {                         // Idle until then
+         int64_t gap = t->wake - sim_now;
+         if (sim_cpu.light_sleep && gap >= SLEEPMIN)
+            sim_cpu.sleep_us += gap;
+         else
+            sim_cpu.awake_us += gap;
+         sim_cpu.wakeups++;
+         sim_now = t->wake;
+      }
+      t->wakeups++;
+      current = t;
+      swapcontext (&scheduler, &t->ctx);
+      current = NULL;
+      if (t->dead && t->stack)
+      {
+         munmap (t->stack, STACK);
+         t->stack = NULL;
+      }
+   }
+}
+
+void
+sim_stop (void)
+{
+   stop = 1;
+}
+
+void
+sim_wait (int64_t us)
+{
+   block (NULL, sim_now + us);
+}
+
+void
+sim_tasks (jo_t j)
+{
+   jo_object (j, "wakeups");
+   for (TaskHandle_t t = tasks; t; t = t->next)
+      jo_int (j, t->name, t->wakeups);
+   jo_close (j);
+}
+
+// FreeRTOS
+
+TaskHandle_t
+xTaskGetCurrentTaskHandle (void)
+{
+   return current;
+}
+
+BaseType_t
+xTaskCreate (TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t * task)
+{
+   TaskHandle_t t = sim_task (name, fn, arg);
+   if (task)
+      *task = t;
+   return pdPASS;
+}
+
+void
+vTaskDelay (TickType_t ticks)
+{
+   block (NULL, ticks_until (ticks));
+}
+
+void
+vTaskDelete (TaskHandle_t t)
+{
+   if (!t)
+      t = current;
+   if (!t)
+      return;
+   t->dead = 1;
+   if (t == current)
+   {
+      swapcontext (&t->ctx, &scheduler);
+      abort ();                 // Never resumed
+   }
+}
+
+uint32_t
+ulTaskNotifyTake (BaseType_t clear, TickType_t ticks)
+{
+   TaskHandle_t t = current;
+   if (!t)
+      return 0;
+   if (!t->notify && ticks)
+      block (notified, ticks_until (ticks));
+   uint32_t n = t->notify;
+   if (n)
+      t->notify = (clear ? 0 : n - 1);
+   return n;
+}
+
+BaseType_t
+xTaskNotifyGive (TaskHandle_t t)
+{
+   if (!t)
+      return pdFAIL;
+   t->notify++;
+   if (t->wait == notified)
+      ready (t);
+   return pdPASS;
+}
+
+void
+vTaskNotifyGiveFromISR (TaskHandle_t t, BaseType_t * woken)
+{
+   xTaskNotifyGive (t);
+   if (woken)
+      *woken = pdTRUE;
+}
+
+SemaphoreHandle_t
+xSemaphoreCreateMutex (void)
+{
+   return calloc (1, sizeof (struct sim_mutex_s));
+}
+
+BaseType_t
+xSemaphoreTake (SemaphoreHandle_t s, TickType_t ticks)
+{
+   int64_t until = ticks_until (ticks);
+   while (s->taken && s->owner != current)
+   {
+      if (!current || sim_now >= until)
+         return pdFALSE;
+      block (s, until);
+   }
+   if (s->taken)
+      return pdFALSE;           // Not recursive
+   s->taken = 1;
+   s->owner = current;
+   return pdTRUE;
+}
+
+BaseType_t
+xSemaphoreGive (SemaphoreHandle_t s)
+{
+   if (!s->taken || s->owner != current)
+      return pdFALSE;
+   s->taken = 0;
+   s->owner = NULL;
+   wake (s);
+   return pdTRUE;
+}
+
+QueueHandle_t
+xQueueCreate (UBaseType_t len, UBaseType_t size)
+{
+   QueueHandle_t q = calloc (1, sizeof (*q));
+   q->len = len;
+   q->size = size;
+   q->data = calloc (len, size);
+   return q;
+}
+
+BaseType_t
+xQueueSend (QueueHandle_t q, const void *item, TickType_t ticks)
+{
+   int64_t until = ticks_until (ticks);
+   while (q->count == q->len)
+   {
+      if (!current || sim_now >= until)
+         return pdFALSE;
+      block (q, until);
+   }
+   memcpy (q->data + ((q->head + q->count) % q->len) * q->size, item, q->size);
+   q->count++;
+   wake (q);
+   return pdTRUE;
+}
+
+BaseType_t
+xQueueReceive (QueueHandle_t q, void *item, TickType_t ticks)
+{
+   int64_t until = ticks_until (ticks);
+   while (!q->count)
+   {
+      if (!current || sim_now >= until)
+         return pdFALSE;
+      block (q, until);
+   }
+   memcpy (item, q->data + q->head * q->size, q->size);
+   q->head = (q->head + 1) % q->len;
+   q->count--;
+   wake (q);
+   return pdTRUE;
+}
+
+UBaseType_t
+uxQueueMessagesWaiting (QueueHandle_t q)
+{
+   return q->count;
+}
+
+// Clock, replacing the C library calls the application makes
+
+int64_t
+esp_timer_get_time (void)
+{
+   return sim_now;
+}
+
+time_t
+time (time_t * t)
+{
+   time_t now = sim_epoch + sim_now / 1000000;
+   if (t)
+      *t = now;
+   return now;
+}
+
+int
+usleep (useconds_t us)
+{
+   block (NULL, sim_now + us);
+   return 0;
+}
+
+// System
+
+static uint32_t random_state = 1;
+
+uint32_t
+esp_random (void)
+{                               // xorshift32, same sequence every run
+   random_state ^= random_state << 13;
+   random_state ^= random_state >> 17;
+   random_state ^= random_state << 5;
+   return random_state;
+}
+
+void
+esp_fill_random (void *buf, size_t len)
+{
+   uint8_t *p = buf;
+   while (len--)
+      *p++ = esp_random ();
+}
+
+esp_reset_reason_t
+esp_reset_reason (void)
+{
+   return ESP_RST_POWERON;
+}
+
+const char *
+esp_err_to_name (esp_err_t e)
+{
+   return e ? "ESP_FAIL" : "ESP_OK";
+}
+
+esp_err_t
+esp_pm_configure (const void *config)
+{
+   const esp_pm_config_t *pm = config;
+   sim_cpu.light_sleep = pm->light_sleep_enable;
+   return ESP_OK;
+}
+
+uint32_t
+esp_rom_crc32_le (uint32_t crc, const uint8_t * buf, uint32_t len)
+{
+   crc = ~crc;
+   while (len--)
+   {
+      crc ^= *buf++;
+      for (int b = 0; b < 8; b++)
+         crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+   }
+   return ~crc;
+}
+
+void
+host_log (esp_log_level_t level, const char *tag, const char *fmt, ...)
+{
+   if (host_quiet || level > ESP_LOG_INFO)
+      return;
+   fprintf (stderr, "%4lld.%03lld %s %s: ", (long long) (sim_now / 1000000), (long long) (sim_now / 1000 % 1000),
+            sim_task_name (current), tag);
+   va_list ap;
+   va_start (ap, fmt);
+   vfprintf (stderr, fmt, ap);
+   va_end (ap);
+   fputc ('\n', stderr);
+}
+
+// Heap, sizes as a unit with 8MB PSRAM, so reports look sensible, nothing depends on them
+
+size_t
+heap_caps_get_free_size (int caps)
+{
+   return caps & MALLOC_CAP_SPIRAM ? 8 * 1024 * 1024 : 200 * 1024;
+}
+
+size_t
+heap_caps_get_minimum_free_size (int caps)
+{
+   return heap_caps_get_free_size (caps);
+}
+
+size_t
+heap_caps_get_largest_free_block (int caps)
+{
+   return heap_caps_get_free_size (caps);
+}
+
+size_t
+heap_caps_get_allocated_size (void *p)
+{
+   return malloc_usable_size (p);
+}
+
+void *
+mallocspi (size_t len)
+{
+   return malloc (len);
+}
@@ -0,0 +1,138 @@
+// Red panel test, built with Doorbell.c included and the red plane stand-in
+// Checks gfx_pixel with a red foreground sets red and clears black, then plots tests/red/bands.png by direct PNG decode and
+// by run length bitmap, and compares the black and red planes with the golden data made by tests/red/golden.py
+// Usage: test-red directory
+
+#include "host.h"
+#include "Doorbell.c"
+
+static uint8_t *
+slurp (const char *dir, const char *name, size_t *lenp)
+{
+   char *fn = NULL;
+   if (asprintf (&fn, "%s/%s", dir, name) < 0)
+      return NULL;
+   FILE *f = fopen (fn, "r");
+   if (!f)
+   {
+      perror (fn);
+      free (fn);
+      return NULL;
+   }
+   free (fn);
+   char *buf = NULL;
+   size_t len = 0;
+   FILE *o = open_memstream (&buf, &len);
+   char b[4096];
+   size_t l;
+   while ((l = fread (b, 1, sizeof (b), f)) > 0)
+      fwrite (b, 1, l, o);
+   fclose (o);
+   fclose (f);
+   *lenp = len;
+   return (uint8_t *) buf;
+}
+
+int
+main (int argc, char *argv[])
+{
+   if (argc != 2)
+   {
+      fprintf (stderr, "Usage: %s directory\n", argv[0]);
+      return 1;
+   }
+   const char *dir = argv[1];
+   host_quiet = 1;
+   gfx_init (.flip = 0,.invert = 1);
+   uint8_t *black = gfx_raw_b (),
+      *red = gfx_raw_r ();
+   uint32_t stride = (gfx_raw_w () + 7) / 8;
+   size_t len = stride * gfx_raw_h ();
+   int fail = 0;
+   int get (const uint8_t * plane, int x, int y)
+   {                            // flip 0, so logical is raw
+      return (plane[y * stride + x / 8] >> (7 - (x & 7))) & 1;
+   }
+   void check (int ok, const char *what)
+   {
+      if (ok)
+         return;
+      fprintf (stderr, "Failed: %s\n", what);
+      fail++;
+   }
+   void compare (const char *what, const uint8_t * plane, const char *pbm)
+   {                            // Compare plane with golden P4 PBM
+      size_t l = 0;
+      uint8_t *g = slurp (dir, pbm, &l);
+      if (!g)
+      {
+         fail++;
+         return;
+      }
+      uint8_t *p = g;
+      for (int n = 0; n < 2 && p < g + l; p++)
+         if (*p == '\n')
+            n++;                // Header lines, P4, then width height
+      if (g + l - p != len)
+         check (0, pbm);
+      else
+      {
+         size_t diff = 0,
+            first = 0;
+         for (size_t o = 0; o < len; o++)
+            if (p[o] != plane[o] && !diff++)
+               first = o;
+         if (diff)
+            fprintf (stderr, "%s: %zu bytes differ from %s, first at %lu,%lu\n", what, diff, pbm, first % stride * 8, first / stride);
+         check (!diff, what);
+      }
+      free (g);
+   }
+   check (black && red, "planes");
+   if (!black || !red)
+      return 1;
+   // gfx_pixel, red sets red and black plane to white, black clears red
+   gfx_foreground (0);
+   gfx_background (0xFFFFFF);
+   gfx_clear (0);
+   int white = get (black, 0, 0);
+   gfx_foreground (0xFF0000);
+   gfx_pixel (10, 10, 255);
+   check (get (red, 10, 10), "red pixel sets red plane");
+   check (get (black, 10, 10) == white, "red pixel clears black plane");
+   gfx_foreground (0);
+   gfx_pixel (10, 10, 255);
+   check (!get (red, 10, 10), "black pixel clears red plane");
+   check (get (black, 10, 10) != white, "black pixel sets black plane");
+   // Known image, each way it is plotted
+   file_t i = {.url = "bands.png" };
+   size_t size = 0;
+   i.data = slurp (dir, "bands.png", &size);
+   i.size = size;
+   check_file (&i);
+   check (i.data && !i.json && i.w == 300 && i.h == 100, "bands.png");
+   if (!i.data)
+      return 1;
+   for (int pass = 0; pass < 2; pass++)
+   {
+      const char *how = (pass ? "run length" : "png");
+      gfx_clear (0);
+      if (pass)
+      {
+         rle_build (&i, DITHER_NONE);
+         check (i.rle != NULL, "rle_build");
+         rle_blit (&i, 100, 50, REVK_SETTINGS_IMAGEPLOT_NORMAL);
+      } else
+         plot_png (&i, 100, 50, DITHER_NONE);
+      char what[50];
+      snprintf (what, sizeof (what), "%s black plane", how);
+      compare (what, black, "black.pbm");
+      snprintf (what, sizeof (what), "%s red plane", how);
+      compare (what, red, "red.pbm");
+   }
+   mem_free (MEM_CACHE, i.rle);
+   free (i.data);
+   if (!fail)
+      printf ("Red plane tests passed\n");
+   return fail ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+#!/usr/bin/env python3
+# Make the red panel test image, and the black and red planes expected on an 800x480 panel (gfxflip 0, gfxinvert 1, imageplot Normal)
+# The image is 5 bands of 60x100 pixels, black, red, white, transparent, pink, plotted at 100,50 on a cleared (white) display
+# Normal plots image white as black and image black as white, and gfxinvert makes a black plane bit 0 for black, so here the
+# black plane is 0 only in the white band. Red sets the red plane, and the black plane bit for white (1).
+import struct, zlib
+
+W, H, X, Y, BAND = 300, 100, 100, 50, 60
+RAW_W, RAW_H = 800, 480
+bands = [(0, 0, 0, 255), (255, 0, 0, 255), (255, 255, 255, 255), (0, 0, 0, 0), (255, 160, 160, 255)]
+
+def chunk(t, d):
+    return struct.pack(">I", len(d)) + t + d + struct.pack(">I", zlib.crc32(t + d))
+
+rows = b"".join(b"\0" + b"".join(bytes(bands[x // BAND]) for x in range(W)) for y in range(H))
+open("bands.png", "wb").write(b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", struct.pack(">IIBBBBB", W, H, 8, 6, 0, 0, 0)) +
+                              chunk(b"IDAT", zlib.compress(rows, 9)) + chunk(b"IEND", b""))
+
+def plane(bit):
+    out = bytearray()
+    for y in range(RAW_H):
+        row = [bit(x - X, y - Y) if 0 <= x - X < W and 0 <= y - Y < H else bit(None, None) for x in range(RAW_W)]
+        for b in range(0, RAW_W, 8):
+            out.append(sum(v << (7 - n) for n, v in enumerate(row[b:b + 8])))
+    return b"P4\n%d %d\n" % (RAW_W, RAW_H) + out
+
+open("black.pbm", "wb").write(plane(lambda x, y: 0 if x is not None and x // BAND == 2 else 1))
+open("red.pbm", "wb").write(plane(lambda x, y: 1 if x is not None and x // BAND in (1, 4) else 0))
@@ -0,0 +1,19 @@
+# Run a replay script and compare the output with what is expected
+# Options for the run are in name.args (one per line), and the output expected in name.out
+
+get_filename_component(dir ${SCRIPT} DIRECTORY)
+get_filename_component(name ${SCRIPT} NAME_WE)
+set(args -q -i ${IMAGES} -s imageurl=http://images -x mem)
+if(EXISTS ${dir}/${name}.args)
+  file(STRINGS ${dir}/${name}.args extra)
+  list(APPEND args ${extra})
+endif()
+execute_process(COMMAND ${PROG} ${args} ${SCRIPT} OUTPUT_VARIABLE out RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "${name}: exit ${result}\n${out}")
+endif()
+file(READ ${dir}/${name}.out expect)
+if(NOT out STREQUAL expect)
+  file(WRITE ${name}.got "${out}")
+  message(FATAL_ERROR "${name}: output differs from ${name}.out, see ${name}.got\n${out}")
+endif()
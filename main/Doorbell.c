@@ -12,6 +12,11 @@ static const char TAG[] = "Doorbell";
 #include "esp_http_server.h"
 #include "esp_crt_bundle.h"
 #include "esp_vfs_fat.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "esp_netif.h"
+#include "esp_debug_helpers.h"
+#include "mbedtls/base64.h"
 #include <driver/sdmmc_host.h>
 #include <driver/uart.h>
 #include "gfx.h"
@@ -19,12 +24,80 @@ static const char TAG[] = "Doorbell";
 #include <hal/spi_types.h>
 #include <driver/gpio.h>
 #include <lwpng.h>
+#ifdef	CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+#ifdef	CONFIG_IDF_TARGET_ARCH_XTENSA
+#include "esp_private/freertos_debug.h"
+#include "xtensa_context.h"
+#endif
 
 #define	UPDATERATE	60
 
 #define	NFCUART	1
 #define NFCBUF  280
 
+#define	EVENTCLIENTS	4       // Max concurrent /events streams
+#define	EVENTDELTA	4096    // Max bytes of frame delta sent, else just a reload notification
+#define	WAITCLIENTS	4       // Max concurrent /push?wait=visible requests
+#define	WAITTIME	30      // Max wait for a frame to be shown
+
+#define	METRICSBUF	12288   // Preallocated /metrics response buffer
+
+#define	MQTTQUEUE	16      // Outbound MQTT queue
+#define	MQTTRETRIES	10      // Outbound MQTT attempts before dropping
+#define	MQTTBACKOFF	60      // Max seconds between outbound MQTT attempts
+
+#define	MEMREPORT	3600    // Memory report interval (seconds)
+
+#define	RLE_CLEAR	0       // Run length bitmap, transparent
+#define	RLE_BLACK	1       // Run length bitmap, plot 0
+#define	RLE_WHITE	2       // Run length bitmap, plot 255
+#define	RLE_RED		3       // Run length bitmap, plot red (red panels only)
+#define	RLE_RUN		64      // Run length bitmap, max run per byte
+
+#define	HASHSIZE	32      // Hash table size (power of 2) for commands and switch names
+#define	SWITCHES	6       // Additional switches (tas.switch)
+#define	RULES		8       // Active image rules (image.rule)
+#define	PRESENCEBITS	(2+SWITCHES)    // Presence state bits, away, busy, then tas.switch
+#define	PRESENCE_AWAY	1
+#define	PRESENCE_BUSY	2
+
+#define	COLOURLUT	16      // Colour classification cache (power of 2), palette images have few colours
+
+#if defined(CONFIG_GFX_BUILD_SUFFIX_EPD75R) || defined(CONFIG_GFX_BUILD_SUFFIX_EPD154R)
+#define	GFX_RED                 // Panel has a red plane
+#endif
+
+#define	MSGCACHE	8       // Rendered message cache
+#define	MSG_WAIT	"/ / / / / / /[11]PLEASE/WAIT"
+#define	MSG_IDLE	"/ / /[10]CANWCH/Y GLOCH/ / /RING/THE/BELL"
+#define	FRAMEFILE	"frame.bin"     // Last frame on SD
+#define	FRAMEMAGIC	0x44424631      // Last frame file header
+#define	FRAMEWAIT	60      // Seconds a restored frame is kept whilst waiting for images
+#define	SCHEDULES	8       // Idle image schedule entries (image.schedule)
+#define	SCHEDULEMAX	128     // Schedule transitions in a week
+#define	SCHEDULEPREFETCH	600     // Seconds before a scheduled change to fetch the image
+#define	PEERS		4       // Peer doorbells remembered
+#define	PEERTIME	7200    // Peer forgotten if not announced for this long
+#define	PEERTOPIC	"doorbell"      // MQTT topic prefix for peer announcements
+#define	DELTAMAGIC	"DBD1"  // Image delta response
+#define	SCENEMAX	32      // Max items in a scene
+
+#define	IMAGEMAX	(1024*1024)     // Max image file size
+#define	IMAGEDIM	4096    // Max image width or height
+#define	PNGSIG		"\x89PNG\r\n\x1A\n"        // PNG file signature
+#define	UPLOADCHUNK	4096    // Upload receive chunk
+#define	UPLOADTIMEOUTS	3       // Receive timeouts in a row before giving up on a stalled client
+#define	UPLOADMARGIN	(512*1024)      // PSRAM to leave free when an upload is held in the cache
+#define	BENCHSCREENS	24      // Max screens rendered by bench
+#define	BENCHGOLDEN	8192    // Max golden hash file size
+#define	LOOPBUCKETS	14      // Task loop time histogram, <1ms, then powers of 2 up to 4s, then over
+#define	STALLTIME	5000    // Main loop iteration (ms) reported as a stall
+#define	STALLFRAMES	8       // Backtrace depth kept for stall report
+#define	STALLMAGIC	0x53544C31      // Stall report in RTC memory
+#define	STALLFILE	"stall.json"    // Stall report on SD
+
 const char sd_mount[] = "/sd";
 
 httpd_handle_t webserver = NULL;
@@ -40,17 +113,122 @@ volatile char led_colour[20] = { 0 };
 volatile char overridemsg[1000] = "";
 
 static SemaphoreHandle_t epd_mutex = NULL;
+static SemaphoreHandle_t events_mutex = NULL;
+static TaskHandle_t events_task_id = NULL;
+static TaskHandle_t main_task_id = NULL;
+static TaskHandle_t push_task_id = NULL;
+static TaskHandle_t led_task_id = NULL;
+static httpd_req_t *events_req[EVENTCLIENTS] = { 0 };
+
+struct
+{                               // Web requests waiting for a frame to be shown
+   httpd_req_t *req;
+   uint32_t frame;              // Waiting for a pushed screen frame at or after this
+   uint32_t timeout;            // Uptime to give up
+} push_wait[WAITCLIENTS] = { 0 };
+
+static volatile uint32_t frames = 0;    // Frames shown
+static volatile uint32_t pushframe = -1;        // Frame number of last pushed screen drawn
+
+enum
+{                               // bench payload
+   BENCH_NORMAL,
+   BENCH_GOLDEN,                // Record golden hashes
+};
+static volatile uint8_t benchmode = BENCH_NORMAL;
 
 struct
 {
    uint8_t mqttinit:1;
    uint8_t wificonnect:1;
-   uint8_t tasawaystate:1;
-   uint8_t tasbusystate:1;
    uint8_t getimages:1;
    uint8_t btn:1;
+   uint8_t eventsframe:1;
+   uint8_t eventsnew:1;
+   uint8_t pagestale:1;
+   uint8_t bench:1;
+   uint8_t refreshfull:1;       // Next update is a full refresh
 } volatile b;
 
+struct
+{                               // Counters for /metrics
+   uint32_t push_button;
+   uint32_t push_web;
+   uint32_t push_mqtt;
+   uint32_t cache_hit;
+   uint32_t cache_miss;
+   uint32_t cache_evict;
+   uint32_t http_count;
+   uint64_t http_us;
+   uint32_t http_200;
+   uint32_t http_304;
+   uint32_t http_404;
+   uint32_t http_other;
+   uint32_t http_fail;
+   uint32_t sd_read;
+   uint32_t sd_write;
+   uint32_t decode_count;
+   uint64_t decode_us;
+   uint32_t blit_count;
+   uint64_t blit_us;
+   uint32_t refresh_full;
+   uint32_t refresh_partial;
+   uint32_t lock_count;
+   uint64_t lock_us;
+   uint32_t led_loops;
+   uint32_t nfc_loops;
+   uint32_t push_loops;
+   uint32_t main_loops;
+   uint64_t main_busy_us;       // Main loop time not waiting
+   uint32_t delta_count;
+   uint32_t delta_failed;
+   int64_t delta_saved;         // Bytes not downloaded thanks to delta
+   uint32_t reject_size;
+   uint32_t reject_format;
+   uint32_t peer_hit;
+   uint32_t peer_miss;
+   uint32_t peer_served;
+   uint32_t mqtt_sent;
+   uint32_t mqtt_retry;
+   uint32_t mqtt_dropped;
+   uint32_t mqtt_dedupe;
+   uint32_t metrics_truncated;
+} stats = { 0 };
+
+typedef enum
+{                               // Heap accounting tags
+   MEM_CACHE,
+   MEM_PNG,
+   MEM_HTTPD,
+   MEM_MQTT,
+   MEM_LED,
+   MEM_OTHER,
+   MEM_TAGS
+} mem_tag_t;
+
+static const char *const mem_name[MEM_TAGS] = { "cache", "png", "httpd", "mqtt", "led", "other" };
+
+struct
+{                               // Heap accounting
+   int32_t live;                // Bytes currently allocated
+   int32_t peak;                // Peak of live
+   uint32_t allocs;             // Allocations
+} mem[MEM_TAGS] = { 0 };
+
+static portMUX_TYPE mem_mux = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct
+{                               // Outbound MQTT message, strings follow in same allocation
+   char *topic;                 // NULL to send payload as topic and payload (as revk_mqtt_send_str)
+   char *payload;
+   uint32_t deadline;           // Uptime after which it is too late to send, 0 for none
+   uint8_t tries;
+} mqtt_msg_t;
+
+static QueueHandle_t mqtt_queue = NULL;
+static TaskHandle_t mqtt_task_id = NULL;
+uint32_t bellsent = 0;          // Uptime bell notifications last queued
+
 typedef struct file_s
 {
    struct file_s *next;         // Next file in chain
@@ -61,11 +239,31 @@ typedef struct file_s
    uint32_t w;                  // PNG width
    uint32_t h;                  // PNG height
    uint8_t *data;               // File data
+   uint32_t crc;                // CRC32 of data
+   uint8_t *rle;                // Decoded bitmap, rows of runs, each byte is state (2 bits) and length-1 (6 bits), or packed pixels
+   uint32_t rlesize;            // Size of rle
+   uint8_t dither:2;            // Dither mode rle was built with
+   uint8_t pack:2;              // rle is packed pixels, 1 bit (1 is white, rows padded to a byte) or 2 bit (state), 0 if runs
+   uint8_t red;                 // Red threshold rle was built with
+   struct scene_s *scene;       // Compiled display list (JSON)
+   uint32_t scenecrc;           // CRC of data that failed to compile as a scene, if scenebad
    uint8_t new:1;               // New file
    uint8_t card:1;              // We have tried card
    uint8_t json:1;              // Is JSON
+   uint8_t nodelta:1;           // Delta failed, fetch in full
+   uint8_t scenebad:1;          // Scene compile failed, not tried again until the data changes
 } file_t;
 
+typedef struct
+{
+   const char *key;
+   int16_t value;               // Not negative
+} hash_t;
+
+static hash_t switch_hash[HASHSIZE] = { 0 };    // Tasmota name to presence bits, more than one if used for away and busy
+static const char *presence_image[1 << PRESENCEBITS] = { 0 };   // Presence state to active image, NULL for built in wait/busy/away
+volatile uint8_t presence = 0;  // Presence state, bit set when switch is off
+
 uint8_t nfcled = 0;
 uint8_t nfcledoverride = 0;
 
@@ -76,6 +274,29 @@ file_t *active = NULL;
 file_t *activeo = NULL;
 char season = 0;
 
+enum
+{
+   DITHER_NONE,                 // Threshold on green
+   DITHER_ORDERED,              // Bayer 8x8 on luminance
+   DITHER_DIFFUSE,              // Floyd-Steinberg on luminance
+};
+#define	DITHER_ORDERED_PREFIX	'^'
+#define	DITHER_DIFFUSE_PREFIX	'~'
+
+uint8_t
+dithermode (const char *n)
+{                               // Dither mode from name prefix (after any ! and before any colours)
+   if (!n || !*n)
+      return DITHER_NONE;
+   if (*n == '!')
+      n++;
+   if (*n == DITHER_ORDERED_PREFIX)
+      return DITHER_ORDERED;
+   if (*n == DITHER_DIFFUSE_PREFIX)
+      return DITHER_DIFFUSE;
+   return DITHER_NONE;
+}
+
 const char *
 skipcolour (const char *n)
 {
@@ -83,6 +304,8 @@ skipcolour (const char *n)
       return n;
    if (*n == '!')
       n++;                      // Full refresh
+   if (*n == DITHER_ORDERED_PREFIX || *n == DITHER_DIFFUSE_PREFIX)
+      n++;                      // Dither
    const char *c = n;
    while (*c && isalpha ((int) (unsigned char) *c))
       c++;                      // Colours
@@ -91,8 +314,344 @@ skipcolour (const char *n)
    return n;
 }
 
+static void
+mem_count (mem_tag_t tag, int32_t len)
+{                               // Account for allocated (positive) or freed (negative) bytes
+   taskENTER_CRITICAL (&mem_mux);
+   if (len > 0)
+      mem[tag].allocs++;
+   if ((mem[tag].live += len) > mem[tag].peak)
+      mem[tag].peak = mem[tag].live;
+   taskEXIT_CRITICAL (&mem_mux);
+}
+
+static void
+mem_adopt (mem_tag_t tag, void *p)
+{                               // Account for memory allocated elsewhere, e.g. open_memstream
+   if (p)
+      mem_count (tag, heap_caps_get_allocated_size (p));
+}
+
+void *
+mem_alloc (mem_tag_t tag, size_t len)
+{
+   void *p = mallocspi (len);
+   mem_adopt (tag, p);
+   return p;
+}
+
+char *
+mem_strdup (mem_tag_t tag, const char *s)
+{
+   char *p = strdup (s);
+   mem_adopt (tag, p);
+   return p;
+}
+
+int
+mem_asprintf (mem_tag_t tag, char **p, const char *fmt, ...)
+{
+   va_list ap;
+   va_start (ap, fmt);
+   int r = vasprintf (p, fmt, ap);
+   va_end (ap);
+   if (r >= 0)
+      mem_adopt (tag, *p);
+   else
+      *p = NULL;
+   return r;
+}
+
+void
+mem_free (mem_tag_t tag, void *p)
+{
+   if (!p)
+      return;
+   mem_count (tag, -(int32_t) heap_caps_get_allocated_size (p));
+   free (p);
+}
+
+void
+mem_report (jo_t j)
+{                               // Add per tag and heap fragmentation details
+   jo_object (j, "tag");
+   for (int t = 0; t < MEM_TAGS; t++)
+   {
+      jo_object (j, mem_name[t]);
+      jo_int (j, "live", mem[t].live);
+      jo_int (j, "peak", mem[t].peak);
+      jo_int (j, "allocs", mem[t].allocs);
+      jo_close (j);
+   }
+   jo_close (j);
+   void heap (const char *tag, int caps)
+   {
+      jo_object (j, tag);
+      jo_int (j, "free", heap_caps_get_free_size (caps));
+      jo_int (j, "largest", heap_caps_get_largest_free_block (caps));
+      jo_int (j, "min", heap_caps_get_minimum_free_size (caps));
+      jo_close (j);
+   }
+   heap ("internal", MALLOC_CAP_INTERNAL);
+   heap ("spiram", MALLOC_CAP_SPIRAM);
+}
+
 file_t *files = NULL;
 
+// Task loop timing, and main loop stall reports
+
+enum
+{                               // Task loops timed
+   LOOP_MAIN,
+   LOOP_PUSH,
+   LOOP_LED,
+   LOOP_NFC,
+   LOOP_MQTT,
+   LOOP_EVENTS,
+   LOOPS
+};
+static const char *const loop_name[LOOPS] = { "main", "push", "led", "nfc", "mqtt", "events" };
+
+struct
+{                               // Iteration time, excluding waiting
+   uint32_t hist[LOOPBUCKETS];
+   uint64_t us;
+   uint32_t max_us;
+} loops[LOOPS] = { 0 };
+
+enum
+{                               // What the main loop is doing
+   STAGE_OTHER,
+   STAGE_FETCH,
+   STAGE_DECODE,
+   STAGE_RENDER,
+   STAGE_REFRESH,
+   STAGE_LOCK,
+   STAGE_SD,
+   STAGES
+};
+static const char *const stage_name[STAGES] = { "other", "fetch", "decode", "render", "refresh", "lock", "sd" };
+
+static struct
+{                               // Main loop iteration in progress
+   int64_t start;               // Iteration start, 0 if waiting
+   int64_t since;               // Stage start
+   uint8_t stage;
+   uint8_t reported:1;          // Stall already reported for this iteration
+   uint8_t bench:1;             // Iteration is running bench, so not a stall
+   uint32_t us[STAGES];         // Time per stage so far
+} volatile loopnow = { 0 };
+
+typedef struct
+{                               // Stall report, kept over reset in RTC memory
+   uint32_t magic;
+   uint32_t count;              // Stalls since power on
+   uint8_t running:1;           // Captured whilst still in the iteration, e.g. before a watchdog reset
+   uint8_t saved:1;             // Written to SD
+   uint8_t stage;               // Stage at the time
+   time_t when;
+   uint32_t uptime;
+   uint32_t ms;                 // Iteration time
+   uint32_t us[STAGES];         // Time per stage
+   uint32_t bt[STALLFRAMES];    // Backtrace
+} stall_t;
+static RTC_NOINIT_ATTR stall_t stall;
+static portMUX_TYPE stall_mux = portMUX_INITIALIZER_UNLOCKED;
+
+void
+loop_time (uint8_t task, int64_t * start)
+{                               // End of a task loop iteration, before waiting, start is set after waiting
+   if (!*start)
+      return;
+   uint32_t us = esp_timer_get_time () - *start;
+   *start = 0;
+   uint32_t ms = us / 1000;
+   int bucket = 0;
+   while (ms && bucket < LOOPBUCKETS - 1)
+   {
+      ms >>= 1;
+      bucket++;
+   }
+   loops[task].hist[bucket]++;
+   loops[task].us += us;
+   if (us > loops[task].max_us)
+      loops[task].max_us = us;
+}
+
+uint8_t
+stage (uint8_t s)
+{                               // Main loop now doing s, returns what it was doing to put back after
+   if (!main_task_id || xTaskGetCurrentTaskHandle () != main_task_id)
+      return s;
+   int64_t now = esp_timer_get_time ();
+   uint8_t was = loopnow.stage;
+   loopnow.us[was] += now - loopnow.since;
+   loopnow.since = now;
+   loopnow.stage = s;
+   return was;
+}
+
+static void
+stall_backtrace (uint32_t * bt)
+{                               // Backtrace of the main task from its saved context, from the stall task, none if it is on the CPU
+#ifdef	CONFIG_IDF_TARGET_ARCH_XTENSA
+   if (!main_task_id || xTaskGetCurrentTaskHandle () == main_task_id)
+      return;
+   TaskSnapshot_t snap;
+   vTaskSuspendAll ();
+   if (eTaskGetState (main_task_id) != eRunning && vTaskGetSnapshot (main_task_id, &snap) == pdTRUE)
+   {
+      XtExcFrame *x = (XtExcFrame *) snap.pxTopOfStack;
+      esp_backtrace_frame_t f = {.pc = x->pc,.sp = x->a1,.next_pc = x->a0,.exc_frame = x };
+      int n = 0;
+      do
+         bt[n++] = esp_cpu_process_stack_pc (f.pc);
+      while (n < STALLFRAMES && f.next_pc && esp_backtrace_get_next_frame (&f));
+   }
+   xTaskResumeAll ();
+#endif
+}
+
+void
+stall_capture (uint8_t running)
+{                               // Record main loop iteration as a stall
+   if (loopnow.bench)
+      return;
+   int64_t now = esp_timer_get_time ();
+   stall_t s = {.magic = STALLMAGIC,.running = running,.stage = loopnow.stage,.when = time (0),.uptime = uptime (),
+      .ms = (now - loopnow.start) / 1000
+   };
+   for (int n = 0; n < STAGES; n++)
+      s.us[n] = loopnow.us[n];
+   if (running)
+      s.us[s.stage] += now - loopnow.since;     // Still in it
+   if (!loopnow.reported)
+      stall_backtrace (s.bt);
+   taskENTER_CRITICAL (&stall_mux);
+   if (loopnow.reported)
+      memcpy (s.bt, (void *) stall.bt, sizeof (s.bt)); // Same iteration, keep the backtrace from when it was stuck
+   s.count = stall.count + (loopnow.reported ? 0 : 1);
+   loopnow.reported = 1;
+   stall = s;
+   taskEXIT_CRITICAL (&stall_mux);
+   ESP_LOGE (TAG, "Stall %lums in %s%s", s.ms, stage_name[s.stage], running ? " (running)" : "");
+}
+
+void
+loop_start (void)
+{                               // Main loop iteration starting
+   loopnow.since = loopnow.start = esp_timer_get_time ();
+   loopnow.stage = STAGE_OTHER;
+   loopnow.reported = 0;
+   loopnow.bench = 0;
+   for (int n = 0; n < STAGES; n++)
+      loopnow.us[n] = 0;
+}
+
+void
+loop_end (void)
+{                               // Main loop iteration done, before waiting
+   if (!loopnow.start)
+      return;
+   stage (STAGE_OTHER);
+   if (esp_timer_get_time () - loopnow.start > STALLTIME * 1000LL)
+      stall_capture (0);
+   int64_t start = loopnow.start;
+   loopnow.start = 0;
+   if (!loopnow.bench)
+      loop_time (LOOP_MAIN, &start);    // Bench reports its own times
+}
+
+void
+stall_task (void *arg)
+{                               // Catch main loop iterations that are taking too long, even if they never finish
+   while (1)
+   {
+      vTaskDelay (1000 / portTICK_PERIOD_MS);
+      int64_t start = loopnow.start;
+      if (start && !loopnow.reported && esp_timer_get_time () - start > STALLTIME * 1000LL)
+         stall_capture (1);
+   }
+}
+
+void
+stall_json (jo_t j)
+{                               // Add stall report and loop histograms
+   stall_t s;
+   taskENTER_CRITICAL (&stall_mux);
+   s = stall;
+   taskEXIT_CRITICAL (&stall_mux);
+   jo_int (j, "reset", esp_reset_reason ());
+   if (s.count)
+   {
+      jo_object (j, "stall");
+      jo_int (j, "count", s.count);
+      jo_int (j, "time", s.when);
+      jo_int (j, "uptime", s.uptime);
+      jo_int (j, "ms", s.ms);
+      jo_bool (j, "running", s.running);
+      jo_string (j, "stage", stage_name[s.stage < STAGES ? s.stage : 0]);
+      jo_object (j, "stages");
+      for (int n = 0; n < STAGES; n++)
+         if (s.us[n])
+            jo_int (j, stage_name[n], s.us[n] / 1000);
+      jo_close (j);
+      char bt[STALLFRAMES * 11 + 1] = "",
+         *p = bt;
+      for (int n = 0; n < STALLFRAMES && s.bt[n]; n++)
+         p += sprintf (p, "%s0x%08lX", n ? " " : "", s.bt[n]);
+      if (*bt)
+         jo_string (j, "backtrace", bt);
+      jo_close (j);
+   }
+   jo_object (j, "loops");
+   for (int t = 0; t < LOOPS; t++)
+   {
+      jo_object (j, loop_name[t]);
+      jo_int (j, "max_ms", loops[t].max_us / 1000);
+      jo_array (j, "hist");
+      for (int bucket = 0; bucket < LOOPBUCKETS; bucket++)
+         jo_int (j, NULL, loops[t].hist[bucket]);
+      jo_close (j);
+      jo_close (j);
+   }
+   jo_close (j);
+}
+
+void
+stall_save (void)
+{                               // Write new stall report to SD, from main loop
+   if (!card || stall.magic != STALLMAGIC || !stall.count || stall.saved)
+      return;
+   stall.saved = 1;
+   char *fn = NULL;
+   mem_asprintf (MEM_OTHER, &fn, "%s/%s", sd_mount, STALLFILE);
+   FILE *f = fn ? fopen (fn, "w") : NULL;
+   if (f)
+   {
+      jo_t j = jo_object_alloc ();
+      stall_json (j);
+      char *out = jo_finisha (&j);
+      if (out)
+         fprintf (f, "%s\n", out);
+      free (out);
+      fclose (f);
+      stats.sd_write++;
+   }
+   mem_free (MEM_OTHER, fn);
+}
+
+void
+epd_take (void)
+{                               // Take epd_mutex, timing the wait
+   uint8_t was = stage (STAGE_LOCK);
+   int64_t start = esp_timer_get_time ();
+   xSemaphoreTake (epd_mutex, portMAX_DELAY);
+   stats.lock_count++;
+   stats.lock_us += esp_timer_get_time () - start;
+   stage (was);
+}
+
 file_t *
 find_file (char *url)
 {
@@ -100,52 +659,312 @@ find_file (char *url)
    for (i = files; i && strcmp (i->url, url); i = i->next);
    if (!i)
    {
-      i = mallocspi (sizeof (*i));
+      i = mem_alloc (MEM_CACHE, sizeof (*i));
       if (i)
       {
          memset (i, 0, sizeof (*i));
-         i->url = strdup (url);
+         i->url = mem_strdup (MEM_CACHE, url);
+         epd_take ();           // Files list shared with web handlers
          i->next = files;
          files = i;
+         xSemaphoreGive (epd_mutex);
       }
    }
    return i;
 }
 
+const char *
+check_data (const uint8_t * data, uint32_t size, uint8_t * json, uint32_t * w, uint32_t * h)
+{                               // Sniff and validate file content, only passing PNG or JSON to the parser for it, NULL if OK
+   *json = 0;
+   *w = *h = 0;
+   if (!data || !size)
+      return "Empty";
+   if (size > IMAGEMAX)
+      return "Too big";
+   if (size >= 8 && !memcmp (data, PNGSIG, 8))
+   {
+      const char *e = lwpng_get_info (size, data, w, h);
+      if (e)
+         return e;
+      if (!*w || !*h || *w > IMAGEDIM || *h > IMAGEDIM)
+         return "Bad image size";
+      return NULL;
+   }
+   const uint8_t *p = data,
+      *e = data + size;
+   while (p < e && isspace ((int) *p))
+      p++;
+   if (p == e || (*p != '[' && *p != '{'))
+      return "Not PNG or JSON";
+   jo_t j = jo_parse_mem (data, size);
+   jo_skip (j);
+   const char *er = jo_error (j, NULL);
+   jo_free (&j);
+   if (er)
+      return er;
+   *json = 1;
+   return NULL;
+}
+
 void
 check_file (file_t * i)
 {
    if (!i || !i->data || !i->size)
       return;
    i->changed = time (0);
-   const char *e1 = lwpng_get_info (i->size, i->data, &i->w, &i->h);
-   if (!e1)
+   i->crc = esp_rom_crc32_le (0, i->data, i->size);
+   mem_free (MEM_CACHE, i->rle);        // Decoded again when next plotted
+   i->rle = NULL;
+   i->rlesize = 0;
+   mem_free (MEM_CACHE, i->scene);      // Compiled again when next used
+   i->scene = NULL;
+   uint8_t json;
+   const char *e = check_data (i->data, i->size, &json, &i->w, &i->h);
+   if (!e)
    {
-      i->json = 0;              // PNG
+      i->json = json;
       i->new = 1;
-      ESP_LOGE (TAG, "Image %s len %lu width %lu height %lu", i->url, i->size, i->w, i->h);
-   } else
-   {                            // Not a png
-      jo_t j = jo_parse_mem (i->data, i->size);
-      jo_skip (j);
-      const char *e2 = jo_error (j, NULL);
-      jo_free (&j);
-      if (!e2)
-      {                         // Valid JSON
-         i->json = 1;
-         i->new = 1;
-         i->w = i->h = 0;
+      if (json)
          ESP_LOGE (TAG, "JSON %s len %lu", i->url, i->size);
-      } else
-      {                         // Not sensible
-         free (i->data);
-         i->data = NULL;
-         i->size = 0;
-         i->w = i->h = 0;
-         i->changed = 0;
-         ESP_LOGE (TAG, "Unknown %s error %s %s", i->url, e1 ? : "", e2 ? : "");
+      else
+         ESP_LOGE (TAG, "Image %s len %lu width %lu height %lu", i->url, i->size, i->w, i->h);
+   } else
+   {                            // Not sensible
+      stats.reject_format++;
+      mem_free (MEM_CACHE, i->data);
+      i->data = NULL;
+      i->size = 0;
+      i->w = i->h = 0;
+      i->crc = 0;
+      i->changed = 0;
+      ESP_LOGE (TAG, "Unknown %s error %s", i->url, e);
+   }
+}
+
+char *
+sd_file (const char *url)
+{                               // SD card file name for URL (malloc'd), last part of path only
+   const char *s = strrchr (url, '/');
+   if (!s)
+      s = url;
+   if (*s == '/')
+      s++;
+   char *fn = NULL;
+   mem_asprintf (MEM_CACHE, &fn, "%s/%s", sd_mount, s);
+   if (!fn)
+      return fn;
+   char *q = fn + sizeof (sd_mount);
+   while (*q && isalnum ((int) (uint8_t) * q))
+      q++;
+   if (*q == '.')
+   {
+      q++;
+      while (*q && isalnum ((int) (uint8_t) * q))
+         q++;
+   }
+   *q = 0;
+   return fn;
+}
+
+// Peers, other doorbells on the LAN sharing cached images
+
+struct
+{
+   char url[40];                // Base URL, e.g. http://10.0.0.2
+   char name[24];               // Peer hostname
+   uint32_t seen;               // Uptime of last announcement
+} peers[PEERS] = { 0 };
+
+static portMUX_TYPE peer_mux = portMUX_INITIALIZER_UNLOCKED;   // peers written by MQTT task, read by main task
+
+void
+peer_announce (void)
+{                               // Tell other doorbells where our images can be fetched (retained)
+   esp_netif_ip_info_t ip = { 0 };
+   esp_netif_get_ip_info (esp_netif_get_handle_from_ifkey ("WIFI_STA_DEF"), &ip);
+   char *topic = NULL;
+   mem_asprintf (MEM_MQTT, &topic, "%s/%s/peer", PEERTOPIC, *hostname ? hostname : revk_id);
+   if (!topic)
+      return;
+   char *payload = NULL;
+   if (imagepeer && ip.ip.addr)
+      mem_asprintf (MEM_MQTT, &payload, "{\"url\":\"http://" IPSTR "\"}", IP2STR (&ip.ip));
+   revk_mqtt_send_raw (topic, 1, payload, 1);   // Empty if not sharing, clears retained
+   mem_free (MEM_MQTT, payload);
+   mem_free (MEM_MQTT, topic);
+}
+
+void
+peer_seen (const char *name, jo_t j)
+{                               // Peer announcement
+   char url[sizeof (peers[0].url)] = "";
+   if (j && jo_find (j, "url") == JO_STRING)
+      jo_strncpy (j, url, sizeof (url));
+   if (!strcmp (name, *hostname ? hostname : revk_id))
+      return;                   // Us
+   int n,
+     o = 0;
+   for (n = 0; n < PEERS && strcmp (peers[n].name, name); n++)
+      if (peers[n].seen < peers[o].seen)
+         o = n;                 // Oldest
+   if (n == PEERS)
+   {
+      if (!*url)
+         return;
+      n = o;
+   }
+   taskENTER_CRITICAL (&peer_mux);
+   strncpy (peers[n].name, name, sizeof (peers[n].name) - 1);
+   strcpy (peers[n].url, url);
+   peers[n].seen = (*url ? uptime () : 0);
+   taskEXIT_CRITICAL (&peer_mux);
+}
+
+typedef struct peer_hdr_s
+{                               // Response headers from peer
+   uint32_t crc;                // X-CRC
+   uint32_t cache;              // X-Cache, seconds left of peer's cache time
+   uint8_t crcset:1;
+} peer_hdr_t;
+
+static esp_err_t
+peer_event (esp_http_client_event_t * e)
+{
+   peer_hdr_t *h = e->user_data;
+   if (e->event_id == HTTP_EVENT_ON_HEADER)
+   {
+      if (!strcasecmp (e->header_key, "X-CRC"))
+      {
+         h->crc = strtoul (e->header_value, NULL, 16);
+         h->crcset = 1;
+      } else if (!strcasecmp (e->header_key, "X-Cache"))
+         h->cache = strtoul (e->header_value, NULL, 10);
+   }
+   return ESP_OK;
+}
+
+int
+peer_fetch (file_t * i, uint8_t ** bufp, int32_t * lenp)
+{                               // Try peers for a current copy, returns 200 (buf set), 304 (ours is current), or -1 (use origin)
+   if (!imagepeer)
+      return -1;
+   const char *name = strrchr (i->url, '/');
+   name = (name ? name + 1 : i->url);
+   for (int n = 0; n < PEERS; n++)
+   {
+      char base[sizeof (peers[0].url)];
+      taskENTER_CRITICAL (&peer_mux);
+      uint32_t seen = peers[n].seen;
+      strcpy (base, peers[n].url);
+      taskEXIT_CRITICAL (&peer_mux);
+      if (!seen || seen + PEERTIME < uptime ())
+         continue;
+      char *url = NULL;
+      mem_asprintf (MEM_CACHE, &url, "%s/image/%s?crc=%08lX", base, name, i->data ? i->crc : 0);
+      if (!url)
+         break;
+      peer_hdr_t h = { 0 };
+      esp_http_client_config_t config = {
+         .url = url,
+         .timeout_ms = 2000,
+         .event_handler = peer_event,
+         .user_data = &h,
+      };
+      int response = -1;
+      int32_t len = 0;
+      uint8_t *buf = NULL;
+      esp_http_client_handle_t client = esp_http_client_init (&config);
+      if (client)
+      {
+         if (!esp_http_client_open (client, 0))
+         {
+            len = esp_http_client_fetch_headers (client);
+            response = esp_http_client_get_status_code (client);
+            if (response == 200 && len > 0 && len <= IMAGEMAX && h.crcset && (buf = mem_alloc (MEM_CACHE, len))
+                && (esp_http_client_read_response (client, (char *) buf, len) != len || esp_rom_crc32_le (0, buf, len) != h.crc))
+            {                   // Not as claimed
+               mem_free (MEM_CACHE, buf);
+               buf = NULL;
+            }
+            esp_http_client_close (client);
+         }
+         esp_http_client_cleanup (client);
+      }
+      mem_free (MEM_CACHE, url);
+      if (h.cache && ((response == 304 && i->data) || (response == 200 && buf)))
+      {                         // Peer checked origin recently, so use its remaining cache time, not ours
+         stats.peer_hit++;
+         i->cache = uptime () + (h.cache < imagecache ? h.cache : imagecache);  // Never longer than our own
+         *bufp = buf;
+         *lenp = len;
+         return response;
       }
+      mem_free (MEM_CACHE, buf);
+      if (response < 0)
+      {                         // Not there
+         taskENTER_CRITICAL (&peer_mux);
+         if (peers[n].seen == seen)
+            peers[n].seen = 0;
+         taskEXIT_CRITICAL (&peer_mux);
+      }
+   }
+   stats.peer_miss++;
+   return -1;
+}
+
+uint8_t *
+delta_apply (file_t * i, const uint8_t * d, int32_t dlen, int32_t * lenp)
+{                               // Apply delta to cached data, returns new data (len in *lenp) or NULL if it does not apply
+   // DELTAMAGIC, from CRC, to CRC, to length (32 bit little endian), then ops
+   // 'C' offset length - copy from cached data
+   // 'I' length data - insert data
+   uint32_t get (const uint8_t * p)
+   {
+      return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+   }
+   if (!i->data || dlen < 16 || get (d + 4) != i->crc)
+      return NULL;
+   uint32_t crc = get (d + 8),
+      len = get (d + 12);
+   if (!len || len > IMAGEMAX)
+      return NULL;
+   uint8_t *buf = mem_alloc (MEM_CACHE, len);
+   if (!buf)
+      return NULL;
+   const uint8_t *p = d + 16,
+      *e = d + dlen;
+   uint32_t o = 0;
+   while (p < e)
+   {
+      uint8_t op = *p++;
+      if (p + 4 > e)
+         break;
+      uint32_t a = get (p);
+      p += 4;
+      if (op == 'C' && p + 4 <= e)
+      {
+         uint32_t l = get (p);
+         p += 4;
+         if (a > i->size || l > i->size - a || l > len - o)
+            break;
+         memcpy (buf + o, i->data + a, l);
+         o += l;
+      } else if (op == 'I' && a <= e - p && a <= len - o)
+      {
+         memcpy (buf + o, p, a);
+         p += a;
+         o += a;
+      } else
+         break;
+   }
+   if (p != e || o != len || esp_rom_crc32_le (0, buf, len) != crc)
+   {
+      mem_free (MEM_CACHE, buf);
+      return NULL;
    }
+   *lenp = len;
+   return buf;
 }
 
 file_t *
@@ -154,8 +973,9 @@ download (char *url)
    file_t *i = find_file (url);
    if (!i)
       return i;
-   url = strdup (i->url);       // Use as is
+   url = mem_strdup (MEM_CACHE, i->url);        // Use as is
    ESP_LOGD (TAG, "Get %s", url);
+   uint8_t was = stage (STAGE_FETCH);
    int32_t len = 0;
    uint8_t *buf = NULL;
    esp_http_client_config_t config = {
@@ -168,50 +988,116 @@ download (char *url)
       response = (i->data ? 304 : 404); // Cached
    else if (!revk_link_down () && (!strncasecmp (url, "http://", 7) || !strncasecmp (url, "https://", 8)))
    {
-      i->cache = uptime () + imagecache;
-      esp_http_client_handle_t client = esp_http_client_init (&config);
-      if (client)
-      {
-         if (i->changed)
-         {
-            char when[50];
-            struct tm t;
-            gmtime_r (&i->changed, &t);
-            strftime (when, sizeof (when), "%a, %d %b %Y %T GMT", &t);
-            esp_http_client_set_header (client, "If-Modified-Since", when);
-         }
-         if (!esp_http_client_open (client, 0))
-         {
-            len = esp_http_client_fetch_headers (client);
-            ESP_LOGD (TAG, "%s Len %ld", url, len);
-            if (!len)
-            {                   // Dynamic, FFS
-               size_t l;
-               FILE *o = open_memstream ((char **) &buf, &l);
-               if (o)
+      if ((response = peer_fetch (i, &buf, &len)) < 0)
+         for (int tries = 0; tries < 2; tries++)
+         {                      // Origin, then in full if a delta does not apply
+            uint8_t delta = 0;  // Sent X-Delta-From
+            i->cache = uptime () + imagecache;
+            int64_t start = esp_timer_get_time ();
+            esp_http_client_handle_t client = esp_http_client_init (&config);
+            if (client)
+            {
+               if (i->changed)
+               {
+                  char when[50];
+                  struct tm t;
+                  gmtime_r (&i->changed, &t);
+                  strftime (when, sizeof (when), "%a, %d %b %Y %T GMT", &t);
+                  esp_http_client_set_header (client, "If-Modified-Since", when);
+               }
+               char from[9];
+               if (i->data && !i->nodelta)
+               {                   // Server can send a delta against what we have
+                  sprintf (from, "%08lX", i->crc);
+                  esp_http_client_set_header (client, "X-Delta-From", from);
+                  delta = 1;
+               }
+               i->nodelta = 0;
+               if (!esp_http_client_open (client, 0))
                {
-                  char temp[64];
-                  while ((len = esp_http_client_read (client, temp, sizeof (temp))) > 0)
-                     fwrite (temp, len, 1, o);
-                  fclose (o);
-                  len = l;
+                  len = esp_http_client_fetch_headers (client);
+                  ESP_LOGD (TAG, "%s Len %ld", url, len);
+                  if (len > IMAGEMAX)
+                  {                // Do not trust server to allocate for it
+                     ESP_LOGE (TAG, "Too big %s (%ld)", url, len);
+                     stats.reject_size++;
+                  } else if (!len)
+                  {                   // Dynamic, FFS
+                     size_t l,
+                       got = 0;
+                     FILE *o = open_memstream ((char **) &buf, &l);
+                     if (o)
+                     {
+                        char temp[64];
+                        while ((len = esp_http_client_read (client, temp, sizeof (temp))) > 0 && (got += len) <= IMAGEMAX)
+                           fwrite (temp, len, 1, o);
+                        fclose (o);
+                        mem_adopt (MEM_CACHE, buf);
+                        len = l;
+                        if (got > IMAGEMAX)
+                        {
+                           ESP_LOGE (TAG, "Too big %s", url);
+                           stats.reject_size++;
+                           mem_free (MEM_CACHE, buf);
+                           buf = NULL;
+                        }
+                     }
+                     if (!buf)
+                        len = 0;
+                  } else if (len > 0 && (buf = mem_alloc (MEM_CACHE, len))
+                             && esp_http_client_read_response (client, (char *) buf, len) != len)
+                  {                // Short
+                     mem_free (MEM_CACHE, buf);
+                     buf = NULL;
+                  }
+                  response = esp_http_client_get_status_code (client);
+                  if (response == 200 && !buf)
+                     response = -1;        // Nothing usable
+                  if (response != 200 && response != 304)
+                     ESP_LOGE (TAG, "Bad response %s (%d)", url, response);
+                  esp_http_client_close (client);
                }
-               if (!buf)
+               esp_http_client_cleanup (client);
+            }
+            stats.http_count++;
+            stats.http_us += esp_timer_get_time () - start;
+            if (response == 200)
+               stats.http_200++;
+            else if (response == 304)
+               stats.http_304++;
+            else if (response == 404)
+               stats.http_404++;
+            else if (response > 0)
+               stats.http_other++;
+            else
+               stats.http_fail++;
+            ESP_LOGD (TAG, "Got %s %d", url, response);
+            if (response == 200 && buf && len >= 4 && !memcmp (buf, DELTAMAGIC, 4))
+            {                      // Delta, only if we asked for one
+               int32_t dlen = len;
+               uint8_t *new = (delta ? delta_apply (i, buf, dlen, &len) : NULL);
+               mem_free (MEM_CACHE, buf);
+               buf = NULL;
+               if (new)
+               {
+                  buf = new;
+                  stats.delta_count++;
+                  stats.delta_saved += len - dlen;
+               } else
+               {                   // Does not apply, fetch in full (once)
+                  ESP_LOGE (TAG, "Delta failed %s", url);
+                  stats.delta_failed++;
+                  response = -1;
                   len = 0;
-            } else
-            {
-               buf = mallocspi (len);
-               if (buf)
-                  len = esp_http_client_read_response (client, (char *) buf, len);
+                  if (delta)
+                  {
+                     i->nodelta = 1;
+                     continue;
+                  }
+               }
             }
-            response = esp_http_client_get_status_code (client);
-            if (response != 200 && response != 304)
-               ESP_LOGE (TAG, "Bad response %s (%d)", url, response);
-            esp_http_client_close (client);
+            break;
          }
-         esp_http_client_cleanup (client);
-      }
-      ESP_LOGD (TAG, "Got %s %d", url, response);
    }
    if (response != 304)
    {
@@ -231,39 +1117,28 @@ download (char *url)
       {
          if (i->data && i->size == len && !memcmp (buf, i->data, len))
          {
-            free (buf);
+            mem_free (MEM_CACHE, buf);
             response = 0;       // No change
          } else
          {                      // Change
-            free (i->data);
+            if (i->data)
+               stats.cache_evict++;
+            epd_take ();        // Data in use when plotting
+            mem_free (MEM_CACHE, i->data);
             i->data = buf;
             i->size = len;
             check_file (i);
+            xSemaphoreGive (epd_mutex);
          }
          buf = NULL;
       }
    }
    if (card)
    {                            // SD
-      char *s = strrchr (url, '/');
-      if (!s)
-         s = url;
-      if (s)
+      stage (STAGE_SD);
+      char *fn = sd_file (url);
+      if (fn)
       {
-         char *fn = NULL;
-         if (*s == '/')
-            s++;
-         asprintf (&fn, "%s/%s", sd_mount, s);
-         char *q = fn + sizeof (sd_mount);
-         while (*q && isalnum ((int) (uint8_t) * q))
-            q++;
-         if (*q == '.')
-         {
-            q++;
-            while (*q && isalnum ((int) (uint8_t) * q))
-               q++;
-         }
-         *q = 0;
          if (i->data && response == 200)
          {                      // Save to card
             FILE *f = fopen (fn, "w");
@@ -273,6 +1148,7 @@ download (char *url)
                if (fwrite (i->data, i->size, 1, f) != 1)
                   jo_string (j, "error", "write failed");
                fclose (f);
+               stats.sd_write++;
                jo_string (j, "write", fn);
                revk_info ("SD", &j);
                ESP_LOGE (TAG, "Write %s %lu", fn, i->size);
@@ -285,16 +1161,22 @@ download (char *url)
             if (f)
             {
                struct stat s;
-               fstat (fileno (f), &s);
-               free (buf);
-               buf = mallocspi (s.st_size);
+               mem_free (MEM_CACHE, buf);
+               buf = NULL;
+               if (fstat (fileno (f), &s) || s.st_size <= 0 || s.st_size > IMAGEMAX)
+               {                // Do not trust card either
+                  ESP_LOGE (TAG, "Bad size %s", fn);
+                  stats.reject_size++;
+               } else
+                  buf = mem_alloc (MEM_CACHE, s.st_size);
                if (buf)
                {
                   if (fread (buf, s.st_size, 1, f) == 1)
                   {
+                     stats.sd_read++;
                      if (i->data && i->size == s.st_size && !memcmp (buf, i->data, i->size))
                      {
-                        free (buf);
+                        mem_free (MEM_CACHE, buf);
                         response = 0;   // No change
                      } else
                      {
@@ -303,10 +1185,12 @@ download (char *url)
                         jo_string (j, "read", fn);
                         revk_info ("SD", &j);
                         response = 200; // Treat as received
-                        free (i->data);
+                        epd_take ();
+                        mem_free (MEM_CACHE, i->data);
                         i->data = buf;
                         i->size = s.st_size;
                         check_file (i);
+                        xSemaphoreGive (epd_mutex);
                      }
                      buf = NULL;
                   }
@@ -315,62 +1199,1384 @@ download (char *url)
             } else
                ESP_LOGE (TAG, "Read fail %s", fn);
          }
-         free (fn);
+         mem_free (MEM_CACHE, fn);
       }
    }
-   free (buf);
-   free (url);
+   stage (was);
+   mem_free (MEM_CACHE, buf);
+   mem_free (MEM_CACHE, url);
    return i;
 }
 
-// Image plot
+// Frame buffer raster operations, direct to the raw 1 bit frame buffer (MSB first rows)
+// The mapping from logical co-ordinates (gfxflip) and the bit value for black (gfxinvert) are probed using gfx_pixel
+// Only used if gfx has gfx_changed to be told of the area changed, else everything is plotted with gfx_pixel
 
-typedef struct plot_s
-{
-   gfx_pos_t ox,
-     oy;
-} plot_t;
+void gfx_changed (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h) __attribute__((weak));
 
-static void *
-my_alloc (void *opaque, uInt items, uInt size)
+typedef struct fb_s
 {
-   return mallocspi (items * size);
-}
+   uint8_t *b;                  // Raw frame buffer
+   uint32_t w,
+     h;                         // Raw size
+   uint32_t stride;             // Bytes per raw row
+   int32_t ox,
+     oy;                        // Raw position of logical 0,0
+   int8_t xx,
+     xy;                        // Raw step for logical x
+   int8_t yx,
+     yy;                        // Raw step for logical y
+   uint8_t black:1;             // Raw bit value for black
+   uint8_t ok:1;                // Probed and usable
+   uint8_t dirty:1;             // Changed without gfx_pixel
+   gfx_pos_t dx0,
+     dy0,
+     dx1,
+     dy1;                       // Logical area changed, if dirty
+} fb_t;
 
-static void
-my_free (void *opaque, void *address)
-{
-   free (address);
-}
+static fb_t fb = { 0 };
 
-static const char *
-pixel (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
-{
-   plot_t *p = opaque;
-   if (a & 0x8000)
-      gfx_pixel (p->ox + x, p->oy + y, (g & 0x8000) ? 255 : 0);
-   return NULL;
+static inline uint8_t *
+fb_raw (void)
+{                               // Raw 1 bit frame buffer, NULL if that is not the whole picture
+#ifdef	GFX_RED
+   return NULL;                 // Red plane is separate, and not accessible
+#else
+   return gfx_changed && gfx_bpp () == 1 ? gfx_raw_b () : NULL;
+#endif
 }
 
-void
-plot (file_t * i, gfx_pos_t ox, gfx_pos_t oy)
+enum
 {
-   plot_t settings = { ox, oy };
-   lwpng_decode_t *p = lwpng_decode (&settings, NULL, &pixel, &my_alloc, &my_free, NULL);
-   lwpng_data (p, i->size, i->data);
-   const char *e = lwpng_decoded (&p);
-   if (e)
-      ESP_LOGE (TAG, "PNG fail %s", e);
-}
+   FB_SET,
+   FB_CLR,
+   FB_XOR,
+   FB_RANDOM,
+};
 
 void
-image_load (const char *name, file_t * i, char c, uint16_t x, uint16_t y)
-{                               // Load image and set LEDs (image can be prefixed with colour, else default is used)
-   int n = 0;
-   if (name)
-   {
+fb_probe (void)
+{                               // Work out raw layout from gfx_pixel, called with display locked
+   fb.ok = 0;
+   if (!(fb.b = fb_raw ()))
+      return;
+   fb.w = gfx_raw_w ();
+   fb.h = gfx_raw_h ();
+   fb.stride = (fb.w + 7) / 8;
+   size_t len = fb.stride * fb.h;
+   uint8_t *save = mem_alloc (MEM_OTHER, len);
+   if (!save)
+      return;
+   memcpy (save, fb.b, len);
+   int find (gfx_pos_t x, gfx_pos_t y, int32_t * rx, int32_t * ry)
+   {                            // Set one black pixel on white and find it
+      gfx_foreground (0);
+      gfx_background (0xFFFFFF);
+      gfx_clear (0);
+      uint8_t white = fb.b[0];
+      gfx_pixel (x, y, 255);
+      for (size_t o = 0; o < len; o++)
+         if (fb.b[o] != white)
+         {
+            uint8_t d = (fb.b[o] ^ white),
+               bit = 0;
+            while (!(d & (0x80 >> bit)))
+               bit++;
+            *rx = (o % fb.stride) * 8 + bit;
+            *ry = o / fb.stride;
+            fb.black = ((fb.b[o] >> (7 - bit)) & 1);
+            return 1;
+         }
+      return 0;
+   }
+   int32_t x0,
+     y0,
+     x1,
+     y1,
+     x2,
+     y2;
+   if (find (0, 0, &x0, &y0) && find (1, 0, &x1, &y1) && find (0, 1, &x2, &y2))
+   {
+      fb.ox = x0;
+      fb.oy = y0;
+      fb.xx = x1 - x0;
+      fb.xy = y1 - y0;
+      fb.yx = x2 - x0;
+      fb.yy = y2 - y0;
+      fb.ok = (abs (fb.xx) + abs (fb.xy) == 1 && abs (fb.yx) + abs (fb.yy) == 1);
+   }
+   memcpy (fb.b, save, len);
+   mem_free (MEM_OTHER, save);
+   ESP_LOGE (TAG, "Raw frame buffer %s origin %ld,%ld x step %d,%d y step %d,%d black %d", fb.ok ? "mapped" : "not mapped", fb.ox,
+             fb.oy, fb.xx, fb.xy, fb.yx, fb.yy, fb.black);
+}
+
+static inline int
+fb_get (gfx_pos_t x, gfx_pos_t y)
+{                               // Is logical pixel black
+   int32_t rx = fb.ox + x * fb.xx + y * fb.yx,
+      ry = fb.oy + x * fb.xy + y * fb.yy;
+   return ((fb.b[ry * fb.stride + rx / 8] >> (7 - (rx & 7))) & 1) == fb.black;
+}
+
+static int
+fb_rect (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h, int32_t * rx, int32_t * ry, int32_t * rw, int32_t * rh)
+{                               // Logical rectangle to raw, clipped, returns 0 if nothing to do
+   if (!fb.ok)
+      return 0;
+   if (x < 0)
+   {
+      w += x;
+      x = 0;
+   }
+   if (y < 0)
+   {
+      h += y;
+      y = 0;
+   }
+   if (x + w > gfx_width ())
+      w = gfx_width () - x;
+   if (y + h > gfx_height ())
+      h = gfx_height () - y;
+   if (w <= 0 || h <= 0)
+      return 0;
+   int32_t ax = fb.ox + x * fb.xx + y * fb.yx,
+      ay = fb.oy + x * fb.xy + y * fb.yy,
+      bx = fb.ox + (x + w - 1) * fb.xx + (y + h - 1) * fb.yx,
+      by = fb.oy + (x + w - 1) * fb.xy + (y + h - 1) * fb.yy;
+   *rx = (ax < bx ? ax : bx);
+   *ry = (ay < by ? ay : by);
+   *rw = abs (bx - ax) + 1;
+   *rh = abs (by - ay) + 1;
+   return 1;
+}
+
+static void
+fb_row (uint8_t * row, int32_t x, int32_t w, uint8_t op)
+{                               // Raw row operation on w bits from x, whole bytes and words in the middle
+   uint8_t *p = row + x / 8;
+   uint8_t lead = (x & 7);
+   void part (uint8_t mask)
+   {
+      if (op == FB_SET)
+         *p |= mask;
+      else if (op == FB_CLR)
+         *p &= ~mask;
+      else if (op == FB_XOR)
+         *p ^= mask;
+      else
+         *p = (*p & ~mask) | (esp_random () & mask);
+      p++;
+   }
+   if (lead)
+   {
+      uint8_t mask = (0xFF >> lead);
+      if (lead + w < 8)
+         mask &= ~(0xFF >> (lead + w));
+      part (mask);
+      w -= 8 - lead;
+      if (w <= 0)
+         return;
+   }
+   int32_t n = w / 8;
+   if (op == FB_SET || op == FB_CLR)
+      memset (p, op == FB_SET ? 0xFF : 0, n);
+   else if (op == FB_RANDOM)
+      esp_fill_random (p, n);
+   else
+   {                            // XOR, words where aligned
+      uint8_t *e = p + n;
+      while (p < e && ((uintptr_t) p & 3))
+         *p++ ^= 0xFF;
+      for (; p + 4 <= e; p += 4)
+         *(uint32_t *) p ^= 0xFFFFFFFF;
+      while (p < e)
+         *p++ ^= 0xFF;
+      p -= n;
+   }
+   p += n;
+   if (w & 7)
+      part (~(0xFF >> (w & 7)));
+}
+
+static void
+fb_changed (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h)
+{                               // Note logical area changed directly
+   if (!fb.dirty || x < fb.dx0)
+      fb.dx0 = x;
+   if (!fb.dirty || y < fb.dy0)
+      fb.dy0 = y;
+   if (!fb.dirty || x + w - 1 > fb.dx1)
+      fb.dx1 = x + w - 1;
+   if (!fb.dirty || y + h - 1 > fb.dy1)
+      fb.dy1 = y + h - 1;
+   fb.dirty = 1;
+}
+
+void
+fb_sync (void)
+{                               // Tell gfx of direct changes, called with display locked
+   if (!fb.dirty)
+      return;
+   fb.dirty = 0;
+   gfx_pos_t W = gfx_width (),
+      H = gfx_height ();
+   gfx_pos_t x0 = (fb.dx0 < 0 ? 0 : fb.dx0),
+      y0 = (fb.dy0 < 0 ? 0 : fb.dy0),
+      x1 = (fb.dx1 >= W ? W - 1 : fb.dx1),
+      y1 = (fb.dy1 >= H ? H - 1 : fb.dy1);
+   if (x0 > x1 || y0 > y1)
+      return;
+   gfx_changed (x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+static void
+fb_op (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h, uint8_t op)
+{
+   int32_t rx,
+     ry,
+     rw,
+     rh;
+   if (!fb_rect (x, y, w, h, &rx, &ry, &rw, &rh))
+      return;
+   for (int32_t r = ry; r < ry + rh; r++)
+      fb_row (fb.b + r * fb.stride, rx, rw, op);
+   fb_changed (x, y, w, h);
+}
+
+int
+fb_fill (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h, uint8_t black)
+{                               // Fill rectangle black or white, returns 0 if not possible (use gfx_pixel)
+   if (!fb.ok)
+      return 0;
+   fb_op (x, y, w, h, black == fb.black ? FB_SET : FB_CLR);
+   return 1;
+}
+
+int
+fb_invert (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h)
+{                               // Invert rectangle
+   if (!fb.ok)
+      return 0;
+   fb_op (x, y, w, h, FB_XOR);
+   return 1;
+}
+
+int
+fb_random (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h)
+{                               // Random fill rectangle
+   if (!fb.ok)
+      return 0;
+   fb_op (x, y, w, h, FB_RANDOM);
+   return 1;
+}
+
+static inline void
+fb_put (int32_t rx, int32_t ry, uint8_t v)
+{                               // Set raw bit
+   uint8_t *p = fb.b + ry * fb.stride + rx / 8;
+   uint8_t m = (0x80 >> (rx & 7));
+   if (v)
+      *p |= m;
+   else
+      *p &= ~m;
+}
+
+int
+fb_blit (gfx_pos_t x, gfx_pos_t y, gfx_pos_t w, gfx_pos_t h, const uint8_t * src, const uint8_t * mask, uint32_t stride)
+{                               // Plot 1 bit (MSB first, 1 is black) bitmap, where mask (if not NULL) set
+   if (!fb.ok)
+      return 0;
+   gfx_pos_t W = gfx_width (),
+      H = gfx_height ();
+   for (gfx_pos_t sy = 0; sy < h; sy++)
+   {
+      gfx_pos_t ly = y + sy;
+      if (ly < 0 || ly >= H)
+         continue;
+      const uint8_t *s = src + sy * stride,
+         *m = mask ? mask + sy * stride : NULL;
+      int32_t rx = fb.ox + x * fb.xx + ly * fb.yx,
+         ry = fb.oy + x * fb.xy + ly * fb.yy;
+      for (gfx_pos_t sx = 0; sx < w; sx++, rx += fb.xx, ry += fb.xy)
+      {
+         gfx_pos_t lx = x + sx;
+         if (!(sx & 7) && sx + 8 <= w && m && !m[sx / 8])
+         {                      // Skip whole byte with nothing to do
+            rx += 7 * fb.xx;
+            ry += 7 * fb.xy;
+            sx += 7;
+            continue;
+         }
+         if (lx < 0 || lx >= W)
+            continue;
+         uint8_t bit = (0x80 >> (sx & 7));
+         if (m && !(m[sx / 8] & bit))
+            continue;
+         fb_put (rx, ry, (s[sx / 8] & bit) ? fb.black : !fb.black);
+      }
+   }
+   fb_changed (x, y, w, h);
+   return 1;
+}
+
+// Message cache, gfx_message output kept as clipped bitmaps
+
+typedef struct msg_s
+{
+   char *text;                  // Message
+   uint32_t hash;               // Hash of text
+   uint32_t used;               // LRU counter, 0 if not in use
+   uint8_t pinned:1;            // Not evicted
+   gfx_pos_t x,
+     y,
+     w,
+     h;                         // Logical bounding box
+   uint8_t *bits;               // Rows of 1 bit per pixel, 1 is black
+} msg_t;
+
+static msg_t msgs[MSGCACHE] = { 0 };
+
+static uint32_t msgused = 0;
+
+static uint32_t
+hash_str (const char *s)
+{                               // FNV-1a
+   uint32_t h = 2166136261U;
+   while (*s)
+      h = (h ^ (uint8_t) * s++) * 16777619U;
+   return h;
+}
+
+static void
+fb_logical (int32_t rx, int32_t ry, gfx_pos_t * x, gfx_pos_t * y)
+{                               // Raw to logical co-ordinates
+   if (fb.xx)
+   {
+      *x = (rx - fb.ox) / fb.xx;
+      *y = (ry - fb.oy) / fb.yy;
+   } else
+   {
+      *x = (ry - fb.oy) / fb.xy;
+      *y = (rx - fb.ox) / fb.yx;
+   }
+}
+
+static msg_t *
+msg_render (const char *text)
+{                               // Render message and capture it, called with display locked, display unchanged
+   uint32_t hash = hash_str (text);
+   msg_t *m = NULL;
+   for (int n = 0; n < MSGCACHE; n++)
+      if (msgs[n].used && msgs[n].hash == hash && !strcmp (msgs[n].text, text))
+      {
+         msgs[n].used = ++msgused;
+         return &msgs[n];
+      }
+   if (!fb.ok)
+      return NULL;
+   for (int n = 0; n < MSGCACHE; n++)
+      if (!msgs[n].pinned && (!m || msgs[n].used < m->used))
+         m = &msgs[n];          // Least recently used
+   if (!m)
+      return NULL;
+   size_t len = fb.stride * fb.h;
+   uint8_t *save = mem_alloc (MEM_OTHER, len);
+   if (!save)
+      return NULL;
+   memcpy (save, fb.b, len);
+   gfx_clear (0);
+   uint8_t white = (fb.black ? 0 : 0xFF);
+   gfx_message (text);
+   int32_t rx0 = fb.w,
+      ry0 = fb.h,
+      rx1 = -1,
+      ry1 = -1;
+   for (uint32_t ry = 0; ry < fb.h; ry++)
+   {                            // Raw bounding box, a byte at a time
+      uint8_t *r = fb.b + ry * fb.stride;
+      for (uint32_t c = 0; c < fb.stride; c++)
+         if (r[c] != white)
+         {
+            if (ry < ry0)
+               ry0 = ry;
+            ry1 = ry;
+            if (c * 8 < rx0)
+               rx0 = c * 8;
+            if (c * 8 + 7 > rx1)
+               rx1 = c * 8 + 7;
+         }
+   }
+   if (rx1 >= (int32_t) fb.w)
+      rx1 = fb.w - 1;
+   mem_free (MEM_CACHE, m->text);
+   mem_free (MEM_CACHE, m->bits);
+   memset (m, 0, sizeof (*m));
+   if (rx1 >= 0 && (m->text = mem_strdup (MEM_CACHE, text)))
+   {
+      gfx_pos_t ax,
+        ay,
+        bx,
+        by;
+      fb_logical (rx0, ry0, &ax, &ay);
+      fb_logical (rx1, ry1, &bx, &by);
+      m->x = (ax < bx ? ax : bx);
+      m->y = (ay < by ? ay : by);
+      m->w = abs (bx - ax) + 1;
+      m->h = abs (by - ay) + 1;
+      uint32_t stride = (m->w + 7) / 8;
+      if ((m->bits = mem_alloc (MEM_CACHE, stride * m->h)))
+      {
+         memset (m->bits, 0, stride * m->h);
+         for (gfx_pos_t y = 0; y < m->h; y++)
+            for (gfx_pos_t x = 0; x < m->w; x++)
+               if (fb_get (m->x + x, m->y + y))
+                  m->bits[y * stride + x / 8] |= (0x80 >> (x & 7));
+         m->hash = hash;
+         m->used = ++msgused;
+      } else
+      {
+         mem_free (MEM_CACHE, m->text);
+         m->text = NULL;
+      }
+   }
+   memcpy (fb.b, save, len);
+   mem_free (MEM_OTHER, save);
+   return m->used ? m : NULL;
+}
+
+void
+msg_draw (const char *text)
+{                               // Draw message, from cache where possible, called with display locked
+   uint8_t was = stage (STAGE_RENDER);
+   msg_t *m = msg_render (text);
+   if (!m || !fb_blit (m->x, m->y, m->w, m->h, m->bits, m->bits, (m->w + 7) / 8))
+      gfx_message (text);
+   stage (was);
+}
+
+void
+msg_pin (const char *text)
+{                               // Render and keep message, called with display locked
+   msg_t *m = msg_render (text);
+   if (m)
+      m->pinned = 1;
+}
+
+// Last frame, saved to SD so a restart can carry on showing it
+
+typedef struct frame_hdr_s
+{
+   uint32_t magic;              // FRAMEMAGIC
+   uint32_t w,
+     h;                         // Raw size
+   uint8_t flip;                // gfxflip
+   uint8_t invert;              // gfxinvert
+   char season;                 // Season shown
+   uint32_t id[2];              // CRC of idle image and overlay shown
+   uint32_t crc;                // CRC of frame buffer
+} frame_hdr_t;
+
+static frame_hdr_t frame = { 0 };       // Last saved or restored
+static RTC_NOINIT_ATTR uint32_t frame_sent[2];  // FRAMEMAGIC and CRC of frame buffer last sent to panel, kept over reset
+
+void
+frame_update (void)
+{                               // Record what is being sent to the panel, called with display locked
+   if (!card || !fb_raw ())
+      return;
+   frame_sent[0] = FRAMEMAGIC;
+   frame_sent[1] = esp_rom_crc32_le (0, gfx_raw_b (), (gfx_raw_w () + 7) / 8 * gfx_raw_h ());
+}
+
+void
+frame_forget (void)
+{                               // Saved frame no longer what is shown, called with display mutex held
+   if (!card || frame.magic != FRAMEMAGIC)
+      return;
+   char *fn = NULL;
+   mem_asprintf (MEM_OTHER, &fn, "%s/%s", sd_mount, FRAMEFILE);
+   if (fn)
+      unlink (fn);
+   mem_free (MEM_OTHER, fn);
+   frame.magic = 0;
+}
+
+void
+frame_save (file_t * i, file_t * o)
+{                               // Save frame buffer if what is shown has changed, called with display mutex held
+   if (!card || !fb_raw ())
+      return;
+   frame_hdr_t h = {.magic = FRAMEMAGIC,.w = gfx_raw_w (),.h = gfx_raw_h (),.flip = gfxflip,.invert = gfxinvert,.season = season };
+   h.id[0] = (i ? i->crc : 0);
+   h.id[1] = (o ? o->crc : 0);
+   if (frame.magic == FRAMEMAGIC && !memcmp (frame.id, h.id, sizeof (h.id)) && frame.season == h.season)
+      return;                   // Same images, only the time has changed
+   size_t len = (h.w + 7) / 8 * h.h;
+   h.crc = esp_rom_crc32_le (0, gfx_raw_b (), len);
+   uint8_t was = stage (STAGE_SD);
+   char *fn = NULL,
+      *tmp = NULL;
+   mem_asprintf (MEM_OTHER, &fn, "%s/%s", sd_mount, FRAMEFILE);
+   mem_asprintf (MEM_OTHER, &tmp, "%s/frame.tmp", sd_mount);
+   FILE *f = (fn && tmp ? fopen (tmp, "w") : NULL);
+   if (f)
+   {
+      if (fwrite (&h, sizeof (h), 1, f) != 1 || fwrite (gfx_raw_b (), len, 1, f) != 1)
+      {
+         fclose (f);
+         unlink (tmp);
+      } else
+      {
+         fclose (f);
+         unlink (fn);
+         if (rename (tmp, fn))
+            unlink (tmp);
+         else
+         {
+            stats.sd_write++;
+            frame = h;
+         }
+      }
+   }
+   mem_free (MEM_OTHER, tmp);
+   mem_free (MEM_OTHER, fn);
+   stage (was);
+}
+
+int
+frame_load (void)
+{                               // Restore last frame to frame buffer, returns 1 if done, 2 if also what the panel was last sent, called with display locked
+   if (!card || !fb_raw ())
+      return 0;
+   char *fn = NULL;
+   mem_asprintf (MEM_OTHER, &fn, "%s/%s", sd_mount, FRAMEFILE);
+   FILE *f = (fn ? fopen (fn, "r") : NULL);
+   mem_free (MEM_OTHER, fn);
+   if (!f)
+      return 0;
+   frame_hdr_t h;
+   size_t len = (gfx_raw_w () + 7) / 8 * gfx_raw_h ();
+   uint8_t *buf = NULL;
+   if (fread (&h, sizeof (h), 1, f) == 1 && h.magic == FRAMEMAGIC && h.w == gfx_raw_w () && h.h == gfx_raw_h () && h.flip == gfxflip
+       && h.invert == gfxinvert && (buf = mem_alloc (MEM_OTHER, len)) && fread (buf, len, 1, f) == 1
+       && esp_rom_crc32_le (0, buf, len) == h.crc)
+   {
+      memcpy (gfx_raw_b (), buf, len);
+      frame = h;
+      stats.sd_read++;
+   } else
+      h.magic = 0;
+   mem_free (MEM_OTHER, buf);
+   fclose (f);
+   if (h.magic != FRAMEMAGIC)
+      return 0;
+   if (frame_sent[0] == FRAMEMAGIC && frame_sent[1] == h.crc)
+      return 2;
+   return 1;
+}
+
+// Image plot
+
+typedef struct dither_s
+{                               // Dither state, pixels arrive a row at a time left to right
+   uint8_t mode;
+   uint32_t w;                  // Image width
+   uint32_t y;                  // Current row
+   int16_t *err;                // Error for next row, w+2 entries, offset by 1 (diffuse only)
+   int16_t right;               // Error carried to next pixel on this row
+   int16_t below;               // Error for next row one pixel right, added once that entry is read
+   uint8_t red;                 // Red threshold
+   struct
+   {
+      uint32_t rgb;             // 8 bit RGB, top bit set if not valid
+      uint8_t lum;              // Luminance
+      uint8_t red:1;            // Is red
+   } lut[COLOURLUT];            // Classification cache
+} dither_t;
+
+static const uint8_t bayer[8][8] = {
+   {0, 32, 8, 40, 2, 34, 10, 42},
+   {48, 16, 56, 24, 50, 18, 58, 26},
+   {12, 44, 4, 36, 14, 46, 6, 38},
+   {60, 28, 52, 20, 62, 30, 54, 22},
+   {3, 35, 11, 43, 1, 33, 9, 41},
+   {51, 19, 59, 27, 49, 17, 57, 25},
+   {15, 47, 7, 39, 13, 45, 5, 37},
+   {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+static void
+dither_start (dither_t * d, uint8_t mode, uint32_t w)
+{
+   memset (d, 0, sizeof (*d));
+   d->mode = mode;
+   d->w = w;
+#ifdef	GFX_RED
+   d->red = imagered;
+#endif
+   for (int n = 0; n < COLOURLUT; n++)
+      d->lut[n].rgb = 0x80000000;
+   if (mode == DITHER_DIFFUSE && (d->err = mem_alloc (MEM_PNG, (w + 2) * sizeof (*d->err))))
+      memset (d->err, 0, (w + 2) * sizeof (*d->err));
+}
+
+static void
+dither_end (dither_t * d)
+{
+   mem_free (MEM_PNG, d->err);
+   d->err = NULL;
+}
+
+static uint8_t
+dither_pixel (dither_t * d, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+{                               // Return RLE_CLEAR, RLE_BLACK, RLE_WHITE or RLE_RED for a pixel
+   if (y != d->y)
+   {                            // New row
+      if (y < d->y && d->err)
+         memset (d->err, 0, (d->w + 2) * sizeof (*d->err));     // Interlaced pass, start again
+      d->y = y;
+      d->right = d->below = 0;
+   }
+   uint8_t skip (uint8_t v)
+   {                            // Pixel not dithered, no error to pass on
+      if (d->err && x < d->w)
+         d->err[x + 1] = d->below;
+      d->right = d->below = 0;
+      return v;
+   }
+   if (!(a & 0x8000))
+      return skip (RLE_CLEAR);
+   if (d->mode == DITHER_NONE && !d->red)
+      return (g & 0x8000) ? RLE_WHITE : RLE_BLACK;
+   // Classify once per colour, palette images hit the cache almost every time
+   uint32_t rgb = ((r >> 8) << 16) | ((g >> 8) << 8) | (b >> 8);
+   typeof (d->lut[0]) * c = &d->lut[(rgb ^ (rgb >> 5) ^ (rgb >> 13)) & (COLOURLUT - 1)];
+   if (c->rgb != rgb)
+   {
+      c->rgb = rgb;
+      c->lum = ((uint32_t) r * 19595 + (uint32_t) g * 38470 + (uint32_t) b * 7471) >> 24;   // 0-255
+      uint8_t r8 = (r >> 8),
+         m = ((g > b ? g : b) >> 8);
+      c->red = (d->red && r8 > m && r8 - m >= d->red);
+   }
+   if (c->red)
+      return skip (RLE_RED);
+   if (d->mode == DITHER_NONE)
+      return (g & 0x8000) ? RLE_WHITE : RLE_BLACK;
+   int16_t l = c->lum;
+   if (d->mode == DITHER_ORDERED || !d->err || x >= d->w)
+      return (l > bayer[y & 7][x & 7] * 4 + 1) ? RLE_WHITE : RLE_BLACK;
+   int16_t *e = d->err + x + 1;
+   int16_t v = l + d->right + *e;
+   uint8_t white = (v >= 128);
+   int16_t q = v - (white ? 255 : 0);
+   e[-1] += q * 3 / 16;         // Below left
+   *e = q * 5 / 16 + d->below;  // Below
+   d->below = q / 16;           // Below right, once read
+   d->right = q * 7 / 16;       // Right
+   return white ? RLE_WHITE : RLE_BLACK;
+}
+
+typedef struct plot_s
+{
+   gfx_pos_t ox,
+     oy;
+   dither_t dither;
+} plot_t;
+
+typedef struct arena_s
+{                               // Bump allocator for lwpng/zlib, reset after each image
+   uint8_t *base;
+   size_t size;                 // Size of base
+   size_t used;                 // Used in base
+   size_t need;                 // Total requested since reset, including fallback
+   size_t high;                 // High water mark of need
+   uint32_t fallback;           // Allocations that did not fit and used mallocspi
+} arena_t;
+
+static arena_t decode_arena = { 0 };    // Used by display task
+static arena_t encode_arena = { 0 };    // Used by httpd task
+
+static void
+arena_reset (arena_t * a)
+{                               // Reset, growing to fit last use so later images need no allocation at all
+   if (a->need > a->high)
+      a->high = a->need;
+   if (a->need > a->size)
+   {
+      mem_free (MEM_PNG, a->base);
+      a->size = (a->need + 4095) & ~4095;
+      if (!(a->base = mem_alloc (MEM_PNG, a->size)))
+         a->size = 0;
+   }
+   a->used = 0;
+   a->need = 0;
+}
+
+static void *
+my_alloc (void *opaque, uInt items, uInt size)
+{
+   arena_t *a = opaque;
+   size_t len = ((size_t) items * size + 7) & ~7;
+   if (!a)
+      return mallocspi (len);
+   a->need += len;
+   if (a->base && a->used + len <= a->size)
+   {
+      void *r = a->base + a->used;
+      a->used += len;
+      return r;
+   }
+   a->fallback++;
+   return mallocspi (len);
+}
+
+static void
+my_free (void *opaque, void *address)
+{
+   arena_t *a = opaque;
+   if (a && a->base && (uint8_t *) address >= a->base && (uint8_t *) address < a->base + a->size)
+      return;                   // Freed on reset
+   free (address);
+}
+
+static const char *
+pixel (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+{
+   plot_t *p = opaque;
+   uint8_t v = dither_pixel (&p->dither, x, y, r, g, b, a);
+#ifdef	GFX_RED
+   if (v == RLE_RED)
+   {
+      uint32_t f = gfx_f ();
+      gfx_foreground (0xFF0000);
+      gfx_pixel (p->ox + x, p->oy + y, 255);
+      gfx_foreground (f);
+   } else
+#endif
+   if (v != RLE_CLEAR)
+      gfx_pixel (p->ox + x, p->oy + y, v == RLE_WHITE ? 255 : 0);
+   return NULL;
+}
+
+void
+plot_png (file_t * i, gfx_pos_t ox, gfx_pos_t oy, uint8_t dither)
+{                               // Decode PNG direct to display
+   plot_t settings = { ox, oy };
+   dither_start (&settings.dither, dither, i->w);
+   uint8_t was = stage (STAGE_DECODE);
+   int64_t start = esp_timer_get_time ();
+   lwpng_decode_t *p = lwpng_decode (&settings, NULL, &pixel, &my_alloc, &my_free, &decode_arena);
+   lwpng_data (p, i->size, i->data);
+   const char *e = lwpng_decoded (&p);
+   arena_reset (&decode_arena);
+   dither_end (&settings.dither);
+   stats.decode_count++;
+   stats.decode_us += esp_timer_get_time () - start;
+   stage (was);
+   if (e)
+      ESP_LOGE (TAG, "PNG fail %s", e);
+}
+
+typedef struct rle_map_s
+{                               // 2 bits per pixel map used whilst building run length bitmap
+   uint32_t w,
+     h;
+   uint8_t *map;
+   dither_t dither;
+} rle_map_t;
+
+static inline uint8_t
+rle_get (const rle_map_t * m, size_t o)
+{
+   return (m->map[o / 4] >> ((o & 3) * 2)) & 3;
+}
+
+static inline void
+rle_set (rle_map_t * m, size_t o, uint8_t v)
+{
+   m->map[o / 4] = (m->map[o / 4] & ~(3 << ((o & 3) * 2))) | (v << ((o & 3) * 2));
+}
+
+static const char *
+rle_pixel (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+{                               // Whole 2 bit map, for interlaced PNG
+   rle_map_t *m = opaque;
+   if (x >= m->w || y >= m->h)
+      return NULL;
+   rle_set (m, (size_t) y * m->w + x, dither_pixel (&m->dither, x, y, r, g, b, a));
+   return NULL;
+}
+
+static size_t
+rle_encode (const rle_map_t * m, uint8_t * out)
+{                               // Encode runs, per row, returns length, out can be NULL to just get length
+   size_t n = 0,
+      o = 0;
+   for (uint32_t y = 0; y < m->h; y++)
+      for (uint32_t x = 0; x < m->w;)
+      {
+         uint8_t v = rle_get (m, o);
+         uint32_t len = 1;
+         while (len < RLE_RUN && x + len < m->w && rle_get (m, o + len) == v)
+            len++;
+         if (out)
+            out[n] = (v << 6) | (len - 1);
+         n++;
+         x += len;
+         o += len;
+      }
+   return n;
+}
+
+static size_t
+rle_pack (const rle_map_t * m, uint8_t * out)
+{                               // Pack to 1 bit per pixel, returns length, 0 if not just black and white, out (zeroed) can be NULL to just check
+   size_t stride = (m->w + 7) / 8,
+      o = 0;
+   for (uint32_t y = 0; y < m->h; y++)
+      for (uint32_t x = 0; x < m->w; x++, o++)
+      {
+         uint8_t v = rle_get (m, o);
+         if (v != RLE_BLACK && v != RLE_WHITE)
+            return 0;
+         if (out && v == RLE_WHITE)
+            out[y * stride + x / 8] |= (0x80 >> (x & 7));
+      }
+   return stride * m->h;
+}
+
+typedef struct rle_out_s
+{                               // Run length bitmap being built a row at a time
+   uint8_t *data;
+   size_t len,                  // Bytes used
+     size;                      // Bytes allocated
+   uint8_t pack;                // As file_t pack
+} rle_out_t;
+
+static int
+rle_out_row (rle_out_t * o, const rle_map_t * row, uint32_t y, uint32_t h)
+{                               // Append row y of h, 0 if no memory
+   size_t stride = (row->w + 7) / 8,
+      need = (o->pack == 1 ? stride * h : o->pack == 2 ? ((size_t) row->w * h + 3) / 4 : o->len + rle_encode (row, NULL));
+   if (need > o->size)
+   {                            // Packed pixels allocated in full, runs grow
+      size_t size = (o->pack ? need : need * 2);
+      uint8_t *d = mem_alloc (MEM_CACHE, size);
+      if (!d)
+         return 0;
+      memset (d, 0, size);
+      if (o->len)
+         memcpy (d, o->data, o->len);
+      mem_free (MEM_CACHE, o->data);
+      o->data = d;
+      o->size = size;
+   }
+   if (o->pack == 1)
+   {
+      rle_pack (row, o->data + y * stride);
+      o->len = (y + 1) * stride;
+   } else if (o->pack == 2)
+   {
+      rle_map_t m = {.w = row->w,.h = h,.map = o->data };
+      for (uint32_t x = 0; x < row->w; x++)
+         rle_set (&m, (size_t) y * row->w + x, rle_get (row, x));
+      o->len = ((size_t) (y + 1) * row->w + 3) / 4;
+   } else
+      o->len += rle_encode (row, o->data + o->len);
+   return 1;
+}
+
+static const uint8_t *
+rle_out_get (const rle_out_t * o, rle_map_t * row, uint32_t y, const uint8_t * p)
+{                               // Expand row y, p is where the row starts in runs, returns where the next row starts
+   if (o->pack == 1)
+   {
+      const uint8_t *r = o->data + y * ((row->w + 7) / 8);
+      for (uint32_t x = 0; x < row->w; x++)
+         rle_set (row, x, (r[x / 8] & (0x80 >> (x & 7))) ? RLE_WHITE : RLE_BLACK);
+   } else if (o->pack == 2)
+   {
+      rle_map_t m = {.w = row->w,.map = o->data };
+      for (uint32_t x = 0; x < row->w; x++)
+         rle_set (row, x, rle_get (&m, (size_t) y * row->w + x));
+   } else
+      for (uint32_t x = 0; x < row->w; p++)
+         for (uint8_t l = 0; l <= (*p & (RLE_RUN - 1)) && x < row->w; l++)
+            rle_set (row, x++, *p >> 6);
+   return p;
+}
+
+static int
+rle_out_convert (rle_out_t * o, uint8_t pack, uint32_t w, uint32_t rows, uint32_t h)
+{                               // Encode rows so far again as pack, 0 if no memory
+   rle_out_t n = {.pack = pack };
+   rle_map_t row = {.w = w,.h = 1 };
+   if (!(row.map = mem_alloc (MEM_CACHE, (w + 3) / 4)))
+      return 0;
+   const uint8_t *p = o->data;
+   int ok = 1;
+   for (uint32_t y = 0; ok && y < rows; y++)
+   {
+      p = rle_out_get (o, &row, y, p);
+      ok = rle_out_row (&n, &row, y, h);
+   }
+   mem_free (MEM_CACHE, row.map);
+   if (!ok)
+   {
+      mem_free (MEM_CACHE, n.data);
+      return 0;
+   }
+   mem_free (MEM_CACHE, o->data);
+   *o = n;
+   return 1;
+}
+
+typedef struct rle_stream_s
+{                               // Run length bitmap built as the PNG is decoded, so no whole 2 bit map is needed
+   rle_map_t row;               // Row being decoded, and dither state
+   uint32_t h;
+   uint32_t x,
+     y;                         // Next pixel expected, rows come in order unless interlaced
+   size_t runs;                 // Size of rows so far as runs, whatever they are held as
+   uint8_t bw:1;                // Rows so far are only black and white
+   rle_out_t out;
+} rle_stream_t;
+
+static const char *
+rle_stream_row (rle_stream_t * s)
+{                               // Row done, hold rows so far as whichever is smallest, as for the whole image at the end
+   uint32_t w = s->row.w;
+   s->runs += rle_encode (&s->row, NULL);
+   if (s->bw && !rle_pack (&s->row, NULL))
+      s->bw = 0;
+   size_t alt = (s->bw ? (w + 7) / 8 * s->h : ((size_t) w * s->h + 3) / 4);
+   uint8_t pack = (s->runs <= alt ? 0 : s->bw ? 1 : 2);
+   if (pack != s->out.pack && !rle_out_convert (&s->out, pack, w, s->y, s->h))
+      return "No memory";
+   if (!rle_out_row (&s->out, &s->row, s->y, s->h))
+      return "No memory";
+   s->x = 0;
+   s->y++;
+   return NULL;
+}
+
+static const char *
+rle_stream_pixel (void *opaque, uint32_t x, uint32_t y, uint16_t r, uint16_t g, uint16_t b, uint16_t a)
+{
+   rle_stream_t *s = opaque;
+   if (x >= s->row.w || y >= s->h)
+      return NULL;
+   if (x != s->x || y != s->y)
+      return "Pixels out of order";
+   rle_set (&s->row, x, dither_pixel (&s->row.dither, x, y, r, g, b, a));
+   if (++s->x < s->row.w)
+      return NULL;
+   return rle_stream_row (s);
+}
+
+void
+rle_expand (const file_t * i, uint8_t * map)
+{                               // Expand rle, whatever the format, to 2 bits per pixel map
+   rle_map_t m = {.w = i->w,.h = i->h,.map = map };
+   size_t o = 0;
+   if (i->pack == 2)
+      memcpy (map, i->rle, i->rlesize);
+   else if (i->pack == 1)
+   {
+      uint32_t stride = (i->w + 7) / 8;
+      for (uint32_t y = 0; y < i->h; y++)
+         for (uint32_t x = 0; x < i->w; x++, o++)
+            rle_set (&m, o, (i->rle[y * stride + x / 8] & (0x80 >> (x & 7))) ? RLE_WHITE : RLE_BLACK);
+   } else
+      for (const uint8_t * p = i->rle, *e = p + i->rlesize; p < e; p++)
+         for (uint8_t l = 0; l <= (*p & (RLE_RUN - 1)); l++, o++)
+            rle_set (&m, o, *p >> 6);
+}
+
+void
+rle_build (file_t * i, uint8_t dither)
+{                               // Decode PNG once to run length bitmap, mostly white signage is a few bytes a row, dithered images are packed pixels
+   uint8_t red = 0;
+#ifdef	GFX_RED
+   red = imagered;
+#endif
+   if (i->rle && (i->dither != dither || i->red != red))
+   {                            // Different dither or red threshold, build again
+      mem_free (MEM_CACHE, i->rle);
+      i->rle = NULL;
+      i->rlesize = 0;
+   }
+   if (i->rle || i->json || !i->w || !i->h)
+      return;
+   rle_stream_t st = {.row = {.w = i->w,.h = 1 },.h = i->h,.bw = 1 };
+   rle_map_t m = {.w = i->w,.h = i->h };
+   uint8_t interlaced = (i->size > 28 && i->data[28]);  // IHDR interlace method, pixels do not come a row at a time
+   const char *e = NULL;
+   if (!(st.row.map = mem_alloc (MEM_CACHE, (i->w + 3) / 4)))
+      return;
+   memset (st.row.map, 0, (i->w + 3) / 4);
+   if (interlaced)
+   {                            // Needs the whole 2 bit map
+      size_t len = ((size_t) m.w * m.h + 3) / 4;
+      if (!(m.map = mem_alloc (MEM_CACHE, len)))
+      {
+         mem_free (MEM_CACHE, st.row.map);
+         return;
+      }
+      memset (m.map, 0, len);
+   }
+   dither_start (interlaced ? &m.dither : &st.row.dither, dither, i->w);
+   uint8_t was = stage (STAGE_DECODE);
+   int64_t start = esp_timer_get_time ();
+   lwpng_decode_t *p = lwpng_decode (interlaced ? (void *) &m : (void *) &st, NULL, interlaced ? &rle_pixel : &rle_stream_pixel,
+                                     &my_alloc, &my_free, &decode_arena);
+   lwpng_data (p, i->size, i->data);
+   e = lwpng_decoded (&p);
+   arena_reset (&decode_arena);
+   dither_end (interlaced ? &m.dither : &st.row.dither);
+   if (!e && interlaced)
+      for (uint32_t y = 0; !e && y < m.h; y++)
+      {                         // Rows from the map
+         for (uint32_t x = 0; x < m.w; x++)
+            rle_set (&st.row, x, rle_get (&m, (size_t) y * m.w + x));
+         e = rle_stream_row (&st);
+      }
+   if (!e && st.y < st.h)
+   {                            // Rows not decoded are left as 0, as in a 2 bit map
+      memset (st.row.map, 0, (i->w + 3) / 4);
+      while (!e && st.y < st.h)
+         e = rle_stream_row (&st);
+   }
+   stats.decode_count++;
+   stats.decode_us += esp_timer_get_time () - start;
+   stage (was);
+   if (e)
+      ESP_LOGE (TAG, "PNG fail %s", e);
+   else if (st.out.data && st.out.len < st.out.size && (i->rle = mem_alloc (MEM_CACHE, st.out.len)))
+   {                            // Runs are grown as needed, so trim
+      memcpy (i->rle, st.out.data, st.out.len);
+      mem_free (MEM_CACHE, st.out.data);
+      st.out.data = NULL;
+   } else
+   {
+      i->rle = st.out.data;
+      st.out.data = NULL;
+   }
+   if (i->rle)
+   {
+      i->rlesize = st.out.len;
+      i->pack = st.out.pack;
+      i->dither = dither;
+      i->red = red;
+   }
+   mem_free (MEM_CACHE, st.out.data);
+   mem_free (MEM_CACHE, st.row.map);
+   mem_free (MEM_CACHE, m.map);
+}
+
+static uint8_t
+plot_fgblack (uint8_t mode)
+{                               // Plot mode (imageplot) puts 255 (white in image) as black
+   return mode == REVK_SETTINGS_IMAGEPLOT_NORMAL || mode == REVK_SETTINGS_IMAGEPLOT_MASK;
+}
+
+static uint8_t
+plot_bgblack (uint8_t mode)
+{                               // Plot mode (imageplot) puts 0 (black in image) as black
+   return !(mode == REVK_SETTINGS_IMAGEPLOT_NORMAL || mode == REVK_SETTINGS_IMAGEPLOT_MASKINVERT);
+}
+
+void
+rle_blit (file_t * i, gfx_pos_t ox, gfx_pos_t oy, uint8_t mode)
+{                               // Plot run length bitmap direct to display, mode is as imageplot
+   int64_t start = esp_timer_get_time ();
+   // Colours as per plot, 255 (white in image) is foreground, 0 is background
+   uint8_t fgblack = plot_fgblack (mode);
+   uint8_t bgblack = plot_bgblack (mode);
+   void run (uint32_t x, uint32_t y, uint8_t v, uint32_t len)
+   {
+#ifdef	GFX_RED
+      if (v == RLE_RED)
+      {                         // Both planes, via gfx
+         uint32_t f = gfx_f ();
+         gfx_foreground (0xFF0000);
+         for (uint32_t l = 0; l < len; l++)
+            gfx_pixel (ox + x + l, oy + y, 255);
+         gfx_foreground (f);
+      } else
+#endif
+      if (v != RLE_CLEAR && !fb_fill (ox + x, oy + y, len, 1, v == RLE_WHITE ? fgblack : bgblack))
+      {
+         gfx_intensity_t c = (v == RLE_WHITE ? 255 : 0);
+         for (uint32_t l = 0; l < len; l++)
+            gfx_pixel (ox + x + l, oy + y, c);
+      }
+   }
+   if (i->pack == 1)
+   {                            // 1 bit per pixel, every pixel is set
+      uint32_t stride = (i->w + 7) / 8;
+      int done;
+      if (fgblack == bgblack)
+         done = fb_fill (ox, oy, i->w, i->h, fgblack);
+      else if ((done = fb_blit (ox, oy, i->w, i->h, i->rle, NULL, stride)) && !fgblack)
+         fb_invert (ox, oy, i->w, i->h);
+      if (!done)
+         for (uint32_t y = 0; y < i->h; y++)
+            for (uint32_t x = 0; x < i->w; x++)
+               run (x, y, (i->rle[y * stride + x / 8] & (0x80 >> (x & 7))) ? RLE_WHITE : RLE_BLACK, 1);
+   } else if (i->pack == 2)
+   {                            // 2 bits per pixel, plotted as runs
+      rle_map_t m = {.w = i->w,.h = i->h,.map = i->rle };
+      size_t o = 0;
+      for (uint32_t y = 0; y < i->h; y++)
+         for (uint32_t x = 0; x < i->w;)
+         {
+            uint8_t v = rle_get (&m, o);
+            uint32_t len = 1;
+            while (x + len < i->w && rle_get (&m, o + len) == v)
+               len++;
+            run (x, y, v, len);
+            x += len;
+            o += len;
+         }
+   } else
+   {
+      const uint8_t *p = i->rle,
+         *e = p + i->rlesize;
+      for (uint32_t y = 0; y < i->h && p < e; y++)
+         for (uint32_t x = 0; x < i->w && p < e; p++)
+         {
+            uint8_t len = (*p & (RLE_RUN - 1)) + 1;
+            run (x, y, *p >> 6, len);
+            x += len;
+         }
+   }
+   stats.blit_count++;
+   stats.blit_us += esp_timer_get_time () - start;
+}
+
+void
+plot (file_t * i, gfx_pos_t ox, gfx_pos_t oy, uint8_t dither, uint8_t mode)
+{                               // Plot image, decoding to run length bitmap first time (or when dither changes), mode is as imageplot
+   rle_build (i, dither);
+   gfx_foreground (plot_fgblack (mode) ? 0 : 0xFFFFFF); // For anything plotted via gfx
+   gfx_background (plot_bgblack (mode) ? 0 : 0xFFFFFF);
+   if (i->rle)
+      rle_blit (i, ox, oy, mode);
+   else
+      plot_png (i, ox, oy, dither);
+   gfx_foreground (0);
+   gfx_background (0xFFFFFF);
+}
+
+// Scenes, JSON layout files compiled once to a display list
+
+const char *gfx_qr (const char *value, int s);
+
+typedef struct scene_op_s
+{                               // Display list entry
+   uint8_t op;                  // SCENE_*
+   uint8_t align;               // GFX_* alignment
+   uint8_t size;                // Text, QR or clock size
+   uint8_t pushed:2;            // 0 any, 1 idle only, 2 pushed only
+   uint8_t presence;            // Presence bits that must be set
+   uint8_t absence;             // Presence bits that must be clear
+   char season;                 // Season code, 0 for any
+   gfx_pos_t x,
+     y;
+   uint16_t from,
+     to;                        // Minute of day range, from==to for all day
+   uint16_t str;                // Offset of string, after the list
+   file_t *file;                // Image, set by scene_prepare
+} scene_op_t;
+
+typedef struct scene_s
+{
+   uint16_t count;
+   scene_op_t op[];             // Followed by strings
+} scene_t;
+
+enum
+{
+   SCENE_IMAGE,
+   SCENE_TEXT,
+   SCENE_QR,
+   SCENE_CLOCK,
+};
+
+static inline const char *
+scene_str (scene_t * s, scene_op_t * o)
+{
+   return (const char *) &s->op[s->count] + o->str;
+}
+
+void
+scene_free (file_t * i)
+{
+   mem_free (MEM_CACHE, i->scene);
+   i->scene = NULL;
+}
+
+void
+scene_compile (file_t * i)
+{                               // Parse JSON array of items to display list, called with display mutex held
+   scene_free (i);
+   if (!i->json || !i->data)
+      return;
+   scene_op_t ops[SCENEMAX];
+   int count = 0;
+   char *strs = NULL;
+   size_t len = 0;
+   FILE *o = open_memstream (&strs, &len);
+   if (!o)
+      return;
+   jo_t j = jo_parse_mem (i->data, i->size);
+   jo_type_t t = jo_here (j);
+   if (t == JO_ARRAY)
+      t = jo_next (j);
+   while (t == JO_OBJECT && count < SCENEMAX)
+   {
+      scene_op_t *op = &ops[count];
+      memset (op, 0, sizeof (*op));
+      op->op = 0xFF;
+      op->x = gfx_width () / 2;
+      op->y = gfx_height () / 2;
+      op->align = GFX_C | GFX_M;
+      op->size = 0;
+      t = jo_next (j);
+      while (t == JO_TAG)
+      {
+         char tag[10] = "";
+         jo_strncpy (j, tag, sizeof (tag));
+         t = jo_next (j);
+         char val[10] = "";
+         if (t == JO_STRING && jo_strlen (j) < sizeof (val))
+            jo_strncpy (j, val, sizeof (val));
+         uint16_t hhmm (void)
+         {
+            int h = 0,
+               m = 0;
+            sscanf (val, "%d:%d", &h, &m);
+            return (h * 60 + m) % (24 * 60);
+         }
+         if (t == JO_STRING && (!strcmp (tag, "image") || !strcmp (tag, "text") || !strcmp (tag, "qr")))
+         {
+            op->op = (*tag == 'i' ? SCENE_IMAGE : *tag == 't' ? SCENE_TEXT : SCENE_QR);
+            op->str = ftell (o);
+            char *v = jo_strdup (j);
+            if (v)
+               fprintf (o, "%s", v);
+            fputc (0, o);
+            free (v);
+         } else if (!strcmp (tag, "clock"))
+         {
+            op->op = SCENE_CLOCK;
+            if (t == JO_NUMBER)
+               op->size = jo_read_int (j);
+         } else if (t == JO_NUMBER && !strcmp (tag, "x"))
+            op->x = jo_read_int (j);
+         else if (t == JO_NUMBER && !strcmp (tag, "y"))
+            op->y = jo_read_int (j);
+         else if (t == JO_NUMBER && !strcmp (tag, "size"))
+            op->size = jo_read_int (j);
+         else if (t == JO_STRING && !strcmp (tag, "align"))
+         {
+            op->align = 0;
+            for (char *a = val; *a; a++)
+               op->align |= (*a == 'L' ? GFX_L : *a == 'R' ? GFX_R : *a == 'C' ? GFX_C : *a == 'T' ? GFX_T : *a == 'B' ? GFX_B : *a ==
+                             'M' ? GFX_M : 0);
+         } else if (t == JO_STRING && !strcmp (tag, "season"))
+            op->season = *val;
+         else if (t == JO_STRING && !strcmp (tag, "from"))
+            op->from = hhmm ();
+         else if (t == JO_STRING && !strcmp (tag, "to"))
+            op->to = hhmm ();
+         else if ((t == JO_TRUE || t == JO_FALSE) && !strcmp (tag, "pushed"))
+            op->pushed = (t == JO_TRUE ? 2 : 1);
+         else if ((t == JO_TRUE || t == JO_FALSE) && (!strcmp (tag, "away") || !strcmp (tag, "busy")))
+            *(t == JO_TRUE ? &op->presence : &op->absence) |= (*tag == 'a' ? PRESENCE_AWAY : PRESENCE_BUSY);
+         t = jo_skip (j);
+      }
+      if (op->op != 0xFF)
+         count++;
+      t = jo_next (j);
+   }
+   const char *e = jo_error (j, NULL);
+   jo_free (&j);
+   fclose (o);
+   if (e)
+   {
+      ESP_LOGE (TAG, "Scene %s %s", i->url, e);
+      i->scenebad = 1;
+      i->scenecrc = i->crc;
+   } else if ((i->scene = mem_alloc (MEM_CACHE, sizeof (scene_t) + count * sizeof (scene_op_t) + len)))
+   {
+      i->scene->count = count;
+      memcpy (i->scene->op, ops, count * sizeof (scene_op_t));
+      memcpy (&i->scene->op[count], strs, len);
+      i->scenebad = 0;
+   }
+   free (strs);
+}
+
+void
+scene_draw (file_t * i, uint8_t mode)
+{                               // Execute display list, called with display locked, mode is as imageplot
+   scene_t *s = i->scene;
+   if (!s)
+      return;
+   time_t now = time (0);
+   struct tm t;
+   localtime_r (&now, &t);
+   uint16_t minute = t.tm_hour * 60 + t.tm_min;
+   for (int n = 0; n < s->count; n++)
+   {
+      scene_op_t *o = &s->op[n];
+      if ((o->pushed == 1 && pushed) || (o->pushed == 2 && !pushed) || (o->season && o->season != season)
+          || (presence & o->presence) != o->presence || (presence & o->absence))
+         continue;
+      if (o->from != o->to
+          && (o->from < o->to ? minute < o->from || minute >= o->to : minute < o->from && minute >= o->to))
+         continue;
+      gfx_pos (o->x, o->y, o->align | GFX_V);
+      switch (o->op)
+      {
+      case SCENE_IMAGE:
+         if (o->file && o->file->data && !o->file->json)
+         {
+            gfx_pos_t x,
+              y;
+            gfx_draw (o->file->w, o->file->h, 0, 0, &x, &y);    // Top left as per align
+            plot (o->file, x, y, dithermode (scene_str (s, o)), mode);
+         }
+         break;
+      case SCENE_TEXT:
+         gfx_message (scene_str (s, o));
+         break;
+      case SCENE_QR:
+         gfx_qr (scene_str (s, o), o->size ? : 4);
+         break;
+      case SCENE_CLOCK:
+         gfx_7seg (0, o->size ? : 2, "%02d:%02d", t.tm_hour, t.tm_min);
+         break;
+      }
+   }
+}
+
+void
+image_load (const char *name, file_t * i, char c, uint16_t x, uint16_t y, uint8_t mode)
+{                               // Load image and set LEDs (image can be prefixed with dither and colour, else default is used), mode is as imageplot
+   int n = 0;
+   uint8_t dither = dithermode (name);
+   if (name)
+   {
       if (*name == '!')
          name++;                // Skip, refresh actually done in calling side
+      if (dither)
+         name++;
       const char *colours = name;
       while (*colours && isalpha ((int) (unsigned char) *colours))
          colours++;
@@ -384,46 +2590,313 @@ image_load (const char *name, file_t * i, char c, uint16_t x, uint16_t y)
    } else if (c)
       led_colour[n++] = c;      // Single from arg
    if (n)
+   {
       while (n < sizeof (led_colour))
          led_colour[n++] = 0;
-   if (i && i->data)
+      if (led_task_id)
+         xTaskNotifyGive (led_task_id);
+   }
+   uint8_t was = stage (STAGE_RENDER);
+   if (i && i->json)
+      scene_draw (i, mode);
+   else if (i && i->data)
+      plot (i, x - i->w / 2, y - i->h / 2, dither, mode);
+   stage (was);
+}
+
+static file_t *
+getfile (const char *name, char season)
+{                               // Get (cached) file, for season
+   name = skipcolour (name);
+   if (!name || !*name)
+      return NULL;
+   char *url = NULL;
+   mem_asprintf (MEM_CACHE, &url, "%s/%s.png", imageurl, name);
+   char *s = strchr (url, '*');
+   if (s)
+   {
+      if (season)
+         *s = season;
+      else
+         memmove (s, s + 1, strlen (s));
+   }
+   file_t *i = find_file (url);
+   if (!i || !i->size)
+   {
+      stats.cache_miss++;
+      i = download (url);
+   } else
+      stats.cache_hit++;
+   mem_free (MEM_CACHE, url);
+   if (!i || !i->size)
+      return NULL;
+   return i;
+}
+
+file_t *
+getimage (const char *name)
+{                               // Get (cached) image, or scene with its images
+   file_t *i = getfile (name, season);
+   if (!i || !i->json)
+      return i;
+   if (!i->scene && !(i->scenebad && i->scenecrc == i->crc))
+   {
+      epd_take ();
+      scene_compile (i);
+      xSemaphoreGive (epd_mutex);
+   }
+   for (int n = 0;; n++)
+   {                            // Fetch without holding mutex, scene may be replaced by upload meanwhile
+      char *name = NULL;
+      epd_take ();
+      scene_t *s = i->scene;
+      int done = (!s || n >= s->count);
+      if (!done && s->op[n].op == SCENE_IMAGE)
+         name = mem_strdup (MEM_CACHE, scene_str (s, &s->op[n]));
+      xSemaphoreGive (epd_mutex);
+      if (done)
+         break;
+      if (!name)
+         continue;
+      file_t *f = getfile (name, season);
+      mem_free (MEM_CACHE, name);
+      epd_take ();
+      if (i->scene == s)
+         s->op[n].file = f;
+      xSemaphoreGive (epd_mutex);
+   }
+   return i;
+}
+
+struct
+{                               // Idle image schedule, sorted transitions through the week
+   uint16_t minute;             // Minute of week from Sunday 00:00
+   const char *image;           // Idle image from here, NULL for imageidle
+} schedule[SCHEDULEMAX];
+
+static int schedules = 0;
+static const char *schedule_image = NULL;       // Current scheduled idle image
+static time_t schedule_next = 0;        // Next transition
+static time_t schedule_prefetch = 0;    // When to fetch image for next transition
+
+void
+schedule_compile (void)
+{                               // Compile idle image schedule, from settings (which need reboot to change)
+   static const char days[] = "SunMonTueWedThuFriSat";
+   struct
+   {
+      uint8_t days;             // Bit per day, Sunday bit 0
+      uint16_t from,
+        to;                     // Minute of day, from==to for all day
+      const char *image;
+   } rule[SCHEDULES];
+   int rules = 0;
+   const char *name (const char *n)
+   {                            // Own copy of image name, shared by rules for the same image, kept as schedule is only compiled once
+      for (int r = 0; r < rules; r++)
+         if (!strcmp (rule[r].image, n))
+            return rule[r].image;
+      return mem_strdup (MEM_OTHER, n);
+   }
+   for (int r = 0; r < SCHEDULES; r++)
+   {                            // [days ]HH:MM-HH:MM=image, days like Mon-Fri or Sat,Sun
+      const char *p = imageschedule[r];
+      const char *eq = p ? strchr (p, '=') : NULL;
+      if (!eq)
+         continue;
+      uint8_t mask = 0;
+      int day (void)
+      {                         // Parse day name
+         for (int d = 0; d < 7; d++)
+            if (!strncasecmp (p, days + d * 3, 3))
+            {
+               p += 3;
+               return d;
+            }
+         return -1;
+      }
+      while (isalpha ((int) (unsigned char) *p))
+      {
+         int a = day (),
+            b = a;
+         if (a < 0)
+            break;
+         if (*p == '-')
+         {
+            p++;
+            if ((b = day ()) < 0)
+               break;
+         }
+         for (int d = a;; d = (d + 1) % 7)
+         {
+            mask |= (1 << d);
+            if (d == b)
+               break;
+         }
+         if (*p == ',')
+            p++;
+      }
+      while (*p == ' ')
+         p++;
+      int fh,
+        fm,
+        th,
+        tm,
+        n = 0;
+      if (p > eq || sscanf (p, "%d:%d-%d:%d%n", &fh, &fm, &th, &tm, &n) != 4 || p + n != eq || fh > 23 || th > 24 || (th == 24 && tm) || fm > 59
+          || tm > 59)
+      {
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "error", "Bad schedule");
+         jo_string (j, "schedule", imageschedule[r]);
+         revk_error ("schedule", &j);
+         continue;
+      }
+      rule[rules].days = (mask ? : 0x7F);
+      rule[rules].from = fh * 60 + fm;
+      rule[rules].to = (th * 60 + tm) % (24 * 60);
+      if (!(rule[rules].image = name (eq + 1)))
+         continue;
+      rules++;
+   }
+   const char *image (uint16_t m)
+   {                            // First matching rule at minute of week
+      uint8_t d = m / (24 * 60),
+         p = (d + 6) % 7;
+      uint16_t t = m % (24 * 60);
+      for (int r = 0; r < rules; r++)
+      {
+         uint8_t today = (rule[r].days >> d) & 1,
+            yesterday = (rule[r].days >> p) & 1;
+         if (rule[r].from == rule[r].to)
+         {                      // All day
+            if (today)
+               return rule[r].image;
+         } else if (rule[r].from < rule[r].to)
+         {                      // Within day
+            if (today && t >= rule[r].from && t < rule[r].to)
+               return rule[r].image;
+         } else if ((today && t >= rule[r].from) || (yesterday && t < rule[r].to))
+            return rule[r].image;       // Over midnight
+      }
+      return NULL;
+   }
+   // Candidate transitions are rule starts and ends on each day, in order through the week
+   schedules = 0;
+   if (!rules)
+      return;
+   for (uint16_t m = 0; m < 7 * 24 * 60 && schedules < SCHEDULEMAX; m++)
    {
-      gfx_foreground (imageplot == REVK_SETTINGS_IMAGEPLOT_NORMAL || imageplot == REVK_SETTINGS_IMAGEPLOT_MASK ? 0 : 0xFFFFFF);
-      gfx_background (imageplot == REVK_SETTINGS_IMAGEPLOT_NORMAL
-                      || imageplot == REVK_SETTINGS_IMAGEPLOT_MASKINVERT ? 0xFFFFFF : 0);
-      plot (i, x - i->w / 2, y - i->h / 2);
-      gfx_foreground (0);
-      gfx_background (0xFFFFFF);
+      uint16_t t = m % (24 * 60);
+      int r;
+      for (r = 0; r < rules && t != rule[r].from && t != rule[r].to; r++);
+      if (r == rules && m)
+         continue;
+      const char *i = image (m);
+      if (schedules && schedule[schedules - 1].image == i)
+         continue;
+      schedule[schedules].minute = m;
+      schedule[schedules].image = i;
+      schedules++;
    }
 }
 
-file_t *
-getimage (const char *name)
-{
-   name = skipcolour (name);
-   if (!name || !*name)
-      return NULL;
-   char *url = NULL;
-   asprintf (&url, "%s/%s.png", imageurl, name);
-   char *s = strchr (url, '*');
-   if (s)
+int
+schedule_find (uint16_t m)
+{                               // Binary search for slot containing minute of week
+   int l = 0,
+      h = schedules - 1;
+   while (l < h)
    {
-      if (season)
-         *s = season;
+      int mid = (l + h + 1) / 2;
+      if (schedule[mid].minute <= m)
+         l = mid;
       else
-         strcpy (s, s + 1);
+         h = mid - 1;
+   }
+   return l;
+}
+
+int
+schedule_update (time_t now)
+{                               // Update scheduled image and next transition, returns 1 if image changed
+   if (!schedules)
+   {
+      schedule_next = now + 86400;
+      return 0;
+   }
+   struct tm t;
+   localtime_r (&now, &t);
+   uint16_t m = (t.tm_wday * 24 + t.tm_hour) * 60 + t.tm_min;
+   int s = schedule_find (m);
+   int n = (s + 1) % schedules;
+   uint32_t wait = ((schedule[n].minute + 7 * 24 * 60 - m - 1) % (7 * 24 * 60) + 1) * 60 - t.tm_sec;
+   schedule_next = now + wait;
+   schedule_prefetch = schedule_next - (wait > SCHEDULEPREFETCH ? SCHEDULEPREFETCH : wait / 2);
+   if (schedule_image == schedule[s].image)
+      return 0;
+   schedule_image = schedule[s].image;
+   ESP_LOGE (TAG, "Scheduled idle %s", schedule_image ? : imageidle);
+   return 1;
+}
+
+const char *
+idle_name (void)
+{                               // Current idle image
+   return schedule_image ? : imageidle;
+}
+
+const char *
+schedule_upcoming (void)
+{                               // Idle image for next transition
+   if (!schedules)
+      return imageidle;
+   time_t now = schedule_next;
+   struct tm t;
+   localtime_r (&now, &t);
+   int s = schedule_find ((t.tm_wday * 24 + t.tm_hour) * 60 + t.tm_min);
+   return schedule[s].image ? : imageidle;
+}
+
+void
+prefetch_season (time_t now)
+{                               // Fetch and decode idle images for seasons coming up, so a season change needs no fetch
+   if (*imageseason || !imagelookahead || now < 1000000000)
+      return;                   // Overridden, disabled, or no clock yet
+   char done[10] = { season };  // Seasons done, counted as season can be 0
+   int n = 1;
+   for (uint32_t ahead = 3600; ahead <= imagelookahead && n < sizeof (done); ahead += 3600)
+   {
+      char next = *revk_season (now + ahead);
+      if (memchr (done, next, n))
+         continue;
+      done[n++] = next;
+      void get (const char *name)
+      {
+         if (!strchr (name, '*'))
+            return;
+         file_t *i = getfile (name, next);
+         if (!i || i->json)
+            return;
+         epd_take ();
+         rle_build (i, dithermode (name));
+         xSemaphoreGive (epd_mutex);
+         ESP_LOGE (TAG, "Prefetched %s for season %c", i->url, next ? : '-');
+      }
+      get (idle_name ());
+      get (imageidleo);
    }
-   file_t *i = find_file (url);
-   if (!i || !i->size)
-      i = download (url);
-   free (url);
-   if (!i || !i->size)
-      return NULL;
-   return i;
 }
 
 void
-setactive (char *value)
+events_notify (void)
+{                               // State or frame changed, wake events task
+   if (events_task_id)
+      xTaskNotifyGive (events_task_id);
+}
+
+void
+setactive (const char *value)
 {
    if (!value || !strcmp (activename, value))
       return;
@@ -433,15 +2906,7 @@ setactive (char *value)
       last = -1;                // Redisplay
    if (pushed)
       pushed = uptime () + holdtime;
-}
-
-static void
-web_head (httpd_req_t * req, const char *title)
-{
-   revk_web_head (req, title);
-   revk_web_send (req, "<style>"        //
-                  "body{font-family:sans-serif;background:#8cf;}"       //
-                  "</style><body><h1>%s</h1>", title ? : "");
+   events_notify ();
 }
 
 static esp_err_t
@@ -464,37 +2929,71 @@ web_text (httpd_req_t * req, const char *msg)
    return ESP_OK;
 }
 
+void
+add_state (jo_t j)
+{                               // Current state, as used for events
+   uint32_t up = uptime ();
+   jo_bool (j, "pushed", pushed && pushed >= up);
+   jo_bool (j, "override", override && override >= up);
+   jo_string (j, "active", activename);
+   if (*tasbusy)
+      jo_bool (j, "busy", presence & PRESENCE_BUSY);
+   if (*tasaway)
+      jo_bool (j, "away", presence & PRESENCE_AWAY);
+   if (presence >> 2)
+      jo_int (j, "presence", presence);
+}
+
+void
+epd_refresh (void)
+{                               // Full refresh on next update
+   b.refreshfull = 1;
+   gfx_refresh ();
+}
+
 void
 epd_lock (void)
 {
-   xSemaphoreTake (epd_mutex, portMAX_DELAY);
+   epd_take ();
    gfx_lock ();
 }
 
 void
 epd_unlock (void)
 {
+   fb_sync ();
+   frame_update ();
+   uint8_t was = stage (STAGE_REFRESH);
    gfx_unlock ();
+   stage (was);
+   if (b.refreshfull)
+      stats.refresh_full++;
+   else
+      stats.refresh_partial++;
+   b.refreshfull = 0;
+   frames++;
    xSemaphoreGive (epd_mutex);
+   b.eventsframe = 1;
+   events_notify ();
 }
 
 #ifdef	CONFIG_LWPNG_ENCODE
 static esp_err_t
 web_frame (httpd_req_t * req)
 {
-   xSemaphoreTake (epd_mutex, portMAX_DELAY);
+   epd_take ();
    uint8_t *png = NULL;
    size_t len = 0;
    uint32_t w = gfx_raw_w ();
    uint32_t h = gfx_raw_h ();
-   uint8_t *b = gfx_raw_b ();
+   uint8_t *raw = gfx_raw_b ();
    ESP_LOGD (TAG, "Encode W=%lu H=%lu", w, h);
-   lwpng_encode_t *p = lwpng_encode_1bit (w, h, &my_alloc, &my_free, NULL);
-   if (b)
+   lwpng_encode_t *p = lwpng_encode_1bit (w, h, &my_alloc, &my_free, &encode_arena);
+   if (raw)
       while (h--)
       {
-         lwpng_encode_scanline (p, b);
-         b += (w + 7) / 8;
+         lwpng_encode_scanline (p, raw);
+         raw += (w + 7) / 8;
       }
    const char *e = lwpng_encoded (&p, &len, &png);
    ESP_LOGD (TAG, "Encoded %u bytes %s", len, e ? : "");
@@ -508,80 +3007,870 @@ web_frame (httpd_req_t * req)
       httpd_resp_set_type (req, "image/png");
       httpd_resp_send (req, (char *) png, len);
    }
-   free (png);
+   my_free (&encode_arena, png);
+   arena_reset (&encode_arena);
    xSemaphoreGive (epd_mutex);
    return ESP_OK;
 }
 #endif
 
 static esp_err_t
-web_root (httpd_req_t * req)
-{
-   if (revk_link_down ())
-      return revk_web_settings (req);   // Direct to web set up
-   web_head (req, *hostname ? hostname : revk_app);
-   revk_web_send (req, "<p><a href=/push>Ding!</a></p>");
+web_ack (httpd_req_t * req, int visible)
+{                               // JSON reply with resulting state
+   jo_t j = jo_object_alloc ();
+   add_state (j);
+   if (*overridename)
+      jo_string (j, "image", overridename);
+   if (*overridemsg)
+      jo_string (j, "message", (char *) overridemsg);
+   if (visible >= 0)
+      jo_bool (j, "visible", visible);
+   char *ack = jo_finisha (&j);
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_sendstr (req, ack ? : "{}");
+   free (ack);
+   return ESP_OK;
+}
+
+uint32_t
+push_target (void)
+{                               // Pushed screen frame to wait for, the one showing (or being drawn) if not since replaced
+   uint32_t f = frames;
+   uint32_t p = pushframe;
+   if ((int32_t) (p - f) >= 0)
+      return p;
+   return f + 1;
+}
+
+int
+push_visible (uint32_t target)
+{                               // Has a pushed screen frame at or after target been shown
+   uint32_t p = pushframe;
+   return (int32_t) (p - target) >= 0 && (int32_t) (frames - p) >= 0;
+}
+
+int
+push_wait_check (void)
+{                               // Reply to waiting requests when frame shown, return number still waiting
+   int n = 0;
+   uint32_t up = uptime ();
+   xSemaphoreTake (events_mutex, portMAX_DELAY);
+   for (int c = 0; c < WAITCLIENTS; c++)
+      if (push_wait[c].req)
+      {
+         int visible = push_visible (push_wait[c].frame);
+         if (visible || push_wait[c].timeout < up)
+         {
+            web_ack (push_wait[c].req, visible);
+            httpd_req_async_handler_complete (push_wait[c].req);
+            push_wait[c].req = NULL;
+         } else
+            n++;
+      }
+   xSemaphoreGive (events_mutex);
+   return n;
+}
+
+static esp_err_t
+web_events (httpd_req_t * req)
+{                               // Server-Sent Events, handed off to events_task so as not to hold an httpd worker
+   xSemaphoreTake (events_mutex, portMAX_DELAY);
+   int c;
+   for (c = 0; c < EVENTCLIENTS && events_req[c]; c++);
+   xSemaphoreGive (events_mutex);
+   if (c == EVENTCLIENTS)
+   {
+      httpd_resp_set_status (req, "503 Too many event streams");
+      return web_text (req, "Too many event streams");
+   }
+   httpd_resp_set_type (req, "text/event-stream");
+   httpd_resp_set_hdr (req, "Cache-Control", "no-cache");
+   if (httpd_resp_send_chunk (req, "retry: 5000\n\n", HTTPD_RESP_USE_STRLEN))
+      return ESP_FAIL;
+   httpd_req_t *async = NULL;
+   if (httpd_req_async_handler_begin (req, &async))
+      return ESP_FAIL;
+   xSemaphoreTake (events_mutex, portMAX_DELAY);
+   for (c = 0; c < EVENTCLIENTS && events_req[c]; c++);
+   if (c < EVENTCLIENTS)
+      events_req[c] = async;
+   xSemaphoreGive (events_mutex);
+   if (c == EVENTCLIENTS)
+   {
+      httpd_req_async_handler_complete (async);
+      return ESP_FAIL;
+   }
+   b.eventsnew = 1;
+   events_notify ();
+   return ESP_OK;
+}
+
+void
+events_task (void *arg)
+{                               // Send state and frame changes to /events clients
+   uint8_t *prev = NULL;        // Frame as last sent
+   uint8_t *delta = mem_alloc (MEM_HTTPD, EVENTDELTA);
+   char *laststate = NULL;
+   uint32_t seq = 0;
+   int waiting = 0;
+   int64_t start = 0;
+   while (1)
+   {
+      loop_time (LOOP_EVENTS, &start);
+      ulTaskNotifyTake (pdTRUE, (waiting ? 1000 : 30000) / portTICK_PERIOD_MS);
+      start = esp_timer_get_time ();
+      waiting = push_wait_check ();
+      int n = 0;
+      xSemaphoreTake (events_mutex, portMAX_DELAY);
+      for (int c = 0; c < EVENTCLIENTS; c++)
+         if (events_req[c])
+            n++;
+      xSemaphoreGive (events_mutex);
+      if (!n || b.eventsnew)
+      {                         // Start again, new clients get everything, and have loaded frame.png themselves
+         b.eventsnew = 0;
+         mem_free (MEM_HTTPD, prev);
+         prev = NULL;
+         free (laststate);
+         laststate = NULL;
+      }
+      if (!n)
+      {
+         b.eventsframe = 0;
+         continue;
+      }
+      char *msg = NULL;
+      size_t len = 0;
+      FILE *o = open_memstream (&msg, &len);
+      if (!o)
+         continue;
+      {                         // State
+         jo_t j = jo_object_alloc ();
+         add_state (j);
+         char *state = jo_finisha (&j);
+         if (state && (!laststate || strcmp (state, laststate)))
+         {
+            fprintf (o, "event: state\ndata: %s\n\n", state);
+            free (laststate);
+            laststate = state;
+            state = NULL;
+         }
+         free (state);
+      }
+#ifdef	CONFIG_LWPNG_ENCODE
+      if (b.eventsframe && gfx_bpp () == 1)
+      {                         // Frame, with dirty rectangle in raw 1 bit format if small enough
+         b.eventsframe = 0;
+         jo_t j = jo_object_alloc ();
+         jo_int (j, "seq", ++seq);
+         int changed = 1;
+         epd_take ();
+         uint32_t w = (gfx_raw_w () + 7) / 8;
+         uint32_t h = gfx_raw_h ();
+         uint8_t *raw = gfx_raw_b ();
+         if (raw && prev)
+         {
+            uint32_t x1 = w,
+               x2 = 0,
+               y1 = h,
+               y2 = 0;
+            for (uint32_t y = 0; y < h; y++)
+            {
+               const uint8_t *a = raw + y * w,
+                  *p = prev + y * w;
+               if (!memcmp (a, p, w))
+                  continue;
+               if (y < y1)
+                  y1 = y;
+               y2 = y;
+               uint32_t x = 0;
+               while (a[x] == p[x])
+                  x++;
+               if (x < x1)
+                  x1 = x;
+               x = w - 1;
+               while (a[x] == p[x])
+                  x--;
+               if (x > x2)
+                  x2 = x;
+            }
+            if (y1 > y2)
+               changed = 0;
+            else if (delta && (x2 - x1 + 1) * (y2 - y1 + 1) <= EVENTDELTA)
+            {
+               uint8_t *d = delta;
+               for (uint32_t y = y1; y <= y2; y++)
+               {
+                  memcpy (d, raw + y * w + x1, x2 - x1 + 1);
+                  d += x2 - x1 + 1;
+               }
+               jo_int (j, "x", x1 * 8);
+               jo_int (j, "y", y1);
+               jo_int (j, "w", x2 - x1 + 1);
+               jo_int (j, "h", y2 - y1 + 1);
+               jo_base64 (j, "data", delta, d - delta);
+            }
+         }
+         if (raw && changed)
+         {
+            if (!prev)
+               prev = mem_alloc (MEM_HTTPD, w * h);
+            if (prev)
+               memcpy (prev, raw, w * h);
+         }
+         xSemaphoreGive (epd_mutex);
+         char *frame = jo_finisha (&j);
+         if (frame && changed)
+            fprintf (o, "event: frame\ndata: %s\n\n", frame);
+         free (frame);
+      }
+#endif
+      if (!ftell (o))
+         fprintf (o, ":\n\n");        // Keep alive
+      fclose (o);
+      xSemaphoreTake (events_mutex, portMAX_DELAY);
+      for (int c = 0; c < EVENTCLIENTS; c++)
+         if (events_req[c] && httpd_resp_send_chunk (events_req[c], msg, len))
+         {                      // Gone
+            httpd_req_async_handler_complete (events_req[c]);
+            events_req[c] = NULL;
+         }
+      xSemaphoreGive (events_mutex);
+      free (msg);
+   }
+}
+
+static char *page = NULL;       // Cached static part of status page, \1 and a digit marks a dynamic field
+static size_t page_len = 0;
+
+static void
+web_page_build (void)
+{                               // Build the static part of the status page, rebuilt on setting change
+   b.pagestale = 0;
+   mem_free (MEM_HTTPD, page);
+   page = NULL;
+   page_len = 0;
+   FILE *o = open_memstream (&page, &page_len);
+   if (!o)
+      return;
+   fprintf (o, "<style>"        //
+            "body{font-family:sans-serif;background:#8cf;}"     //
+            "</style><body><h1>%s</h1>", *hostname ? hostname : revk_app);
+   fprintf (o, "<p><a href=push onclick=\"fetch('push');return false;\">Ding!</a></p>");
    if (card)
-      revk_web_send (req, "<p>SD card mounted</p>");
+      fprintf (o, "<p>SD card mounted</p>");
 #ifdef	CONFIG_LWPNG_ENCODE
-   revk_web_send (req, "<p>");
+   fprintf (o, "<p>");
    int32_t w = gfx_width ();
    int32_t h = gfx_height ();
 #define DIV	2
-   revk_web_send (req, "<div style='display:inline-block;width:%dpx;height:%dpx;margin:5px;border:10px solid %s;border-%s:20px solid %s;'><img width=%d height=%d src='frame.png' style='transform:",   //
-                  w / DIV, h / DIV,     //
-                  gfxinvert ? "black" : "white",        //
-                  gfxflip & 4 ? gfxflip & 2 ? "left" : "right" : gfxflip & 2 ? "top" : "bottom",        //
-                  gfxinvert ? "black" : "white",        //
-                  gfx_raw_w () / DIV, gfx_raw_h () / DIV        //
+   fprintf (o, "<div style='display:inline-block;width:%ldpx;height:%ldpx;margin:5px;border:10px solid %s;border-%s:20px solid %s;'><canvas id=frame width=%lu height=%lu style='width:%lupx;height:%lupx;transform:",     //
+            w / DIV, h / DIV,   //
+            gfxinvert ? "black" : "white",      //
+            gfxflip & 4 ? gfxflip & 2 ? "left" : "right" : gfxflip & 2 ? "top" : "bottom",      //
+            gfxinvert ? "black" : "white",      //
+            gfx_raw_w (), gfx_raw_h (), //
+            gfx_raw_w () / DIV, gfx_raw_h () / DIV      //
       );
    if (gfxflip & 4)
-      revk_web_send (req, "translate(%dpx,%dpx)rotate(90deg)scale(1,-1)",       //
-                     (w - h) / 2 / DIV, (h - w) / 2 / DIV);
-   revk_web_send (req, "scale(%d,%d);'></div>", gfxflip & 1 ? -1 : 1, gfxflip & 2 ? -1 : 1      //
+      fprintf (o, "translate(%ldpx,%ldpx)rotate(90deg)scale(1,-1)",     //
+               (w - h) / 2 / DIV, (h - w) / 2 / DIV);
+   fprintf (o, "scale(%d,%d);'></canvas></div>", gfxflip & 1 ? -1 : 1, gfxflip & 2 ? -1 : 1  //
       );
 #undef	DIV
+   fprintf (o, "</p><p id=state></p><script>"   //
+            "var f=document.getElementById('frame').getContext('2d');"  //
+            "function load(){var i=new Image();i.onload=function(){f.drawImage(i,0,0);};i.src='frame.png?'+Date.now();}"        //
+            "load();"           //
+            "var e=new EventSource('events');"  //
+            "e.addEventListener('frame',function(m){"   //
+            "var d=JSON.parse(m.data);if(!d.data){load();return;}"      //
+            "var b=atob(d.data),p=f.getImageData(d.x,d.y,d.w*8,d.h),n=0;"       //
+            "for(var y=0;y<d.h;y++)for(var x=0;x<d.w;x++){var v=b.charCodeAt(n++);"     //
+            "for(var q=0;q<8;q++){var o=(y*d.w*8+x*8+q)*4,l=(v&(128>>q))?255:0;p.data[o]=p.data[o+1]=p.data[o+2]=l;p.data[o+3]=255;}}"   //
+            "f.putImageData(p,d.x,d.y);});"     //
+            "e.addEventListener('state',function(m){var s=JSON.parse(m.data);"  //
+            "document.getElementById('state').textContent=(s.pushed?'Pushed':'Idle')+(s.override?' (override)':'')+' '+s.active+(s.busy?' busy':'')+(s.away?' away':'');});"        //
+            "</script>");
 #endif
    if (*imageurl)
    {
-      void i (const char *tag, const char *name)
+      void i (const char *tag, const char *name, char field)
       {
          if (!*name)
             return;
          const char *filename = skipcolour (name);
+         const char *colour = name + (*name == '!') + (dithermode (name) != DITHER_NONE);
          uint32_t rgb = 0x808080;
-         if (filename != name)
-            rgb = (revk_rgb (*name) & 0xFFFFFF);
-         revk_web_send (req,
-                        "<figure style='display:inline-block;background:black;border:10px solid black;border-left:20px solid black;margin:5px;'><img width=240 height=400 style='%s' src='%s/%s.png'><figcaption style='margin:3px;padding:3px;background:#%06lX'>%s%s</figcaption></figure>",
-                        gfxinvert ^ (imageplot & 1) ? "" : "filter:invert(1)", imageurl, filename, rgb, tag, !strcmp (name,
-                                                                                                                      imageidle)
-                        || !strcmp (name, activename) ? " (current)" : "");
-      }
-      revk_web_send (req, "<p>");
-      i ("Wait", imagewait);
+         if (filename != colour)
+            rgb = (revk_rgb (*colour) & 0xFFFFFF);
+         fprintf (o,
+                  "<figure style='display:inline-block;background:black;border:10px solid black;border-left:20px solid black;margin:5px;'><img width=240 height=400 style='%s' src='%s/%s.png'><figcaption style='margin:3px;padding:3px;background:#%06lX'>%s\1%c</figcaption></figure>",
+                  gfxinvert ^ (imageplot & 1) ? "" : "filter:invert(1)", imageurl, filename, rgb, tag, field);
+      }
+      fprintf (o, "<p>");
+      i ("Wait", imagewait, '0');
       if (*tasbusy)
-         i ("Busy", imagebusy);
+         i ("Busy", imagebusy, '1');
       if (*tasaway)
-         i ("Away", imageaway);
-      revk_web_send (req, "</p>");
+         i ("Away", imageaway, '2');
+      fprintf (o, "</p>");
+   }
+   fclose (o);
+   mem_adopt (MEM_HTTPD, page);
+}
+
+static esp_err_t
+web_root (httpd_req_t * req)
+{                               // Status page, cached static part with dynamic fields patched in, sent as one chunk
+   if (revk_link_down ())
+      return revk_web_settings (req);   // Direct to web set up
+   static char *out = NULL;     // Handlers run on the single httpd task
+   static size_t out_max = 0;
+   if (!page || b.pagestale)
+      web_page_build ();
+   if (!page)
+      return ESP_FAIL;
+   const char current[] = " (current)";
+   size_t need = page_len + 3 * sizeof (current);
+   if (need > out_max)
+   {
+      mem_free (MEM_HTTPD, out);
+      out_max = 0;
+      if (!(out = mem_alloc (MEM_HTTPD, need)))
+         return ESP_FAIL;
+      out_max = need;
+   }
+   char *q = out;
+   for (const char *p = page; p < page + page_len; p++)
+      if (*p == 1 && p + 1 < page + page_len)
+      {                         // Dynamic field
+         p++;
+         const char *name = (*p == '0' ? imagewait : *p == '1' ? imagebusy : imageaway);
+         if ((!strcmp (name, imageidle) || !strcmp (name, activename)) && q + sizeof (current) <= out + out_max)
+         {
+            memcpy (q, current, sizeof (current) - 1);
+            q += sizeof (current) - 1;
+         }
+      } else
+         *q++ = *p;
+   revk_web_head (req, *hostname ? hostname : revk_app);
+   httpd_resp_send_chunk (req, out, q - out);
+   return revk_web_foot (req, 0, 1, NULL);
+}
+
+static esp_err_t
+web_stall (httpd_req_t * req)
+{                               // Stall report and task loop histograms
+   jo_t j = jo_object_alloc ();
+   stall_json (j);
+   char *out = jo_finisha (&j);
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_sendstr (req, out ? : "{}");
+   free (out);
+   return ESP_OK;
+}
+
+static esp_err_t
+web_push (httpd_req_t * req)
+{
+   size_t l = httpd_req_get_url_query_len (req);
+   char query[200];
+   int wait = 0;
+   if (l > 0 && l < sizeof (query) && !httpd_req_get_url_query_str (req, query, sizeof (query)))
+   {
+      char val[20];
+      if (!httpd_query_key_value (query, "wait", val, sizeof (val)))
+         wait = !strcmp (val, "visible");
+      else if (!*overridename)
+      {
+         strncpy (overridename, query, sizeof (overridename));
+         return web_ack (req, -1);
+      }
+   }
+   uint32_t target = push_target ();
+   pushed = uptime () + holdtime;
+   stats.push_web++;
+   if (main_task_id)
+      xTaskNotifyGive (main_task_id);
+   if (!wait)
+      return web_ack (req, -1);
+   if (push_visible (target))
+      return web_ack (req, 1);  // Already showing the pushed screen, held for longer
+   // Reply once the next frame has been shown, without holding an httpd worker
+   httpd_req_t *async = NULL;
+   if (httpd_req_async_handler_begin (req, &async))
+      return web_ack (req, -1);
+   int c;
+   xSemaphoreTake (events_mutex, portMAX_DELAY);
+   for (c = 0; c < WAITCLIENTS && push_wait[c].req; c++);
+   if (c < WAITCLIENTS)
+   {
+      push_wait[c].req = async;
+      push_wait[c].frame = target;
+      push_wait[c].timeout = uptime () + WAITTIME;
+   }
+   xSemaphoreGive (events_mutex);
+   if (c == WAITCLIENTS)
+   {
+      web_ack (async, -1);
+      httpd_req_async_handler_complete (async);
+   } else
+      events_notify ();
+   return ESP_OK;
+}
+
+void
+mqtt_queue_send (const char *topic, const char *payload, uint32_t deadline)
+{                               // Queue outbound MQTT, sent and retried by mqtt_task, dropped if not sent by deadline (uptime, 0 for none)
+   size_t tl = topic ? strlen (topic) + 1 : 0,
+      pl = payload ? strlen (payload) + 1 : 0;
+   mqtt_msg_t *m = mem_alloc (MEM_MQTT, sizeof (*m) + tl + pl);
+   if (!m)
+   {
+      stats.mqtt_dropped++;
+      return;
+   }
+   memset (m, 0, sizeof (*m));
+   m->deadline = deadline;
+   char *p = (char *) (m + 1);
+   if (topic)
+   {
+      m->topic = p;
+      memcpy (p, topic, tl);
+      p += tl;
+   }
+   if (payload)
+   {
+      m->payload = p;
+      memcpy (p, payload, pl);
+   }
+   if (!mqtt_queue || xQueueSend (mqtt_queue, &m, 0) != pdTRUE)
+   {
+      ESP_LOGE (TAG, "MQTT queue full %s", topic ? : payload ? : "");
+      stats.mqtt_dropped++;
+      mem_free (MEM_MQTT, m);
+   }
+}
+
+void
+mqtt_task (void *arg)
+{                               // Send queued MQTT, in order, retrying with backoff, woken early on reconnect
+   mqtt_msg_t *m = NULL;
+   int64_t start = 0;
+   while (1)
+   {
+      if (!m)
+      {
+         loop_time (LOOP_MQTT, &start);
+         if (xQueueReceive (mqtt_queue, &m, portMAX_DELAY) != pdTRUE)
+            continue;
+      }
+      if (!start)
+         start = esp_timer_get_time ();
+      if (m->deadline && m->deadline < uptime ())
+      {                         // Too late, e.g. a chime long after the bell was pushed
+         ESP_LOGE (TAG, "MQTT expired %s", m->topic ? : m->payload);
+         stats.mqtt_dropped++;
+         mem_free (MEM_MQTT, m);
+         m = NULL;
+         continue;
+      }
+      const char *e = m->topic ? revk_mqtt_send_raw (m->topic, 0, m->payload, 1) : revk_mqtt_send_str (m->payload);
+      if (!e)
+      {
+         stats.mqtt_sent++;
+         mem_free (MEM_MQTT, m);
+         m = NULL;
+         continue;
+      }
+      if (++m->tries >= MQTTRETRIES)
+      {
+         ESP_LOGE (TAG, "MQTT dropped %s (%s)", m->topic ? : m->payload, e);
+         stats.mqtt_dropped++;
+         mem_free (MEM_MQTT, m);
+         m = NULL;
+         continue;
+      }
+      stats.mqtt_retry++;
+      uint32_t backoff = (1 << m->tries);
+      if (backoff > MQTTBACKOFF)
+         backoff = MQTTBACKOFF;
+      loop_time (LOOP_MQTT, &start);
+      ulTaskNotifyTake (pdTRUE, backoff * 1000 / portTICK_PERIOD_MS);
+   }
+}
+
+static esp_err_t
+web_metrics (httpd_req_t * req)
+{                               // Prometheus text format, built in a buffer allocated once (handlers run on the single httpd task)
+   static char *buf = NULL;
+   static size_t size = METRICSBUF;     // Grown if output was cut short
+   if (!buf && !(buf = mem_alloc (MEM_HTTPD, size)))
+      return ESP_FAIL;
+   char *p = buf,
+      *e = buf + size;
+   uint8_t over = 0;
+   void add (const char *fmt, ...)
+   {
+      va_list ap;
+      va_start (ap, fmt);
+      int l = vsnprintf (p, e - p, fmt, ap);
+      va_end (ap);
+      if (l >= e - p)
+         over = 1;
+      if (l > 0)
+         p += (l < e - p ? l : e - p - 1);
+   }
+   void head (const char *name, const char *type, const char *help)
+   {
+      add ("# HELP doorbell_%s %s\n# TYPE doorbell_%s %s\n", name, help, name, type);
+   }
+   void seconds (const char *name, const char *help, uint32_t count, uint64_t us)
+   {
+      head (name, "summary", help);
+      add ("doorbell_%s_sum %llu.%06llu\ndoorbell_%s_count %lu\n", name, us / 1000000ULL, us % 1000000ULL, name, count);
+   }
+   head ("metrics_truncated_total", "counter", "Metrics responses cut short, buffer is then grown");      // First, so not itself cut off
+   add ("doorbell_metrics_truncated_total %lu\n", stats.metrics_truncated);
+   head ("push_total", "counter", "Bell presses by source");
+   add ("doorbell_push_total{source=\"button\"} %lu\n", stats.push_button);
+   add ("doorbell_push_total{source=\"web\"} %lu\n", stats.push_web);
+   add ("doorbell_push_total{source=\"mqtt\"} %lu\n", stats.push_mqtt);
+   head ("cache_total", "counter", "Image cache lookups and evictions");
+   add ("doorbell_cache_total{result=\"hit\"} %lu\n", stats.cache_hit);
+   add ("doorbell_cache_total{result=\"miss\"} %lu\n", stats.cache_miss);
+   add ("doorbell_cache_total{result=\"evict\"} %lu\n", stats.cache_evict);
+   {
+      uint32_t count = 0,
+         bytes = 0;
+      for (file_t * i = files; i; i = i->next)
+         if (i->data)
+         {
+            count++;
+            bytes += i->size;
+         }
+      head ("cache_files", "gauge", "Image cache files held");
+      add ("doorbell_cache_files %lu\n", count);
+      head ("cache_bytes", "gauge", "Image cache bytes held");
+      add ("doorbell_cache_bytes %lu\n", bytes);
+   }
+   seconds ("download_seconds", "Image download time", stats.http_count, stats.http_us);
+   head ("download_total", "counter", "Image downloads by HTTP status");
+   add ("doorbell_download_total{status=\"200\"} %lu\n", stats.http_200);
+   add ("doorbell_download_total{status=\"304\"} %lu\n", stats.http_304);
+   add ("doorbell_download_total{status=\"404\"} %lu\n", stats.http_404);
+   add ("doorbell_download_total{status=\"other\"} %lu\n", stats.http_other);
+   add ("doorbell_download_total{status=\"failed\"} %lu\n", stats.http_fail);
+   head ("delta_total", "counter", "Image updates received as delta");
+   add ("doorbell_delta_total{result=\"applied\"} %lu\n", stats.delta_count);
+   add ("doorbell_delta_total{result=\"failed\"} %lu\n", stats.delta_failed);
+   head ("delta_saved_bytes_total", "counter", "Download bytes saved by delta updates");
+   add ("doorbell_delta_saved_bytes_total %lld\n", stats.delta_saved);
+   head ("peer_total", "counter", "Image cache fills and checks using peer doorbells");
+   add ("doorbell_peer_total{result=\"hit\"} %lu\n", stats.peer_hit);
+   add ("doorbell_peer_total{result=\"miss\"} %lu\n", stats.peer_miss);
+   add ("doorbell_peer_total{result=\"served\"} %lu\n", stats.peer_served);
+   head ("reject_total", "counter", "Image files rejected from server, peer, upload or SD");
+   add ("doorbell_reject_total{reason=\"size\"} %lu\n", stats.reject_size);
+   add ("doorbell_reject_total{reason=\"format\"} %lu\n", stats.reject_format);
+   head ("sd_total", "counter", "SD card file operations");
+   add ("doorbell_sd_total{op=\"read\"} %lu\n", stats.sd_read);
+   add ("doorbell_sd_total{op=\"write\"} %lu\n", stats.sd_write);
+   seconds ("decode_seconds", "PNG decode time", stats.decode_count, stats.decode_us);
+   seconds ("blit_seconds", "Run length bitmap plot time", stats.blit_count, stats.blit_us);
+   head ("loop_seconds", "histogram", "Task loop iteration time, not including waiting");
+   for (int t = 0; t < LOOPS; t++)
+   {
+      uint32_t n = 0;
+      for (int bucket = 0; bucket < LOOPBUCKETS; bucket++)
+      {
+         n += loops[t].hist[bucket];
+         if (bucket < LOOPBUCKETS - 1)
+            add ("doorbell_loop_seconds_bucket{task=\"%s\",le=\"%d.%03d\"} %lu\n", loop_name[t], (1 << bucket) / 1000, (1 << bucket) % 1000,
+                 n);
+         else
+            add ("doorbell_loop_seconds_bucket{task=\"%s\",le=\"+Inf\"} %lu\n", loop_name[t], n);
+      }
+      add ("doorbell_loop_seconds_sum{task=\"%s\"} %llu.%06llu\n", loop_name[t], loops[t].us / 1000000ULL, loops[t].us % 1000000ULL);
+      add ("doorbell_loop_seconds_count{task=\"%s\"} %lu\n", loop_name[t], n);
+   }
+   head ("stall_total", "counter", "Main loop stalls since power on");
+   add ("doorbell_stall_total %lu\n", stall.count);
+   head ("refresh_total", "counter", "Panel refreshes");
+   add ("doorbell_refresh_total{type=\"full\"} %lu\n", stats.refresh_full);
+   add ("doorbell_refresh_total{type=\"partial\"} %lu\n", stats.refresh_partial);
+   head ("mqtt_total", "counter", "Outbound MQTT queue results");
+   add ("doorbell_mqtt_total{result=\"sent\"} %lu\n", stats.mqtt_sent);
+   add ("doorbell_mqtt_total{result=\"retry\"} %lu\n", stats.mqtt_retry);
+   add ("doorbell_mqtt_total{result=\"dropped\"} %lu\n", stats.mqtt_dropped);
+   add ("doorbell_mqtt_total{result=\"dedupe\"} %lu\n", stats.mqtt_dedupe);
+   head ("mqtt_queue", "gauge", "Outbound MQTT queue depth");
+   add ("doorbell_mqtt_queue %u\n", mqtt_queue ? uxQueueMessagesWaiting (mqtt_queue) : 0);
+   head ("arena_bytes", "gauge", "PNG allocator arena size and high water mark");
+   add ("doorbell_arena_bytes{arena=\"decode\",type=\"size\"} %u\n", decode_arena.size);
+   add ("doorbell_arena_bytes{arena=\"decode\",type=\"high\"} %u\n", decode_arena.high);
+   add ("doorbell_arena_bytes{arena=\"encode\",type=\"size\"} %u\n", encode_arena.size);
+   add ("doorbell_arena_bytes{arena=\"encode\",type=\"high\"} %u\n", encode_arena.high);
+   head ("arena_fallback_total", "counter", "PNG allocations that did not fit arena");
+   add ("doorbell_arena_fallback_total{arena=\"decode\"} %lu\n", decode_arena.fallback);
+   add ("doorbell_arena_fallback_total{arena=\"encode\"} %lu\n", encode_arena.fallback);
+   seconds ("epd_lock_wait_seconds", "Time waiting for display mutex", stats.lock_count, stats.lock_us);
+   head ("task_loops_total", "counter", "Task loop iterations");
+   add ("doorbell_task_loops_total{task=\"led\"} %lu\n", stats.led_loops);
+   add ("doorbell_task_loops_total{task=\"nfc\"} %lu\n", stats.nfc_loops);
+   add ("doorbell_task_loops_total{task=\"push\"} %lu\n", stats.push_loops);
+   add ("doorbell_task_loops_total{task=\"main\"} %lu\n", stats.main_loops);
+   head ("main_busy_seconds_total", "counter", "Main loop time not waiting, against uptime gives duty cycle");
+   add ("doorbell_main_busy_seconds_total %llu.%06llu\n", stats.main_busy_us / 1000000ULL, stats.main_busy_us % 1000000ULL);
+   head ("heap_free_bytes", "gauge", "Free heap");
+   add ("doorbell_heap_free_bytes{type=\"internal\"} %u\n", heap_caps_get_free_size (MALLOC_CAP_INTERNAL));
+   add ("doorbell_heap_free_bytes{type=\"spiram\"} %u\n", heap_caps_get_free_size (MALLOC_CAP_SPIRAM));
+   head ("heap_min_free_bytes", "gauge", "Free heap low water mark");
+   add ("doorbell_heap_min_free_bytes{type=\"internal\"} %u\n", heap_caps_get_minimum_free_size (MALLOC_CAP_INTERNAL));
+   add ("doorbell_heap_min_free_bytes{type=\"spiram\"} %u\n", heap_caps_get_minimum_free_size (MALLOC_CAP_SPIRAM));
+   head ("heap_largest_free_bytes", "gauge", "Largest free heap block");
+   add ("doorbell_heap_largest_free_bytes{type=\"internal\"} %u\n", heap_caps_get_largest_free_block (MALLOC_CAP_INTERNAL));
+   add ("doorbell_heap_largest_free_bytes{type=\"spiram\"} %u\n", heap_caps_get_largest_free_block (MALLOC_CAP_SPIRAM));
+   head ("mem_bytes", "gauge", "Heap allocated by subsystem");
+   for (int t = 0; t < MEM_TAGS; t++)
+      add ("doorbell_mem_bytes{tag=\"%s\",type=\"live\"} %ld\ndoorbell_mem_bytes{tag=\"%s\",type=\"peak\"} %ld\n", mem_name[t],
+           mem[t].live, mem_name[t], mem[t].peak);
+   head ("uptime_seconds", "counter", "Uptime");
+   add ("doorbell_uptime_seconds %lu\n", uptime ());
+   httpd_resp_set_type (req, "text/plain;version=0.0.4");
+   httpd_resp_send (req, buf, p - buf);
+   if (over)
+   {                            // Larger next time
+      ESP_LOGE (TAG, "Metrics truncated at %u bytes", size);
+      stats.metrics_truncated++;
+      mem_free (MEM_HTTPD, buf);
+      buf = NULL;
+      size *= 2;
+   }
+   return ESP_OK;
+}
+
+static int
+web_auth (httpd_req_t * req)
+{                               // Check HTTP Basic auth against settings password (any user name)
+   if (!*password)
+      return 1;
+   char auth[128];
+   size_t l = httpd_req_get_hdr_value_len (req, "Authorization");
+   if (!l || l >= sizeof (auth) || httpd_req_get_hdr_value_str (req, "Authorization", auth, sizeof (auth))
+       || strncasecmp (auth, "Basic ", 6))
+      return 0;
+   unsigned char dec[96];
+   size_t len = 0;
+   if (mbedtls_base64_decode (dec, sizeof (dec) - 1, &len, (unsigned char *) auth + 6, strlen (auth + 6)))
+      return 0;
+   dec[len] = 0;
+   char *p = strchr ((char *) dec, ':');
+   return p && !strcmp (p + 1, password);
+}
+
+static esp_err_t
+web_image (httpd_req_t * req)
+{                               // GET /image/name.png?crc=XXXXXXXX, for peers, only if checked with origin within cache time
+   if (!imagepeer)
+      return httpd_resp_send_err (req, HTTPD_404_NOT_FOUND, "Not sharing");
+   const char *n = req->uri + 7;        // After /image/
+   const char *q = n;
+   while (*q && isalnum ((int) (uint8_t) * q))
+      q++;
+   if (q == n || strncmp (q, ".png", 4) || (q[4] && q[4] != '?'))
+      return httpd_resp_send_err (req, HTTPD_400_BAD_REQUEST, "Expecting /image/name.png");
+   uint32_t crc = 0;
+   char query[30];
+   if (!httpd_req_get_url_query_str (req, query, sizeof (query)))
+   {
+      char v[10];
+      if (!httpd_query_key_value (query, "crc", v, sizeof (v)))
+         crc = strtoul (v, NULL, 16);
+   }
+   char *url = NULL;
+   mem_asprintf (MEM_HTTPD, &url, "%s/%.*s.png", imageurl, (int) (q - n), n);
+   uint8_t *buf = NULL;
+   uint32_t len = 0,
+      left = 0,
+      have = 0;
+   epd_take ();                 // Data can change
+   file_t *i;
+   for (i = files; i && url && strcmp (i->url, url); i = i->next);
+   if (i && i->data && i->cache > uptime ())
+   {
+      left = i->cache - uptime ();
+      have = i->crc;
+      if (crc != have && (buf = mem_alloc (MEM_HTTPD, i->size)))
+         memcpy (buf, i->data, len = i->size);
+   }
+   xSemaphoreGive (epd_mutex);
+   mem_free (MEM_HTTPD, url);
+   if (!left)
+      return httpd_resp_send_err (req, HTTPD_404_NOT_FOUND, "Not cached");
+   char hdr[2][12];
+   sprintf (hdr[0], "%08lX", have);
+   sprintf (hdr[1], "%lu", left);
+   httpd_resp_set_hdr (req, "X-CRC", hdr[0]);
+   httpd_resp_set_hdr (req, "X-Cache", hdr[1]);
+   stats.peer_served++;
+   if (crc == have)
+   {
+      httpd_resp_set_status (req, "304 Not Modified");
+      return httpd_resp_send (req, NULL, 0);
+   }
+   if (!buf)
+      return httpd_resp_send_err (req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+   httpd_resp_set_type (req, "image/png");
+   esp_err_t e = httpd_resp_send (req, (char *) buf, len);
+   mem_free (MEM_HTTPD, buf);
+   return e;
+}
+
+static esp_err_t
+web_upload (httpd_req_t * req)
+{                               // PUT/POST /image/name.png, streamed to SD then read back in to the cache, or in to memory if no SD
+   if (!web_auth (req))
+   {
+      httpd_resp_set_hdr (req, "WWW-Authenticate", "Basic realm=\"Doorbell\"");
+      return httpd_resp_send_err (req, HTTPD_401_UNAUTHORIZED, "Password required");
+   }
+   const char *n = req->uri + 7;        // After /image/
+   const char *q = n;
+   while (*q && isalnum ((int) (uint8_t) * q))
+      q++;
+   if (q == n || strncmp (q, ".png", 4) || (q[4] && q[4] != '?'))
+      return httpd_resp_send_err (req, HTTPD_400_BAD_REQUEST, "Expecting /image/name.png");
+   if (!req->content_len)
+      return httpd_resp_send_err (req, HTTPD_411_LENGTH_REQUIRED, "Content-Length required");
+   if (req->content_len > IMAGEMAX)
+      return httpd_resp_send_err (req, HTTPD_400_BAD_REQUEST, "Too big");
+   if (heap_caps_get_largest_free_block (MALLOC_CAP_SPIRAM) < req->content_len + UPLOADMARGIN)
+      return httpd_resp_send_err (req, HTTPD_400_BAD_REQUEST, "Too big for free memory");      // The cache holds it all in the end
+   char *url = NULL;
+   mem_asprintf (MEM_HTTPD, &url, "%s/%.*s.png", imageurl, (int) (q - n), n);
+   char *fn = NULL,
+      *tmp = NULL;
+   FILE *f = NULL;
+   if (url && card && (fn = sd_file (url)))
+   {
+      mem_asprintf (MEM_HTTPD, &tmp, "%s/upload.tmp", sd_mount);
+      if (tmp)
+         f = fopen (tmp, "w+");
+   }
+   // To SD a chunk at a time, so a slow client does not hold the whole file in memory, else straight in to the cache buffer
+   uint8_t *buf = (!url ? NULL : f ? mem_alloc (MEM_HTTPD, UPLOADCHUNK) : mem_alloc (MEM_CACHE, req->content_len));
+   if (!buf)
+   {
+      if (f)
+      {
+         fclose (f);
+         unlink (tmp);
+      }
+      mem_free (MEM_CACHE, fn);
+      mem_free (MEM_HTTPD, tmp);
+      mem_free (MEM_HTTPD, url);
+      return httpd_resp_send_err (req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+   }
+   const char *e = NULL;
+   size_t len = 0;
+   int timeouts = 0;
+   while (len < req->content_len)
+   {
+      size_t want = req->content_len - len;
+      if (want > UPLOADCHUNK)
+         want = UPLOADCHUNK;
+      int r = httpd_req_recv (req, (char *) (f ? buf : buf + len), want);
+      if (r == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < UPLOADTIMEOUTS)
+         continue;              // Single httpd task, so do not wait for ever
+      if (r <= 0)
+         break;
+      timeouts = 0;
+      if (f && fwrite (buf, r, 1, f) != 1)
+      {
+         e = "SD write failed";
+         break;
+      }
+      len += r;
+   }
+   if (!e && len < req->content_len)
+      e = "Incomplete";
+   if (f)
+   {                            // Read back in to the cache buffer
+      mem_free (MEM_HTTPD, buf);
+      buf = NULL;
+      if (!e && (fflush (f) || fseek (f, 0, SEEK_SET)))
+         e = "SD write failed";
+      if (!e && !(buf = mem_alloc (MEM_CACHE, len)))
+         e = "No memory";
+      for (size_t o = 0; !e && o < len; o += UPLOADCHUNK)
+         if (fread (buf + o, len - o < UPLOADCHUNK ? len - o : UPLOADCHUNK, 1, f) != 1)
+            e = "SD read failed";
+   }
+   file_t new = {.url = url,.data = buf,.size = len };
+   if (!e)
+   {
+      check_file (&new);
+      if (!new.data)
+         e = "Not a valid image";
+   }
+   if (f)
+   {
+      fclose (f);
+      if (e)
+         unlink (tmp);
+      else
+      {
+         unlink (fn);
+         if (rename (tmp, fn))
+            unlink (tmp);
+         else
+            stats.sd_write++;
+      }
    }
-   return revk_web_foot (req, 0, 1, NULL);
-}
-
-static esp_err_t
-web_push (httpd_req_t * req)
-{
-   size_t l = httpd_req_get_url_query_len (req);
-   char query[200];
-   if (!*overridename && l > 0 && l < sizeof (query) && !httpd_req_get_url_query_str (req, query, sizeof (query)))
+   mem_free (MEM_CACHE, fn);
+   mem_free (MEM_HTTPD, tmp);
+   file_t *i = (e ? NULL : find_file (url));   // Only now it is known to be good
+   mem_free (MEM_HTTPD, url);
+   if (!e && !i)
+      e = "No memory";
+   if (e)
    {
-      strncpy (overridename, query, sizeof (overridename));
-      return web_text (req, NULL);
+      mem_free (MEM_CACHE, new.data);
+      return httpd_resp_send_err (req, HTTPD_400_BAD_REQUEST, e);
    }
-   pushed = uptime () + holdtime;
-   sleep (1);
-   return web_root (req);
+   epd_take ();                 // Data in use when plotting
+   mem_free (MEM_CACHE, i->data);
+   mem_free (MEM_CACHE, i->rle);
+   i->rle = NULL;
+   i->rlesize = 0;
+   mem_free (MEM_CACHE, i->scene);
+   i->scene = NULL;
+   i->data = new.data;
+   i->size = new.size;
+   i->w = new.w;
+   i->h = new.h;
+   i->crc = new.crc;
+   i->json = new.json;
+   i->new = 1;
+   i->card = 1;
+   i->changed = new.changed;
+   i->cache = uptime () + imagecache;
+   xSemaphoreGive (epd_mutex);
+   if (!pushed)
+      last = -1;                // Redisplay
+   jo_t j = jo_object_alloc ();
+   jo_string (j, "url", i->url);
+   jo_int (j, "size", i->size);
+   jo_int (j, "width", i->w);
+   jo_int (j, "height", i->h);
+   jo_stringf (j, "crc", "%08lX", i->crc);
+   char *ack = jo_finisha (&j);
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_sendstr (req, ack ? : "{}");
+   free (ack);
+   return ESP_OK;
 }
 
 static esp_err_t
@@ -596,7 +3885,7 @@ web_active (httpd_req_t * req)
          q++;
       setactive (q);
    }
-   return web_text (req, NULL);
+   return web_ack (req, -1);
 }
 
 static esp_err_t
@@ -611,7 +3900,7 @@ web_message (httpd_req_t * req)
          q++;
       strncpy ((char *) overridemsg, q, sizeof (overridemsg));
    }
-   return web_text (req, NULL);
+   return web_ack (req, -1);
 }
 
 static void
@@ -625,16 +3914,22 @@ register_uri (const httpd_uri_t * uri_struct)
 }
 
 static void
-register_get_uri (const char *uri, esp_err_t (*handler) (httpd_req_t * r))
+register_method_uri (const char *uri, httpd_method_t method, esp_err_t (*handler) (httpd_req_t * r))
 {
    httpd_uri_t uri_struct = {
       .uri = uri,
-      .method = HTTP_GET,
+      .method = method,
       .handler = handler,
    };
    register_uri (&uri_struct);
 }
 
+static void
+register_get_uri (const char *uri, esp_err_t (*handler) (httpd_req_t * r))
+{
+   register_method_uri (uri, HTTP_GET, handler);
+}
+
 const char *
 gfx_qr (const char *value, int s)
 {
@@ -659,28 +3954,558 @@ gfx_qr (const char *value, int s)
    for (int y = 0; y < width; y++)
       for (int x = 0; x < width; x++)
          if (qr[width * y + x] & QR_TAG_BLACK)
-            for (int dy = 0; dy < s; dy++)
-               for (int dx = 0; dx < s; dx++)
-                  gfx_pixel (ox + x * s + dx, oy + y * s + dy, 0xFF);
+         {
+            int n = 1;          // Run of black modules
+            while (x + n < width && (qr[width * y + x + n] & QR_TAG_BLACK))
+               n++;
+            if (!fb_fill (ox + x * s, oy + y * s, n * s, s, 1))
+               for (int dy = 0; dy < s; dy++)
+                  for (int dx = 0; dx < n * s; dx++)
+                     gfx_pixel (ox + x * s + dx, oy + y * s + dy, 0xFF);
+            x += n - 1;
+         }
    free (qr);
 #endif
    return NULL;
 }
 
 void
-tassub (char *name)
+bench (uint8_t mode)
+{                               // Compare PNG decode, run length bitmap and raw 2 bit map blit for cached images, then render screens and check against golden hashes
+   loopnow.bench = 1;           // Takes a while, and waits for the bell push
+   jo_t j = jo_object_alloc ();
+   jo_int (j, "flip", gfxflip);
+   jo_int (j, "width", gfx_width ());
+   jo_int (j, "height", gfx_height ());
+   // Screens to render, images fetched first as getimage may need the display mutex
+   struct
+   {
+      char screen[20];
+      const char *name;
+      file_t *i;
+      const char *oname;        // Overlay
+      file_t *o;
+      gfx_pos_t ox,
+        oy;
+   } screens[BENCHSCREENS];
+   int n = 0;
+   void add (const char *screen, const char *name, const char *oname, gfx_pos_t ox, gfx_pos_t oy)
+   {
+      if (n == BENCHSCREENS)
+         return;
+      memset (&screens[n], 0, sizeof (screens[n]));
+      strncpy (screens[n].screen, screen, sizeof (screens[n].screen) - 1);
+      screens[n].name = name;
+      screens[n].i = name ? getimage (name) : NULL;
+      screens[n].oname = oname;
+      screens[n].o = oname ? getimage (oname) : NULL;
+      screens[n].ox = ox;
+      screens[n].oy = oy;
+      n++;
+   }
+   add ("idle", idle_name (), imageidleo, imageidlex, imageidley);
+   add ("wait", imagewait, imageactiveo, imageactivex, imageactivey);
+   add ("busy", imagebusy, imageactiveo, imageactivex, imageactivey);
+   add ("away", imageaway, imageactiveo, imageactivex, imageactivey);
+   add ("message", NULL, NULL, 0, 0);
+   add ("qr", NULL, NULL, 0, 0);
+   epd_take ();
+   for (file_t * i = files; i; i = i->next)
+      if (i->data && !i->json && n < BENCHSCREENS)
+      {                         // Every cached image as an override image
+         const char *name = strrchr (i->url, '/');
+         name = name ? name + 1 : i->url;
+         memset (&screens[n], 0, sizeof (screens[n]));
+         snprintf (screens[n].screen, sizeof (screens[n].screen), "image:%.*s", (int) strcspn (name, "."), name);
+         screens[n].i = i;
+         n++;
+      }
+   xSemaphoreGive (epd_mutex);
+   // Golden hashes for this orientation
+   char *gfn = NULL,
+      *gold = NULL;
+   size_t goldlen = 0;
+   FILE *go = NULL;
+   if (card)
+   {
+      mem_asprintf (MEM_OTHER, &gfn, "%s/golden%d.txt", sd_mount, gfxflip);
+      FILE *f = NULL;
+      if (gfn && mode != BENCH_GOLDEN && (f = fopen (gfn, "r")))
+      {
+         struct stat st;
+         if (!fstat (fileno (f), &st) && st.st_size > 0 && st.st_size < BENCHGOLDEN && (gold = mem_alloc (MEM_OTHER, st.st_size + 1)))
+         {
+            goldlen = fread (gold, 1, st.st_size, f);
+            gold[goldlen] = 0;
+            stats.sd_read++;
+         }
+         fclose (f);
+      }
+      if (gfn && mode == BENCH_GOLDEN)
+         go = fopen (gfn, "w");
+   }
+   int failed = 0;
+   // The display is locked for one screen or image at a time, so the watchdog, bell and web handlers are not held up
+   size_t fblen = (gfx_raw_w () + 7) / 8 * gfx_raw_h ();
+   uint8_t *save = (fb_raw ()? mem_alloc (MEM_OTHER, fblen) : NULL);     // Not on red panels, as the red plane cannot be put back
+   uint8_t aborted = 0;
+   int lock (void)
+   {                            // Lock display for next item, 0 if stopping as bell pushed
+      if (aborted || pushed)
+      {
+         aborted = 1;
+         return 0;
+      }
+      epd_lock ();
+      return 1;
+   }
+   void unlock (void)
+   {                            // Put back, display does not change, so not counted as a frame
+      if (save)
+         memcpy (gfx_raw_b (), save, fblen);
+      fb.dirty = 0;
+      gfx_unlock ();
+      xSemaphoreGive (epd_mutex);
+      vTaskDelay (1);
+   }
+   if (save)
+   {
+      epd_lock ();
+      memcpy (save, gfx_raw_b (), fblen);
+      gfx_unlock ();
+      xSemaphoreGive (epd_mutex);
+   }
+   jo_array (j, "screens");
+   for (int m = REVK_SETTINGS_IMAGEPLOT_NORMAL; save && m <= REVK_SETTINGS_IMAGEPLOT_MASKINVERT; m++)
+   {
+      for (int s = 0; s < n && lock (); s++)
+      {
+         void draw (const char *name, file_t * i, gfx_pos_t x, gfx_pos_t y)
+         {                      // As image_load, without colour prefix so the LEDs are left alone
+            if (!i)
+               return;
+            uint8_t dither = (name ? dithermode (name) : i->dither);
+            if (m == REVK_SETTINGS_IMAGEPLOT_NORMAL && i->rle)
+            {                   // Decode once per screen so decode time is seen
+               mem_free (MEM_CACHE, i->rle);
+               i->rle = NULL;
+               i->rlesize = 0;
+            }
+            char temp[100];
+            snprintf (temp, sizeof (temp), "%s%s", dither == DITHER_ORDERED ? "^" : dither == DITHER_DIFFUSE ? "~" : "",
+                      skipcolour (name) ? : "");
+            image_load (temp, i, 0, x, y, m);
+         }
+         typeof (stats) s0 = stats;
+         uint32_t a0 = 0;
+         for (int t = 0; t < MEM_TAGS; t++)
+            a0 += mem[t].allocs;
+         int64_t t0 = esp_timer_get_time ();
+         gfx_clear (0);
+         if (!strcmp (screens[s].screen, "message"))
+            msg_draw ("BENCH/TEST/MESSAGE");
+         else if (!strcmp (screens[s].screen, "qr"))
+         {
+            gfx_pos (0, gfx_height () - 1, GFX_B | GFX_L | GFX_V);
+            gfx_qr ("2000-01-01 00:00 BENCH", 4);
+         } else if (!screens[s].name)
+            draw (NULL, screens[s].i, gfx_width () / 2, gfx_height () / 2);
+         else if (!screens[s].i)
+            msg_draw (s ? MSG_WAIT : MSG_IDLE);
+         else
+            draw (screens[s].name, screens[s].i, gfx_width () / 2, gfx_height () / 2);
+         draw (screens[s].oname, screens[s].o, screens[s].ox, screens[s].oy);
+         int64_t t1 = esp_timer_get_time ();
+         uint32_t a1 = 0;
+         for (int t = 0; t < MEM_TAGS; t++)
+            a1 += mem[t].allocs;
+         uint32_t crc = esp_rom_crc32_le (0, gfx_raw_b (), fblen);
+         unlock ();
+         char key[50];
+         snprintf (key, sizeof (key), "%d %s ", m, screens[s].screen);
+         jo_object (j, NULL);
+         jo_string (j, "screen", screens[s].screen);
+         jo_int (j, "plot", m);
+         jo_int (j, "us", t1 - t0);
+         jo_int (j, "decode_us", stats.decode_us - s0.decode_us);
+         jo_int (j, "blit_us", stats.blit_us - s0.blit_us);
+         jo_int (j, "allocs", a1 - a0);
+         jo_stringf (j, "crc", "%08lX", crc);
+         if (go)
+            fprintf (go, "%s%08lX\n", key, crc);
+         else if (gold)
+         {
+            const char *g = gold;
+            while ((g = strstr (g, key)) && g > gold && g[-1] != '\n')
+               g++;
+            if (!g)
+               jo_string (j, "golden", "new");
+            else if (strtoul (g + strlen (key), NULL, 16) == crc)
+               jo_string (j, "golden", "match");
+            else
+            {
+               jo_string (j, "golden", "differ");
+               failed++;
+            }
+         }
+         jo_close (j);
+      }
+   }
+   jo_close (j);
+   jo_array (j, "images");
+   for (file_t * i = files; i && lock (); i = i->next)
+   {                            // Without a frame buffer copy (red panels), only the timings that do not touch the display
+      if (!i->data || i->json || !i->w || !i->h)
+      {
+         unlock ();
+         continue;
+      }
+      mem_free (MEM_CACHE, i->rle);     // Built again, to time it
+      i->rle = NULL;
+      i->rlesize = 0;
+      int64_t t = esp_timer_get_time ();
+      rle_build (i, i->dither);
+      t = esp_timer_get_time () - t;
+      jo_object (j, NULL);
+      jo_string (j, "url", i->url);
+      jo_int (j, "width", i->w);
+      jo_int (j, "height", i->h);
+      jo_int (j, "png_bytes", i->size);
+      jo_int (j, "rle_bytes", i->rlesize);
+      jo_int (j, "rle_pack", i->pack);
+      jo_int (j, "raw_bytes", ((size_t) i->w * i->h + 3) / 4);
+      jo_int (j, "build_us", t);
+      if (save)
+      {
+         t = esp_timer_get_time ();
+         plot_png (i, 0, 0, i->dither);
+         t = esp_timer_get_time () - t;
+         jo_int (j, "png_us", t);
+         if (t)
+            jo_int (j, "png_bps", (int64_t) i->size * 1000000 / t);
+      }
+      if (i->rle)
+      {
+         if (save)
+         {
+            t = esp_timer_get_time ();
+            rle_blit (i, 0, 0, imageplot);
+            jo_int (j, "rle_us", esp_timer_get_time () - t);
+         }
+         rle_map_t m = {.w = i->w,.h = i->h };
+         if ((m.map = mem_alloc (MEM_OTHER, ((size_t) m.w * m.h + 3) / 4)))
+         {                      // Expand to raw map, and time that and plotting it
+            t = esp_timer_get_time ();
+            rle_expand (i, m.map);
+            jo_int (j, "expand_us", esp_timer_get_time () - t);
+            if (save)
+            {
+               t = esp_timer_get_time ();
+               size_t o = 0;
+               for (uint32_t y = 0; y < m.h; y++)
+                  for (uint32_t x = 0; x < m.w; x++, o++)
+                  {
+                     uint8_t v = rle_get (&m, o);
+                     if (v != RLE_CLEAR)
+                        gfx_pixel (x, y, v == RLE_WHITE ? 255 : 0);
+                  }
+               jo_int (j, "raw_us", esp_timer_get_time () - t);
+            }
+            mem_free (MEM_OTHER, m.map);
+         }
+      }
+      unlock ();
+      jo_close (j);
+   }
+   jo_close (j);
+   jo_array (j, "ingest");
+   for (file_t * i = files; i && !aborted; i = i->next)
+   {                            // Content check throughput
+      epd_take ();              // Data in use
+      if (!i->data)
+      {
+         xSemaphoreGive (epd_mutex);
+         continue;
+      }
+      uint8_t json;
+      uint32_t w,
+        h;
+      int64_t t = esp_timer_get_time ();
+      const char *e = check_data (i->data, i->size, &json, &w, &h);
+      t = esp_timer_get_time () - t;
+      jo_object (j, NULL);
+      jo_string (j, "url", i->url);
+      jo_string (j, "format", e ? "bad" : json ? "json" : "png");
+      jo_int (j, "bytes", i->size);
+      jo_int (j, "check_us", t);
+      if (t)
+         jo_int (j, "check_bps", (int64_t) i->size * 1000000 / t);
+      xSemaphoreGive (epd_mutex);
+      vTaskDelay (1);
+      jo_close (j);
+   }
+   jo_close (j);
+   mem_free (MEM_OTHER, save);
+   if (!fb_raw ())
+      jo_string (j, "skipped", "Red plane, screens and display timings");
+   else if (!save)
+      jo_string (j, "error", "No frame buffer copy");
+   if (aborted)
+      jo_bool (j, "aborted", 1);
+   if (go)
+   {
+      fclose (go);
+      if (aborted)
+         unlink (gfn);          // Incomplete
+      else
+      {
+         stats.sd_write++;
+         jo_bool (j, "golden", 1);
+      }
+   } else if (gold)
+      jo_int (j, "failed", failed);
+   mem_free (MEM_OTHER, gold);
+   mem_free (MEM_OTHER, gfn);
+   revk_info ("bench", &j);
+}
+
+static void
+hash_add (hash_t * t, const char *key, int16_t value)
+{
+   uint32_t h = hash_str (key);
+   for (int n = 0; n < HASHSIZE; n++)
+   {
+      hash_t *e = &t[(h + n) & (HASHSIZE - 1)];
+      if (!e->key || !strcmp (e->key, key))
+      {
+         e->key = key;
+         e->value = value;
+         return;
+      }
+   }
+   ESP_LOGE (TAG, "Hash full %s", key);
+}
+
+static int
+hash_find (const hash_t * t, const char *key)
+{
+   uint32_t h = hash_str (key);
+   for (int n = 0; n < HASHSIZE; n++)
+   {
+      const hash_t *e = &t[(h + n) & (HASHSIZE - 1)];
+      if (!e->key)
+         break;
+      if (!strcmp (e->key, key))
+         return e->value;
+   }
+   return -1;
+}
+
+void
+presence_compile (void)
+{                               // Compile switch names and image rules, from settings (which need reboot to change)
+   memset (switch_hash, 0, sizeof (switch_hash));
+   void add (const char *name, int bit)
+   {                            // Same device can be more than one switch, e.g. away and busy, so away still wins
+      if (!name || !*name)
+         return;
+      int bits = hash_find (switch_hash, name);
+      hash_add (switch_hash, name, (bits < 0 ? 0 : bits) | (1 << bit));
+   }
+   add (tasaway, 0);
+   add (tasbusy, 1);
+   for (int s = 0; s < SWITCHES; s++)
+      add (tasswitch[s], 2 + s);
+   struct
+   {
+      uint32_t bits;
+      const char *image;
+   } rule[RULES];
+   int rules = 0;
+   const char *image (const char *n)
+   {                            // Own copy of image name, shared by rules for the same image, kept as rules are only compiled once
+      for (int r = 0; r < rules; r++)
+         if (!strcmp (rule[r].image, n))
+            return rule[r].image;
+      return mem_strdup (MEM_OTHER, n);
+   }
+   for (int r = 0; r < RULES; r++)
+   {                            // switch+switch=image
+      const char *p = imagerule[r];
+      const char *eq = p ? strchr (p, '=') : NULL;
+      if (!eq)
+         continue;
+      uint32_t bits = 0;
+      while (p < eq)
+      {
+         const char *e = p;
+         while (e < eq && *e != '+')
+            e++;
+         char name[40];
+         snprintf (name, sizeof (name), "%.*s", (int) (e - p), p);
+         int found = hash_find (switch_hash, name);
+         if (found < 0)
+         {
+            jo_t j = jo_object_alloc ();
+            jo_string (j, "error", "Unknown switch");
+            jo_string (j, "switch", name);
+            jo_string (j, "rule", imagerule[r]);
+            revk_error ("rule", &j);
+            bits = 0;
+            break;
+         }
+         bits |= found;
+         p = e;
+         if (p < eq)
+            p++;
+      }
+      if (!bits)
+         continue;
+      rule[rules].bits = bits;
+      if (!(rule[rules].image = image (eq + 1)))
+         continue;
+      rules++;
+   }
+   for (int m = 0; m < (1 << PRESENCEBITS); m++)
+   {                            // First matching rule
+      int r;
+      for (r = 0; r < rules && (m & rule[r].bits) != rule[r].bits; r++);
+      presence_image[m] = (r < rules ? rule[r].image : NULL);
+   }
+}
+
+const char *
+presence_active (void)
+{                               // Active image for current presence state
+   uint8_t p = presence;
+   if (presence_image[p])
+      return presence_image[p];
+   return (p & PRESENCE_AWAY) ? imageaway : (p & PRESENCE_BUSY) ? imagebusy : imagewait;
+}
+
+void
+tassub (const char *name)
 {
    if (!*name)
       return;
    char *topic;
-   asprintf (&topic, "stat/%s/RESULT", name);
+   mem_asprintf (MEM_MQTT, &topic, "stat/%s/RESULT", name);
    lwmqtt_subscribe (revk_mqtt (0), topic);
-   free (topic);
-   asprintf (&topic, "cmnd/%s/POWER", name);
+   mem_free (MEM_MQTT, topic);
+   mem_asprintf (MEM_MQTT, &topic, "cmnd/%s/POWER", name);
    revk_mqtt_send_raw (topic, 0, NULL, 1);
-   free (topic);
+   mem_free (MEM_MQTT, topic);
+}
+
+static const char *
+cmd_setting (const char *value)
+{
+   last = 0;
+   b.pagestale = 1;
+   return "";
+}
+
+static const char *
+cmd_connect (const char *value)
+{
+   b.mqttinit = 1;
+   return "";
+}
+
+static const char *
+cmd_upgrade (const char *value)
+{
+   strncpy ((char *) overridemsg, "UPGRADING", sizeof (overridemsg));
+   return "";
+}
+
+static const char *
+cmd_wifi (const char *value)
+{
+   b.wificonnect = 1;
+   return "";
+}
+
+static const char *
+cmd_message (const char *value)
+{
+   strncpy ((char *) overridemsg, value, sizeof (overridemsg));
+   return "";
+}
+
+static const char *
+cmd_cancel (const char *value)
+{
+   override = 0;
+   pushed = 0;
+   bellsent = 0;
+   return "";
+}
+
+static const char *
+cmd_push (const char *value)
+{
+   if (!*overridename && *value)
+      strncpy (overridename, value, sizeof (overridename));
+   else
+   {
+      pushed = uptime () + holdtime;
+      stats.push_mqtt++;
+   }
+   return "";
+}
+
+static const char *
+cmd_bench (const char *value)
+{
+   benchmode = (!strcmp (value, "golden") ? BENCH_GOLDEN : BENCH_NORMAL);
+   b.bench = 1;                 // Done in main loop
+   return "";
+}
+
+static const char *
+cmd_stall (const char *value)
+{
+   if (!strcmp (value, "clear"))
+   {
+      taskENTER_CRITICAL (&stall_mux);
+      stall.count = 0;
+      taskEXIT_CRITICAL (&stall_mux);
+      memset (loops, 0, sizeof (loops));
+   }
+   jo_t j = jo_object_alloc ();
+   stall_json (j);
+   revk_info ("stall", &j);
+   return "";
+}
+
+static const char *
+cmd_active (const char *value)
+{
+   setactive (value);
+   return "";
 }
 
+static const struct
+{
+   const char *name;
+   const char *(*fn) (const char *value);
+} commands[] = {
+   {"setting", cmd_setting},
+   {"connect", cmd_connect},
+   {"upgrade", cmd_upgrade},
+   {"wifi", cmd_wifi},
+   {"ipv6", cmd_wifi},
+   {"message", cmd_message},
+   {"cancel", cmd_cancel},
+   {"push", cmd_push},
+   {"active", cmd_active},
+   {"bench", cmd_bench},
+   {"stall", cmd_stall},
+};
+
+static hash_t command_hash[HASHSIZE] = { 0 };
+
 const char *
 app_callback (int client, const char *prefix, const char *target, const char *suffix, jo_t j)
 {
@@ -697,63 +4522,29 @@ app_callback (int client, const char *prefix, const char *target, const char *su
    }
    if (prefix && target && suffix && j && !strcmp (prefix, "stat") && !strcmp (suffix, "RESULT"))
    {
+      int bits = hash_find (switch_hash, target);
       jo_rewind (j);
-      if (jo_find (j, "POWER") == JO_STRING)
-      {                         // "ON" or "OFF"
-         if (!strcmp (target, tasaway))
-            b.tasawaystate = !jo_strcmp (j, "OFF");     // Off means we are away
-         else if (!strcmp (target, tasbusy))
-            b.tasbusystate = !jo_strcmp (j, "OFF");     // Off means we are busy
-         setactive (b.tasawaystate ? imageaway : b.tasbusystate ? imagebusy : imagewait);
+      if (bits >= 0 && jo_find (j, "POWER") == JO_STRING)
+      {                         // "ON" or "OFF", off means away/busy/etc
+         if (!jo_strcmp (j, "OFF"))
+            presence |= bits;
+         else
+            presence &= ~bits;
+         setactive (presence_active ());
+         events_notify ();
       }
    }
-   if (client || !prefix || target || strcmp (prefix, topiccommand) || !suffix)
-      return NULL;              //Not for us or not a command from main MQTT
-   if (!strcmp (suffix, "setting"))
-   {
-      last = 0;
-      return "";
-   }
-   if (!strcmp (suffix, "connect"))
-   {
-      b.mqttinit = 1;
-      return "";
-   }
-   if (!strcmp (suffix, "upgrade"))
-   {
-      strncpy ((char *) overridemsg, "UPGRADING", sizeof (overridemsg));
-      return "";
-   }
-   if (!strcmp (suffix, "wifi") || !strcmp (suffix, "ipv6"))
-   {
-      b.wificonnect = 1;
-      return "";
-   }
-   if (!strcmp (suffix, "message"))
-   {
-      strncpy ((char *) overridemsg, value, sizeof (overridemsg));
-      return "";
-   }
-   if (!strcmp (suffix, "cancel"))
-   {
-      override = 0;
-      pushed = 0;
-      return "";
-   }
-   if (!strcmp (suffix, "push"))
-   {
-      if (!*overridename && *value)
-         strncpy (overridename, value, sizeof (overridename));
-      else
-         pushed = uptime () + holdtime;
-      return "";
-   }
-   if (!strcmp (suffix, "active"))
+   if (prefix && target && suffix && !strcmp (prefix, PEERTOPIC) && !strcmp (suffix, "peer"))
    {
-      setactive (value);
-      return "";
+      jo_rewind (j);
+      peer_seen (target, j);
    }
-   return NULL;
+   if (client || !prefix || target || strcmp (prefix, topiccommand) || !suffix)
+      return NULL;              //Not for us or not a command from main MQTT
+   int c = hash_find (command_hash, suffix);
+   if (c < 0)
+      return NULL;
+   return commands[c].fn (value);
 }
 
 // --------------------------------------------------------------------------------
@@ -804,9 +4595,19 @@ nfc_task (void *arg)
       return;
    }
    uint8_t buf[NFCBUF];
+   int64_t start = 0;
    while (1)
    {
-      int l = uart_read_bytes (NFCUART, buf, NFCBUF, 5 / portTICK_PERIOD_MS ? : 1);
+      loop_time (LOOP_NFC, &start);
+      int l = uart_read_bytes (NFCUART, buf, 1, portMAX_DELAY);     // Wait for start
+      start = esp_timer_get_time ();
+      if (l == 1)
+      {                         // Rest of message
+         int r = uart_read_bytes (NFCUART, buf + 1, NFCBUF - 1, 5 / portTICK_PERIOD_MS ? : 1);
+         if (r > 0)
+            l += r;
+      }
+      stats.nfc_loops++;
       if (l <= 0)
          continue;
       uint8_t *p = buf,
@@ -842,6 +4643,8 @@ nfc_task (void *arg)
             blink = c;
             solid = l;
             nfcledoverride = 255;
+            if (led_task_id)
+               xTaskNotifyGive (led_task_id);
             //ESP_LOGE (TAG, "LED solid=%02X blink=%02X", solid, blink);
          }
       }
@@ -849,6 +4652,15 @@ nfc_task (void *arg)
    }
 }
 
+static void IRAM_ATTR
+push_isr (void *arg)
+{                               // Button level changed, masked until push_task has looked at it (level interrupt would repeat)
+   gpio_intr_disable ((intptr_t) arg);
+   BaseType_t woken = pdFALSE;
+   vTaskNotifyGiveFromISR (push_task_id, &woken);
+   portYIELD_FROM_ISR (woken);
+}
+
 void
 push_task (void *arg)
 {
@@ -865,8 +4677,17 @@ push_task (void *arg)
       vTaskDelete (NULL);
       return;
    }
+   push_task_id = xTaskGetCurrentTaskHandle ();
+   gpio_intr_disable (btn1.num);
+   gpio_install_isr_service (0);        // May already be installed
+   if (gpio_isr_handler_add (btn1.num, push_isr, (void *) (intptr_t) btn1.num))
+      push_task_id = NULL;      // Poll instead
+   else if (powersave)
+      esp_sleep_enable_gpio_wakeup ();  // Wake from light sleep on button
    while (1)
    {
+      int64_t start = esp_timer_get_time ();
+      stats.push_loops++;
       uint8_t l = revk_gpio_get (btn1);
       if (l && !b.btn)
       { // Some debounce
@@ -879,11 +4700,26 @@ push_task (void *arg)
                ESP_LOGE (TAG, "Pushed btn1");
                revk_info ("btn1", NULL);
                pushed = uptime () + holdtime;
+               stats.push_button++;
+               if (main_task_id)
+                  xTaskNotifyGive (main_task_id);
             }
          }
       }
       b.btn = l;
-      usleep (10000);
+      loop_time (LOOP_PUSH, &start);
+      if (push_task_id)
+      {                         // Wait for pin to change from level now, level (not edge) so it also wakes from light sleep
+         gpio_int_type_t t = ((l ^ btn1.invert) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+         if (powersave)
+            gpio_wakeup_enable (btn1.num, t);   // Sets interrupt type as well
+         else
+            gpio_set_intr_type (btn1.num, t);
+         gpio_intr_enable (btn1.num);
+         ulTaskNotifyTake (pdTRUE, l ? pdMS_TO_TICKS (100) : portMAX_DELAY);
+         gpio_intr_disable (btn1.num);
+      } else
+         usleep (10000);
    }
 }
 
@@ -894,8 +4730,12 @@ led_task (void *arg)
       og = 0,
       ob = 0,
       n = 0;
+   led_task_id = xTaskGetCurrentTaskHandle ();
+   int64_t start = 0;
    while (1)
    {
+      start = esp_timer_get_time ();
+      stats.led_loops++;
       revk_led (strip, 0, 255, revk_blinker ());
       if (nfcledoverride)
       {
@@ -926,9 +4766,11 @@ led_task (void *arg)
             revk_led (strip, i, 255, revk_rgb (c));
          }
          led_strip_refresh (strip);
+         loop_time (LOOP_LED, &start);
          usleep (10000);
          if (--nfcledoverride)
             continue;
+         start = esp_timer_get_time ();
          // Done
          for (int i = 1; i < leds; i++)
             revk_led (strip, i, 255, 0);
@@ -945,8 +4787,9 @@ led_task (void *arg)
          g = (rgb >> 8),
          b = rgb;
       if (r == or && g == og && b == ob && !led_colour[1])
-      {                         // No change and not flashing
-         usleep (10000);
+      {                         // No change and not flashing, wait for image_load or NFC to change something
+         loop_time (LOOP_LED, &start);
+         ulTaskNotifyTake (pdTRUE, portMAX_DELAY);      // Status LED only shows on a refresh anyway
          continue;
       }
       // Fade
@@ -978,28 +4821,63 @@ led_task (void *arg)
             else
                led_strip_set_pixel (strip, i, R, G, B);
          led_strip_refresh (strip);
+         loop_time (LOOP_LED, &start);
          usleep (led_colour[1] ? 100000 : 50000);
+         start = esp_timer_get_time ();
       }
       or = r;
       og = g;
       ob = b;
+      loop_time (LOOP_LED, &start);
    }
 }
 
 void
 app_main ()
 {
+   if (stall.magic != STALLMAGIC || esp_reset_reason () == ESP_RST_POWERON)
+   {                            // RTC memory not kept
+      memset (&stall, 0, sizeof (stall));
+      stall.magic = STALLMAGIC;
+   }
+   if (frame_sent[0] != FRAMEMAGIC || esp_reset_reason () == ESP_RST_POWERON)
+      frame_sent[0] = 0;        // Not known what the panel shows
+   for (int c = 0; c < sizeof (commands) / sizeof (*commands); c++)
+      hash_add (command_hash, commands[c].name, c);
    revk_boot (&app_callback);
    revk_start ();
+   main_task_id = xTaskGetCurrentTaskHandle ();
+#ifdef	CONFIG_PM_ENABLE
+   {                            // Set either way, so without powersave the CPU stays at full speed and tickless idle never sleeps
+      esp_pm_config_t pm = {
+         .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+         .min_freq_mhz = powersave ? 40 : CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+         .light_sleep_enable = powersave,
+      };
+      esp_err_t e = esp_pm_configure (&pm);
+      if (e)
+         ESP_LOGE (TAG, "Power management %s", esp_err_to_name (e));
+   }
+#else
+   if (powersave)
+      ESP_LOGE (TAG, "Power management not in build");
+#endif
    epd_mutex = xSemaphoreCreateMutex ();
    xSemaphoreGive (epd_mutex);
+   events_mutex = xSemaphoreCreateMutex ();
+   xSemaphoreGive (events_mutex);
 
    revk_gpio_output (relay, 0);
 
+   mqtt_queue = xQueueCreate (MQTTQUEUE, sizeof (mqtt_msg_t *));
+   mqtt_task_id = revk_task ("mqtt", mqtt_task, NULL, 4);
+   revk_task ("stall", stall_task, NULL, 2);
    revk_task ("push", push_task, NULL, 4);
    revk_task ("nfc", nfc_task, NULL, 4);
 
-   setactive (imagewait);
+   presence_compile ();
+   schedule_compile ();
+   setactive (presence_active ());
 
    if (leds)
    {
@@ -1015,16 +4893,19 @@ app_main ()
          .resolution_hz = 10 * 1000 * 1000,     // 10MHz
          .flags.with_dma = true,
       };
+      size_t before = heap_caps_get_free_size (MALLOC_CAP_DEFAULT);
       REVK_ERR_CHECK (led_strip_new_rmt_device (&strip_config, &rmt_config, &strip));
+      mem_count (MEM_LED, before - heap_caps_get_free_size (MALLOC_CAP_DEFAULT));        // Allocated by library
       if (strip)
          revk_task ("led", led_task, NULL, 4);
-      image_load (NULL, NULL, 'M', gfx_width () / 2, gfx_height () / 2);
+      image_load (NULL, NULL, 'M', gfx_width () / 2, gfx_height () / 2, imageplot);
    }
    // Web interface
    httpd_config_t config = HTTPD_DEFAULT_CONFIG ();
    config.stack_size += 1024 * 4;
    config.lru_purge_enable = true;
-   config.max_uri_handlers = 6 + revk_num_web_handlers ();
+   config.max_uri_handlers = 12 + revk_num_web_handlers ();
+   config.uri_match_fn = httpd_uri_match_wildcard;
    if (!httpd_start (&webserver, &config))
    {
       register_get_uri ("/", web_root);
@@ -1032,26 +4913,19 @@ app_main ()
       register_get_uri ("/push", web_push);
       register_get_uri ("/message", web_message);
       register_get_uri ("/active", web_active);
+      register_get_uri ("/events", web_events);
+      register_get_uri ("/metrics", web_metrics);
+      register_get_uri ("/stall", web_stall);
+      register_method_uri ("/image/*", HTTP_GET, web_image);
+      register_method_uri ("/image/*", HTTP_PUT, web_upload);
+      register_method_uri ("/image/*", HTTP_POST, web_upload);
+      events_task_id = revk_task ("events", events_task, NULL, 4);
 #ifdef	CONFIG_LWPNG_ENCODE
       if (gfx_bpp () == 1)
          register_get_uri ("/frame.png", web_frame);
 #endif
       revk_web_settings_add (webserver);
    }
-   {
-    const char *e = gfx_init (cs: gfxcs.num, sck: gfxsck.num, mosi: gfxmosi.num, dc: gfxdc.num, rst: gfxrst.num, busy: gfxbusy.num, ena: gfxena.num, flip: gfxflip, direct: 1, invert:gfxinvert);
-      if (e)
-      {
-         ESP_LOGE (TAG, "gfx %s", e);
-         jo_t j = jo_object_alloc ();
-         jo_string (j, "error", "Failed to start");
-         jo_string (j, "description", e);
-         revk_error ("gfx", &j);
-      }
-      xSemaphoreTake (epd_mutex, portMAX_DELAY);
-      revk_gfx_init (startup);
-      xSemaphoreGive (epd_mutex);
-   }
    if (sdcmd.set)
    {
       revk_gpio_input (sdcd);
@@ -1083,31 +4957,72 @@ app_main ()
          revk_error ("SD", &j);
          card = NULL;
       } else
+      {
          ESP_LOGE (TAG, "SD Mounted");
+         b.pagestale = 1;
+      }
+   }
+   uint8_t restored = 0;        // Showing last frame from before restart, 2 if known to be what the panel showed
+   {
+    const char *e = gfx_init (cs: gfxcs.num, sck: gfxsck.num, mosi: gfxmosi.num, dc: gfxdc.num, rst: gfxrst.num, busy: gfxbusy.num, ena: gfxena.num, flip: gfxflip, direct: 1, invert:gfxinvert);
+      if (e)
+      {
+         ESP_LOGE (TAG, "gfx %s", e);
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "error", "Failed to start");
+         jo_string (j, "description", e);
+         revk_error ("gfx", &j);
+      }
+      epd_lock ();
+      fb_probe ();
+      msg_pin (MSG_WAIT);       // Ready for a bell press before any images are loaded
+      msg_pin (MSG_IDLE);
+      restored = frame_load ();
+      epd_unlock ();
+      if (restored)
+      {                         // Panel already shows this, carry on from it
+         ESP_LOGE (TAG, "Restored last frame");
+      } else
+      {
+         epd_take ();
+         revk_gfx_init (startup);
+         xSemaphoreGive (epd_mutex);
+      }
    }
 
    void flash (void)
    {                            // Random data
       uint32_t r = 0;
       epd_lock ();
-      for (int y = 0; y < gfx_height (); y++)
-         for (int x = 0; x < gfx_width (); x++)
-         {
-            if (!(x & 31))
-               r = esp_random ();
-            gfx_pixel (x, y, (r & 1) ? 255 : 0);
-            r >>= 1;
-         }
-      gfx_refresh ();
+      if (!fb_random (0, 0, gfx_width (), gfx_height ()))
+         for (int y = 0; y < gfx_height (); y++)
+            for (int x = 0; x < gfx_width (); x++)
+            {
+               if (!(x & 31))
+                  r = esp_random ();
+               gfx_pixel (x, y, (r & 1) ? 255 : 0);
+               r >>= 1;
+            }
+      epd_refresh ();
       epd_unlock ();
    }
-   if (gfxflash)
+   if (gfxflash && !restored)
       flash ();
 
    uint32_t lastrefresh = 0;
+   uint32_t memreport = 0;
+   uint32_t lookahead = 60;     // Once settled after boot
+   uint32_t peerannounce = PEERTIME / 2;
+   int64_t busy = esp_timer_get_time ();      // Not counting boot
    while (1)
    {
-      usleep (100000);
+      loop_end ();
+      stats.main_busy_us += esp_timer_get_time () - busy;
+      // Bell press wakes us at once, otherwise poll (once a second when saving power)
+      ulTaskNotifyTake (pdTRUE, pdMS_TO_TICKS (powersave ? 1000 : 100));
+      busy = esp_timer_get_time ();
+      loop_start ();
+      stats.main_loops++;
       time_t now = time (0) + 2;
       struct tm t;
       localtime_r (&now, &t);
@@ -1133,18 +5048,47 @@ app_main ()
             }
          }
       }
+      if (up >= memreport)
+      {                         // Periodic heap report
+         memreport = up + MEMREPORT;
+         jo_t j = jo_object_alloc ();
+         mem_report (j);
+         revk_info ("mem", &j);
+      }
+      if (b.bench && !pushed)
+      {                         // Not whilst bell pushed
+         b.bench = 0;
+         bench (benchmode);
+      }
+      stall_save ();
       if (b.mqttinit)
       {
          ESP_LOGE (TAG, "MQTT Connected");
          b.mqttinit = 0;
          last = -1;
+         if (mqtt_task_id)
+            xTaskNotifyGive (mqtt_task_id);     // Retry now
          tassub (tasaway);
          tassub (tasbusy);
+         for (int s = 0; s < SWITCHES; s++)
+            if (tasswitch[s])
+               tassub (tasswitch[s]);
+         if (imagepeer)
+            lwmqtt_subscribe (revk_mqtt (0), PEERTOPIC "/+/peer");
+         peer_announce ();
+         static uint8_t stallsent = 0;
+         if (!stallsent && stall.count)
+         {                      // Report from before restart
+            stallsent = 1;
+            jo_t j = jo_object_alloc ();
+            stall_json (j);
+            revk_info ("stall", &j);
+         }
       }
       if (b.getimages)
       {                         // Ensure images in cache in advance
          b.getimages = 0;
-         getimage (imageidle);
+         getimage (idle_name ());
          idleo = getimage (imageidleo);
          activeo = getimage (imageactiveo);
          getimage (imagewait);
@@ -1153,6 +5097,33 @@ app_main ()
          if (*tasaway)
             getimage (imageaway);
       }
+      if (now >= schedule_next && now > 1000000000 && schedule_update (now))
+      {                         // Scheduled idle image changed
+         idle = NULL;
+         last = -1;             // Redisplay
+      }
+      if (schedule_prefetch && now >= schedule_prefetch)
+      {                         // Fetch and decode idle image for next transition
+         schedule_prefetch = 0;
+         const char *name = schedule_upcoming ();
+         file_t *i = getimage (name);
+         if (i && !i->json)
+         {
+            epd_take ();
+            rle_build (i, dithermode (name));
+            xSemaphoreGive (epd_mutex);
+         }
+      }
+      if (imagepeer && up >= peerannounce)
+      {                         // Announce again so peers do not time us out
+         peerannounce = up + PEERTIME / 2;
+         peer_announce ();
+      }
+      if (up >= lookahead)
+      {                         // Hourly look ahead for season changes
+         lookahead = up + 3600;
+         prefetch_season (now);
+      }
       if (b.wificonnect)
       {
          b.wificonnect = 0;
@@ -1167,15 +5138,16 @@ app_main ()
          last = 0;
          epd_lock ();
          gfx_clear (0);
-         gfx_message ((char *) overridemsg);
+         msg_draw ((char *) overridemsg);
          *overridemsg = 0;
          addqr (-1);
+         frame_forget ();
          epd_unlock ();
       }
       if (*overridename)
       {                         // Special override
          ESP_LOGE (TAG, "Override: %s", overridename);
-         char *t = strdup (overridename);
+         char *t = mem_strdup (MEM_OTHER, overridename);
          *overridename = 0;
          file_t *i = getimage (t);
          if (i)
@@ -1184,14 +5156,15 @@ app_main ()
                override = up + holdtime;
             last = 0;
             if (*t == '!')
-               gfx_refresh ();
+               epd_refresh ();
             epd_lock ();
             gfx_clear (0);
-            image_load (t, i, 'B', gfx_width () / 2, gfx_height () / 2);
+            image_load (t, i, 'B', gfx_width () / 2, gfx_height () / 2, imageplot);
             addqr (-1);
+            frame_forget ();
             epd_unlock ();
          }
-         free (t);
+         mem_free (MEM_OTHER, t);
       }
       if (override && override < up)
          override = 0;
@@ -1207,39 +5180,47 @@ app_main ()
             {
                if (relay.set)
                   revk_gpio_set (relay, 1);
-               if (*tasbell)
-               {
-                  char *topic = NULL;
-                  asprintf (&topic, "cmnd/%s/POWER", tasbell);
-                  revk_mqtt_send_raw (topic, 0, "ON", 1);
-                  free (topic);
-               }
-               const char *msg = b.tasawaystate ? mqttaway : b.tasbusystate ? mqttbusy : mqttbell;
-               if (*msg)
-                  revk_mqtt_send_str (msg);
-               if (*toot)
+               if (bellsent && bellsent + holdtime > up)
+                  stats.mqtt_dedupe++;  // Redisplay of same press
+               else
                {
-                  char *pl = NULL;
-                  asprintf (&pl, "@%s\nDing dong\n%s\n%4d-%02d-%02d %02d:%02d:%02d", toot, activename, t.tm_year + 1900,
-                            t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
-                  revk_mqtt_send_raw ("toot", 0, pl, 1);
-                  free (pl);
+                  bellsent = up;
+                  if (*tasbell)
+                  {
+                     char *topic = NULL;
+                     mem_asprintf (MEM_MQTT, &topic, "cmnd/%s/POWER", tasbell);
+                     mqtt_queue_send (topic, "ON", up + holdtime);
+                     mem_free (MEM_MQTT, topic);
+                  }
+                  const char *msg = (presence & PRESENCE_AWAY) ? mqttaway : (presence & PRESENCE_BUSY) ? mqttbusy : mqttbell;
+                  if (*msg)
+                     mqtt_queue_send (NULL, msg, up + holdtime);
+                  if (*toot)
+                  {
+                     char *pl = NULL;
+                     mem_asprintf (MEM_MQTT, &pl, "@%s\nDing dong\n%s\n%4d-%02d-%02d %02d:%02d:%02d", toot, activename, t.tm_year + 1900,
+                               t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+                     mqtt_queue_send ("toot", pl, 0); // Has the time in it, so still worth sending late
+                     mem_free (MEM_MQTT, pl);
+                  }
                }
             }
             if (!active)
                active = getimage (activename);
             epd_lock ();
             if (imageflash)
-               gfx_refresh ();
+               epd_refresh ();
             gfx_clear (0);
             if (!active)
-               gfx_message ("/ / / / / / /[11]PLEASE/WAIT");
+               msg_draw (MSG_WAIT);
             else
-               image_load (activename, active, 'B', gfx_width () / 2, gfx_height () / 2);
-            image_load (imageactiveo, activeo, 0, imageactivex, imageactivey);
+               image_load (activename, active, 'B', gfx_width () / 2, gfx_height () / 2, imageplot);
+            image_load (imageactiveo, activeo, 0, imageactivex, imageactivey, imageplot);
             if (last && *activename == '!')
-               gfx_refresh ();
+               epd_refresh ();
             addqr (1);
+            frame_forget ();
+            pushframe = frames + 1;     // This frame
             epd_unlock ();
             if (last && relay.set)
                revk_gpio_set (relay, 0);
@@ -1261,25 +5242,35 @@ app_main ()
                idle = idleo = NULL;     // Changed
          }
          // Update for cache
-         idle = getimage (imageidle);
+         idle = getimage (idle_name ());
          idleo = getimage (imageidleo);
+         if (restored && !idle && *idle_name () && up < FRAMEWAIT)
+            continue;           // Keep showing restored frame until we have the image
+         if (restored == 2 && refresh)
+            lastrefresh = now / refresh;        // Panel is clean, no need for a full refresh yet
+         uint8_t full = (restored == 1);        // Panel may not have matched the restored frame
+         restored = 0;
          if (gfxnight && t.tm_hour >= 2 && t.tm_hour < 4)
             flash ();
          epd_lock ();
          gfx_clear (0);
-         if (!last || (refresh && lastrefresh != now / refresh))
+         if (full || !last || (refresh && lastrefresh != now / refresh))
          {
-            lastrefresh = now / refresh;
-            gfx_refresh ();
+            if (refresh)
+               lastrefresh = now / refresh;
+            epd_refresh ();
          }
          last = now / UPDATERATE;
          if (!idle)
-            gfx_message ("/ / /[10]CANWCH/Y GLOCH/ / /RING/THE/BELL");
+            msg_draw (MSG_IDLE);
          else
-            image_load (imageidle, idle, 'K', gfx_width () / 2, gfx_height () / 2);
-         image_load (imageidleo, idleo, 0, imageidlex, imageidley);
+            image_load (idle_name (), idle, 'K', gfx_width () / 2, gfx_height () / 2, imageplot);
+         image_load (imageidleo, idleo, 0, imageidlex, imageidley, imageplot);
          addqr (0);
          epd_unlock ();
+         epd_take ();
+         frame_save (idle, idleo);
+         xSemaphoreGive (epd_mutex);
       }
    }
 }